@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* a microbenchmark of the response pipeline: writer_func() deblocking,
+ * data_blob() and tuple_make() parsing and filtering, the presenters,
+ * and the sort, run in process over synthetic records, for every verb,
+ * presentation, and sort order. no API key or network is needed; output
+ * goes to /dev/null. built and run by "make bench".
+ *
+ * with -D, only the record boundary scanners of deblock.c are timed, each
+ * against the others, for synthetic records and for lines of several
+ * average lengths.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "deblock.h"
+#include "netio.h"
+#include "pdns.h"
+#include "render.h"
+#include "sort.h"
+#define MAIN_PROGRAM
+#include "globals.h"
+#undef MAIN_PROGRAM
+
+#define	BENCH_RECORDS 200000
+#define	BENCH_REPEAT 3
+#define	BENCH_CHUNK 16384	// what libcurl hands writer_func() at most
+
+/* Forward. */
+
+static void bench_usage(void);
+static void bench_deblock(u_long, int);
+static char *bench_lines(size_t, size_t, size_t *);
+static double bench_scan(deblock_t, const char *, size_t, u_long *);
+static char *bench_generate(bool, u_long, size_t *);
+static void bench_lookup(obuf_t);
+static void bench_summarize(obuf_t);
+static void bench_name(obuf_t, int, const char *);
+static void bench_domain(char *, size_t);
+static void bench_rdata(obuf_t, const char *);
+static void bench_times(obuf_t);
+static double bench_run(verb_ct, present_e, sort_e, const char *, size_t);
+static double bench_now(void);
+static uint64_t bench_random(void);
+static u_long bench_below(u_long);
+
+/* Private. */
+
+static const struct verb bench_verbs[] = {
+	{ "lookup", "/lookup", NULL,
+	  present_text_lookup, present_json, present_csv_lookup },
+	{ "summarize", "/summarize", NULL,
+	  present_text_summarize, present_json, present_csv_summarize },
+	{ NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+static const char * const pres_names[] = { "text", "json", "csv" };
+static const char * const sort_names[] = { "none", "-s", "-S" };
+
+/* the mix of types a passive DNS result tends to have, in percent. */
+static const struct {
+	const char	*rrtype;
+	u_long		percent;
+} bench_types[] = {
+	{ "A", 45 }, { "AAAA", 15 }, { "CNAME", 10 }, { "NS", 8 },
+	{ "MX", 6 }, { "TXT", 6 }, { "PTR", 4 }, { "SOA", 3 }, { "SRV", 3 },
+};
+
+static const char * const bench_tlds[] = {
+	"com", "net", "org", "de", "uk", "ru", "info", "io", "co.uk", "jp"
+};
+
+static uint64_t bench_state = 0x9e3779b97f4a7c15ULL;
+
+/* Public. */
+
+int
+main(int argc, char *argv[]) {
+	u_long records = BENCH_RECORDS, seed = 0;
+	int repeat = BENCH_REPEAT, ch, fd;
+	const char *generate = NULL;
+	bool deblock = false;
+	verb_ct v;
+	char *value;
+
+	program_name = "dnsdbq-bench";
+	while ((ch = getopt(argc, argv, "Dg:n:r:S:")) != -1) {
+		switch (ch) {
+		case 'D':
+			deblock = true;
+			break;
+		case 'g':
+			generate = optarg;
+			break;
+		case 'n':
+			records = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			repeat = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			bench_usage();
+		}
+	}
+	if (argc != optind || records == 0 || repeat <= 0)
+		bench_usage();
+	if (seed != 0)
+		bench_state = seed;
+
+	/* -g just writes out the records, for use elsewhere. */
+	if (generate != NULL) {
+		size_t len;
+		char *buf;
+
+		for (v = bench_verbs; v->name != NULL; v++)
+			if (strcmp(v->name, generate) == 0)
+				break;
+		if (v->name == NULL)
+			bench_usage();
+		buf = bench_generate(v->text == present_text_summarize,
+				     records, &len);
+		fwrite(buf, 1, len, stdout);
+		DESTROY(buf);
+		return (0);
+	}
+	if (deblock) {
+		bench_deblock(records, repeat);
+		return (0);
+	}
+
+	value = getenv(env_workers);
+	if (value != NULL)
+		render_workers = strtol(value, NULL, 10);
+	if ((fd = open("/dev/null", O_WRONLY)) < 0)
+		my_panic(true, "/dev/null");
+	stdout_obuf.fd = fd;
+	sort_ready();
+
+	printf("%-10s %-5s %-5s %10s %12s %10s\n",
+	       "verb", "pres", "sort", "records", "records/s", "MB/s");
+	for (v = bench_verbs; v->name != NULL; v++) {
+		bool summ = v->text == present_text_summarize;
+		size_t len;
+		char *buf = bench_generate(summ, records, &len);
+		int p, s;
+
+		for (p = pres_text; p <= pres_csv; p++)
+			for (s = no_sort; s <= reverse_sort; s++) {
+				double best = 0.0;
+				int r;
+
+				/* as dnsdbq itself refuses to. */
+				if (summ && s != no_sort)
+					continue;
+				for (r = 0; r < repeat; r++) {
+					double secs = bench_run(v,
+						(present_e)p, (sort_e)s,
+						buf, len);
+
+					if (r == 0 || secs < best)
+						best = secs;
+				}
+				printf("%-10s %-5s %-5s %10lu %12.0f %10.1f\n",
+				       v->name, pres_names[p], sort_names[s],
+				       records, (double)records / best,
+				       (double)len / best / 1e6);
+				fflush(stdout);
+			}
+		DESTROY(buf);
+	}
+
+	unmake_writers();
+	render_fini();
+	obuf_fini(&stdout_obuf);
+	sort_destroy();
+	close(fd);
+	return (0);
+}
+
+/* debug -- at the moment, dump to stderr.
+ */
+void
+debug(bool want_header, const char *fmtstr, ...) {
+	va_list ap;
+
+	va_start(ap, fmtstr);
+	if (want_header)
+		fputs("debug: ", stderr);
+	vfprintf(stderr, fmtstr, ap);
+	va_end(ap);
+}
+
+/* my_exit -- nothing to tidy up that the process exit won't.
+ */
+__attribute__((noreturn)) void
+my_exit(int code) {
+	exit(code);
+}
+
+/* my_panic -- display an error on diagnostic output stream, exit ungracefully
+ */
+__attribute__((noreturn)) void
+my_panic(bool want_perror, const char *s) {
+	fprintf(stderr, "%s: ", program_name);
+	if (want_perror)
+		perror(s);
+	else
+		fprintf(stderr, "%s\n", s);
+	my_exit(1);
+}
+
+/* or_else -- return one pointer or else the other. */
+const char *
+or_else(const char *p, const char *or_else) {
+	if (p != NULL)
+		return p;
+	return or_else;
+}
+
+/* Private. */
+
+/* bench_usage -- say how to run this, and exit.
+ */
+static __attribute__((noreturn)) void
+bench_usage(void) {
+	fprintf(stderr, "usage: %s [-D] [-n records] [-r repeat] [-S seed] "
+		"[-g lookup|summarize]\n", program_name);
+	exit(1);
+}
+
+/* bench_deblock -- time each record boundary scanner this CPU can run,
+ * over synthetic lookup records, and over as many octets of lines whose
+ * lengths average 40, 200, and 1000.
+ *
+ * the scanners take turns within each repetition, so that none of them is
+ * favoured by running when the machine happens to be quieter.
+ */
+static void
+bench_deblock(u_long records, int repeat) {
+	static const size_t avgs[] = { 0, 40, 200, 1000 };
+	const struct deblock_scanner *scanners = deblock_scanners();
+	double best[8];
+	size_t len, a, ns;
+	char *lookup = bench_generate(false, records, &len);
+
+	for (ns = 0; scanners[ns].name != NULL; ns++)
+		assert(ns < sizeof best / sizeof best[0]);
+	printf("%-8s %10s %10s %-8s %10s\n",
+	       "records", "lines", "avg len", "scanner", "MB/s");
+	for (a = 0; a < sizeof avgs / sizeof avgs[0]; a++) {
+		size_t blen, i;
+		char *buf = avgs[a] == 0 ? lookup
+			: bench_lines(avgs[a], len, &blen);
+		u_long lines = 0;
+		int r;
+
+		if (avgs[a] == 0)
+			blen = len;
+		for (r = 0; r < repeat; r++)
+			for (i = 0; i < ns; i++) {
+				u_long found = 0;
+				double secs = bench_scan(scanners[i].scan,
+							 buf, blen, &found);
+
+				if (r == 0 || secs < best[i])
+					best[i] = secs;
+				/* every scanner must find the same records. */
+				if (lines == 0)
+					lines = found;
+				else if (found != lines)
+					my_panic(false, "scanners disagree");
+			}
+		for (i = 0; i < ns; i++)
+			printf("%-8s %10lu %10.0f %-8s %10.1f\n",
+			       avgs[a] == 0 ? "lookup" : "lines", lines,
+			       (double)blen / (double)lines, scanners[i].name,
+			       (double)blen / best[i] / 1e6);
+		fflush(stdout);
+		if (buf != lookup)
+			DESTROY(buf);
+	}
+	DESTROY(lookup);
+}
+
+/* bench_lines -- make lines of printable octets, of lengths spread evenly
+ * from half to half again the given average, until there are "total"
+ * octets or just more.
+ *
+ * Returns a buffer of *lenp octets that must be free()d.
+ */
+static char *
+bench_lines(size_t avg, size_t total, size_t *lenp) {
+	struct obuf ob;
+
+	obuf_init(&ob, -1);
+	while (ob.len < total) {
+		size_t n = avg / 2 + (size_t)bench_below((u_long)avg + 1), i;
+
+		obuf_room(&ob, n + 1);
+		for (i = 0; i < n; i++)
+			ob.base[ob.len++] = (char)('a' + bench_below(26));
+		obuf_putc(&ob, '\n');
+	}
+	return (obuf_take(&ob, lenp));
+}
+
+/* bench_scan -- deblock a buffer in the pieces libcurl would hand to
+ * writer_func(), as writer_func() does, counting the lines found.
+ *
+ * Returns the time taken, in seconds.
+ */
+static double
+bench_scan(deblock_t scan, const char *buf, size_t len, u_long *lines) {
+	struct slice slices[MAX_SLICES];
+	size_t off = 0, end = 0;
+	double start;
+
+	*lines = 0;
+	start = bench_now();
+	while (end < len) {
+		size_t used, n;
+
+		/* a partial line is carried over into the next piece. */
+		end = len - end < BENCH_CHUNK ? len : end + BENCH_CHUNK;
+		do {
+			n = scan(buf + off, end - off, slices, MAX_SLICES,
+				 &used);
+			off += used;
+			*lines += n;
+		} while (n == MAX_SLICES);
+	}
+	return (bench_now() - start);
+}
+
+/* bench_generate -- make some synthetic records, as newline-separated
+ * JSON just as the API would send them.
+ *
+ * Returns a buffer of *lenp octets that must be free()d.
+ */
+static char *
+bench_generate(bool summarize, u_long records, size_t *lenp) {
+	struct obuf ob;
+	u_long i;
+
+	obuf_init(&ob, -1);
+	for (i = 0; i < records; i++) {
+		if (summarize)
+			bench_summarize(&ob);
+		else
+			bench_lookup(&ob);
+		obuf_putc(&ob, '\n');
+	}
+	return (obuf_take(&ob, lenp));
+}
+
+/* bench_lookup -- generate one lookup record.
+ */
+static void
+bench_lookup(obuf_t ob) {
+	const char *rrtype = bench_types[0].rrtype;
+	u_long pick = bench_below(100), sum = 0, n, i;
+	char domain[64];
+	size_t t;
+
+	for (t = 0; t < sizeof bench_types / sizeof bench_types[0]; t++) {
+		sum += bench_types[t].percent;
+		if (pick < sum) {
+			rrtype = bench_types[t].rrtype;
+			break;
+		}
+	}
+
+	/* counts are mostly small, with a long tail. */
+	obuf_printf(ob, "{\"count\":%lu,",
+		    1 + (bench_random() % 1000) * (bench_random() % 1000) /
+		    (1 + bench_below(100)));
+	bench_times(ob);
+	bench_domain(domain, sizeof domain);
+	obuf_puts(ob, ",\"rrname\":\"");
+	bench_name(ob, (int)bench_below(4), domain);
+	obuf_printf(ob, "\",\"rrtype\":\"%s\",\"bailiwick\":\"%s\","
+		    "\"rdata\":[", rrtype, domain);
+
+	/* address and name server sets are often several; others not. */
+	n = 1;
+	if (strcmp(rrtype, "A") == 0 || strcmp(rrtype, "AAAA") == 0 ||
+	    strcmp(rrtype, "NS") == 0 || strcmp(rrtype, "MX") == 0)
+		n += bench_below(4);
+	for (i = 0; i < n; i++) {
+		if (i != 0)
+			obuf_putc(ob, ',');
+		obuf_putc(ob, '"');
+		bench_rdata(ob, rrtype);
+		obuf_putc(ob, '"');
+	}
+	obuf_puts(ob, "]}");
+}
+
+/* bench_summarize -- generate one summarize record.
+ */
+static void
+bench_summarize(obuf_t ob) {
+	obuf_printf(ob, "{\"count\":%lu,\"num_results\":%lu,",
+		    1 + bench_below(10000000), 1 + bench_below(100000));
+	bench_times(ob);
+	obuf_putc(ob, '}');
+}
+
+/* bench_name -- generate a domain name having this many labels in front
+ * of a registered domain, or of a random one if that is NULL.
+ *
+ * label lengths cluster around eight, as real ones do, with some short
+ * ("www", "mail") and some long (CDN and tracking labels).
+ */
+static void
+bench_name(obuf_t ob, int labels, const char *domain) {
+	static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	char random[64];
+	int l;
+
+	for (l = 0; l < labels; l++) {
+		u_long len, i;
+
+		switch (bench_below(4)) {
+		case 0:
+			obuf_puts(ob, l == labels - 1 ? "www." : "mail.");
+			continue;
+		case 1:
+			len = 16 + bench_below(48);
+			break;
+		default:
+			len = 3 + bench_below(10);
+			break;
+		}
+		for (i = 0; i < len; i++)
+			obuf_putc(ob, alnum[bench_below(sizeof alnum - 1)]);
+		obuf_putc(ob, '.');
+	}
+	if (domain == NULL) {
+		bench_domain(random, sizeof random);
+		domain = random;
+	}
+	obuf_puts(ob, domain);
+}
+
+/* bench_domain -- generate a registered domain, with a trailing dot.
+ *
+ * these are drawn from a small population, so that names sort and
+ * compare into realistic runs.
+ */
+static void
+bench_domain(char *buf, size_t size) {
+	snprintf(buf, size, "example%lu.%s.", bench_below(5000),
+		 bench_tlds[bench_below(sizeof bench_tlds /
+					sizeof bench_tlds[0])]);
+}
+
+/* bench_rdata -- generate one rdata value of the given type.
+ */
+static void
+bench_rdata(obuf_t ob, const char *rrtype) {
+	if (strcmp(rrtype, "A") == 0) {
+		obuf_printf(ob, "%lu.%lu.%lu.%lu", 1 + bench_below(223),
+			    bench_below(256), bench_below(256),
+			    bench_below(256));
+	} else if (strcmp(rrtype, "AAAA") == 0) {
+		obuf_printf(ob, "2001:db8:%lx:%lx::%lx", bench_below(65536),
+			    bench_below(65536), bench_below(65536));
+	} else if (strcmp(rrtype, "MX") == 0) {
+		obuf_printf(ob, "%lu ", 10 * bench_below(5));
+		bench_name(ob, 1, NULL);
+	} else if (strcmp(rrtype, "TXT") == 0) {
+		obuf_printf(ob, "\\\"v=spf1 ip4:192.0.2.%lu "
+			    "include:_spf.example.com ~all\\\"",
+			    bench_below(256));
+	} else if (strcmp(rrtype, "SOA") == 0) {
+		bench_name(ob, 1, NULL);
+		obuf_putc(ob, ' ');
+		bench_name(ob, 1, NULL);
+		obuf_printf(ob, " %lu 7200 3600 1209600 300",
+			    2020000000 + bench_below(5000000));
+	} else if (strcmp(rrtype, "SRV") == 0) {
+		obuf_printf(ob, "0 5 %lu ", 1 + bench_below(65535));
+		bench_name(ob, 1, NULL);
+	} else {
+		bench_name(ob, (int)bench_below(3), NULL);
+	}
+}
+
+/* bench_times -- generate the first and last times of a record. most
+ * come from passive sensors, and some from zone files.
+ */
+static void
+bench_times(obuf_t ob) {
+	u_long first = 1262304000 + bench_below(15 * 365 * 86400),
+		last = first + bench_below(5 * 365 * 86400);
+
+	if (bench_below(100) < 15)
+		obuf_printf(ob, "\"zone_time_first\":%lu,"
+			    "\"zone_time_last\":%lu", first, last);
+	else
+		obuf_printf(ob, "\"time_first\":%lu,\"time_last\":%lu",
+			    first, last);
+}
+
+/* bench_run -- push one buffer of records through the pipeline, as one
+ * query's response would be, with the given verb, presentation and sort.
+ *
+ * Returns the time taken, in seconds.
+ */
+static double
+bench_run(verb_ct v, present_e pres, sort_e sort, const char *buf, size_t len)
+{
+	double start;
+	writer_t writer;
+	query_t query = NULL;
+	fetch_t fetch = NULL;
+	size_t off, n;
+
+	presentation = pres;
+	sorting = sort;
+	pverb = v;
+	switch (pres) {
+	case pres_text:
+		presenter = v->text;
+		break;
+	case pres_json:
+		presenter = v->json;
+		break;
+	case pres_csv:
+		presenter = v->csv;
+		break;
+	default:
+		abort();
+	}
+
+	/* a query with one fetch, as from a file (there's no easy). */
+	writer = writer_init(-1);
+	CREATE(query, sizeof(struct query));
+	query->writer = writer;
+	query->params = qparam_empty;
+	query->command = strdup("bench");
+	writer->queries = query;
+	CREATE(fetch, sizeof(struct fetch));
+	fetch->query = query;
+	fetch->url = strdup("bench");
+	fetch->render = render_wanted(writer);
+	query->fetches = fetch;
+
+	start = bench_now();
+	for (off = 0; off < len; off += n) {
+		n = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+		/* writer_func() takes a mutable buffer, but doesn't write. */
+		if (writer_func((char *)(uintptr_t)(buf + off),
+				1, n, fetch) != n)
+			my_panic(false, "writer_func() stopped");
+	}
+	writer_fini(writer);
+	obuf_flush(&stdout_obuf);
+	return (bench_now() - start);
+}
+
+/* bench_now -- seconds on a clock which never goes backward.
+ */
+static double
+bench_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
+
+/* bench_random -- xorshift64*, for records which are the same each run.
+ */
+static uint64_t
+bench_random(void) {
+	bench_state ^= bench_state >> 12;
+	bench_state ^= bench_state << 25;
+	bench_state ^= bench_state >> 27;
+	return (bench_state * 0x2545f4914f6cdd1dULL);
+}
+
+/* bench_below -- a random number from zero to one less than the limit.
+ */
+static u_long
+bench_below(u_long limit) {
+	return ((u_long)(bench_random() % limit));
+}
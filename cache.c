@@ -0,0 +1,573 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* a local cache of API responses, so that a lookup repeated within the
+ * cache's lifetime costs neither quota nor a round trip. each response
+ * is one file, named by a hash of the URL which fetched it; the URL is
+ * the canonical form of the query (the path from makepath(), plus its
+ * fence and limit parameters) and never carries the API key, which goes
+ * in a header. a file's first line records when it was fetched and the
+ * whole URL, and the rest is the response body, exactly as it came.
+ * a file's mtime is when it was last used, for LRU eviction.
+ *
+ * lookups which found nothing (a 404, which the system calls NOERROR) are
+ * far more common than those which found something, and have no body worth
+ * keeping, so they are remembered separately: a hash set of URL hashes,
+ * when each was fetched, and which message its response gave (the first
+ * line of the body, which becomes the query's status message, and of
+ * which there are only ever a few distinct ones), loaded whole at startup
+ * from one small file and written back at exit.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "cache.h"
+#include "globals.h"
+
+#define	CACHE_MAGIC "dnsdbq-cache 1"
+#define	CACHE_NAME_LEN 16	// hex digits of the URL's hash
+#define	CACHE_NEGATIVE "negative"
+#define	NEG_MAGIC "dnsdbq-negative 2\n"
+
+/* one remembered empty lookup; this is also its form in the file, which
+ * has the messages (a count, and then one per line) before the entries.
+ */
+struct neg_entry {
+	uint64_t	hash;		// of the URL; zero marks an empty slot
+	uint32_t	when;		// when it was fetched
+	uint32_t	message;	// its index in neg_messages, plus one
+} __attribute__((packed));
+
+/* a response being written to the cache as it arrives. */
+struct cache_fill {
+	FILE		*f;		// NULL if a write failed
+	char		*temp;		// renamed to path when complete
+	char		*path;
+};
+
+/* one file in the cache directory, as seen by cache_trim(). */
+struct cache_file {
+	char		*name;
+	time_t		used;
+	off_t		size;
+};
+
+static uint64_t cache_hash(const char *);
+static char *cache_path(const char *);
+static void neg_load(void);
+static void neg_save(void);
+static void neg_insert(uint64_t, uint32_t, uint32_t);
+static uint32_t neg_message(const char *);
+static size_t neg_slot(uint64_t);
+static bool cache_mkdir(const char *);
+static void cache_trim(void);
+static int cache_file_cmp(const void *, const void *);
+
+static u_long stat_hits = 0, stat_misses = 0, stat_stored = 0;
+static u_long stat_neg_hits = 0, stat_neg_stored = 0;
+
+/* the negative set, open addressed with linear probing. */
+static struct neg_entry *neg_set = NULL;
+static size_t neg_mask = 0, neg_count = 0;
+static char **neg_messages = NULL;
+static size_t neg_nmessages = 0;
+
+/* cache_ready -- find (or make) the cache directory.
+ *
+ * Returns NULL if no error, otherwise a static error message.
+ */
+const char *
+cache_ready(void) {
+	if (cache_dir == NULL) {
+		const char *home = getenv("HOME");
+
+		if (home == NULL)
+			return ("the cache needs DNSDBQ_CACHE_DIR or HOME");
+		if (asprintf(&cache_dir, "%s/.cache/dnsdbq", home) < 0)
+			my_panic(true, "asprintf");
+	}
+	if (!cache_mkdir(cache_dir))
+		return ("cannot create the cache directory");
+	neg_load();
+	DEBUG(1, true, "cache: %s, ttl %lu, size %zu, %zu negative\n",
+	      cache_dir, cache_ttl, cache_size, neg_count);
+	return (NULL);
+}
+
+/* cache_lookup -- find a fresh cached response to a URL.
+ *
+ * Returns the cache file, positioned at the start of the response body,
+ * or NULL if there is no fresh response. an expired one is removed.
+ */
+FILE *
+cache_lookup(const char *url) {
+	char *path = cache_path(url), *line = NULL;
+	size_t size = 0;
+	u_long fetched;
+	ssize_t len;
+	int used;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		goto miss;
+	len = getline(&line, &size, f);
+	if (len <= 0 || line[len - 1] != '\n' ||
+	    sscanf(line, CACHE_MAGIC " %lu %n", &fetched, &used) != 1)
+		goto miss;
+	line[len - 1] = '\0';
+	if (strcmp(line + used, url) != 0) {
+		/* a hash collision; leave the other URL's response be. */
+		DEBUG(2, true, "cache: collision %s\n", path);
+		goto miss;
+	}
+	if ((u_long)time(NULL) - fetched > cache_ttl) {
+		DEBUG(2, true, "cache: expired %s\n", path);
+		(void) unlink(path);
+		goto miss;
+	}
+
+	/* note its use, for the LRU. */
+	(void) futimens(fileno(f), NULL);
+	DEBUG(2, true, "cache: hit %s\n", path);
+	stat_hits++;
+	DESTROY(line);
+	DESTROY(path);
+	return (f);
+
+ miss:
+	stat_misses++;
+	if (f != NULL)
+		fclose(f);
+	DESTROY(line);
+	DESTROY(path);
+	return (NULL);
+}
+
+/* cache_negative -- was this URL recently found to have no results?
+ *
+ * Returns the message its response gave, or NULL if it isn't known to
+ * have had no results.
+ */
+const char *
+cache_negative(const char *url) {
+	uint64_t h = cache_hash(url);
+	size_t slot;
+
+	if (neg_set == NULL)
+		return (NULL);
+	slot = neg_slot(h);
+	if (neg_set[slot].hash == 0 ||
+	    (u_long)time(NULL) - neg_set[slot].when > cache_neg_ttl)
+		return (NULL);
+	DEBUG(2, true, "cache: negative hit %016" PRIx64 "\n", h);
+	stat_neg_hits++;
+	return (neg_messages[neg_set[slot].message - 1]);
+}
+
+/* cache_negative_add -- remember that this URL had no results, and the
+ * message its response gave.
+ */
+void
+cache_negative_add(const char *url, const char *message) {
+	neg_insert(cache_hash(url), (uint32_t)time(NULL),
+		   neg_message(message));
+	stat_neg_stored++;
+}
+
+/* cache_fill_start -- begin caching the response to a URL.
+ *
+ * Returns NULL if the cache cannot be written, which is not an error.
+ */
+cache_fill_t
+cache_fill_start(const char *url) {
+	cache_fill_t fill = NULL;
+	int fd;
+
+	CREATE(fill, sizeof *fill);
+	if (asprintf(&fill->temp, "%s/tmp.XXXXXX", cache_dir) < 0)
+		my_panic(true, "asprintf");
+	if ((fd = mkstemp(fill->temp)) < 0 ||
+	    (fill->f = fdopen(fd, "w")) == NULL)
+	{
+		DEBUG(1, true, "cache: %s: %s\n",
+		      fill->temp, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			(void) unlink(fill->temp);
+		}
+		DESTROY(fill->temp);
+		DESTROY(fill);
+		return (NULL);
+	}
+	fill->path = cache_path(url);
+	fprintf(fill->f, CACHE_MAGIC " %lu %s\n", (u_long)time(NULL), url);
+	return (fill);
+}
+
+/* cache_fill -- add some of the response body to a cache fill.
+ */
+void
+cache_fill(cache_fill_t fill, const char *ptr, size_t len) {
+	if (fill->f != NULL && fwrite(ptr, 1, len, fill->f) != len) {
+		DEBUG(1, true, "cache: %s: %s\n",
+		      fill->temp, strerror(errno));
+		fclose(fill->f);
+		fill->f = NULL;
+	}
+}
+
+/* cache_fill_end -- finish a cache fill, keeping it only if the response
+ * was complete and good, and it could all be written.
+ */
+void
+cache_fill_end(cache_fill_t fill, bool keep) {
+	if (fill->f != NULL) {
+		if (fclose(fill->f) != 0)
+			keep = false;
+		fill->f = NULL;
+	} else {
+		keep = false;
+	}
+	if (keep && rename(fill->temp, fill->path) == 0) {
+		DEBUG(2, true, "cache: stored %s\n", fill->path);
+		stat_stored++;
+	} else {
+		(void) unlink(fill->temp);
+	}
+	DESTROY(fill->temp);
+	DESTROY(fill->path);
+	DESTROY(fill);
+}
+
+/* cache_fini -- report, bring the cache back within its size, and close.
+ */
+void
+cache_fini(void) {
+	size_t i;
+
+	if (stat_hits + stat_misses + stat_neg_hits != 0)
+		DEBUG(1, true, "cache: %lu hits, %lu misses, %lu stored; "
+		      "%lu fetches saved by %lu negative hits, "
+		      "%lu negative stored\n",
+		      stat_hits, stat_misses, stat_stored,
+		      stat_hits + stat_neg_hits, stat_neg_hits,
+		      stat_neg_stored);
+	if (stat_stored != 0)
+		cache_trim();
+	if (stat_neg_stored != 0)
+		neg_save();
+	stat_hits = stat_misses = stat_stored = 0;
+	stat_neg_hits = stat_neg_stored = 0;
+	DESTROY(neg_set);
+	neg_mask = neg_count = 0;
+	for (i = 0; i < neg_nmessages; i++)
+		DESTROY(neg_messages[i]);
+	DESTROY(neg_messages);
+	neg_nmessages = 0;
+	DESTROY(cache_dir);
+}
+
+/* cache_hash -- FNV-1a over a URL; never zero.
+ */
+static uint64_t
+cache_hash(const char *url) {
+	uint64_t h = 14695981039346656037ULL;
+	const u_char *p;
+
+	for (p = (const u_char *)url; *p != '\0'; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+	return (h != 0 ? h : 1);
+}
+
+/* cache_path -- return the (heap allocated) cache file name for a URL.
+ */
+static char *
+cache_path(const char *url) {
+	char *path = NULL;
+
+	if (asprintf(&path, "%s/%0*" PRIx64,
+		     cache_dir, CACHE_NAME_LEN, cache_hash(url)) < 0)
+		my_panic(true, "asprintf");
+	return (path);
+}
+
+/* neg_load -- add the still fresh entries of the negative file to the set.
+ *
+ * this is done at startup, and again just before saving, so that entries
+ * added meanwhile by another run are not lost.
+ */
+static void
+neg_load(void) {
+	char magic[sizeof NEG_MAGIC - 1], *path = NULL, *line = NULL;
+	u_long now = (u_long)time(NULL);
+	uint32_t *ids = NULL;
+	size_t n = 0, i, count = 0;
+	struct neg_entry e;
+	ssize_t len;
+	FILE *f;
+
+	if (asprintf(&path, "%s/" CACHE_NEGATIVE, cache_dir) < 0)
+		my_panic(true, "asprintf");
+	f = fopen(path, "r");
+	DESTROY(path);
+	if (f == NULL)
+		return;
+	if (fread(magic, sizeof magic, 1, f) != 1 ||
+	    memcmp(magic, NEG_MAGIC, sizeof magic) != 0 ||
+	    fscanf(f, "%zu\n", &count) != 1)
+		goto done;
+
+	/* the file's messages, renumbered as ours. */
+	CREATE(ids, (count + 1) * sizeof *ids);
+	for (i = 0; i < count; i++) {
+		if ((len = getline(&line, &n, f)) <= 0 ||
+		    line[len - 1] != '\n')
+			goto done;
+		line[len - 1] = '\0';
+		ids[i] = neg_message(line);
+	}
+	while (fread(&e, sizeof e, 1, f) == 1)
+		if (e.hash != 0 && now - e.when <= cache_neg_ttl &&
+		    e.message >= 1 && e.message <= count)
+			neg_insert(e.hash, e.when, ids[e.message - 1]);
+ done:
+	DESTROY(line);
+	DESTROY(ids);
+	fclose(f);
+}
+
+/* neg_save -- write the fresh entries of the negative set back out.
+ */
+static void
+neg_save(void) {
+	char *path = NULL, *temp = NULL;
+	u_long now = (u_long)time(NULL);
+	size_t i;
+	bool ok;
+	FILE *f;
+	int fd;
+
+	neg_load();
+	if (asprintf(&path, "%s/" CACHE_NEGATIVE, cache_dir) < 0 ||
+	    asprintf(&temp, "%s/tmp.XXXXXX", cache_dir) < 0)
+		my_panic(true, "asprintf");
+	if ((fd = mkstemp(temp)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+		DEBUG(1, true, "cache: %s: %s\n", temp, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			(void) unlink(temp);
+		}
+		goto done;
+	}
+	fputs(NEG_MAGIC, f);
+	fprintf(f, "%zu\n", neg_nmessages);
+	for (i = 0; i < neg_nmessages; i++)
+		fprintf(f, "%s\n", neg_messages[i]);
+	for (i = 0; i <= neg_mask; i++)
+		if (neg_set[i].hash != 0 &&
+		    now - neg_set[i].when <= cache_neg_ttl)
+			fwrite(&neg_set[i], sizeof neg_set[i], 1, f);
+	ok = ferror(f) == 0;
+	if (fclose(f) != 0 || !ok || rename(temp, path) < 0) {
+		DEBUG(1, true, "cache: %s: %s\n", path, strerror(errno));
+		(void) unlink(temp);
+	}
+ done:
+	DESTROY(temp);
+	DESTROY(path);
+}
+
+/* neg_insert -- add a URL hash to the negative set, or freshen it.
+ */
+static void
+neg_insert(uint64_t hash, uint32_t when, uint32_t message) {
+	size_t slot;
+
+	/* keep the load at or below one half. */
+	if (2 * (neg_count + 1) > neg_mask + 1 || neg_set == NULL) {
+		struct neg_entry *old = neg_set;
+		size_t i, old_size = old == NULL ? 0 : neg_mask + 1;
+
+		neg_mask = old_size == 0 ? 1023 : 2 * old_size - 1;
+		neg_set = NULL;
+		CREATE(neg_set, (neg_mask + 1) * sizeof *neg_set);
+		neg_count = 0;
+		for (i = 0; i < old_size; i++)
+			if (old[i].hash != 0)
+				neg_insert(old[i].hash, old[i].when,
+					   old[i].message);
+		DESTROY(old);
+	}
+	slot = neg_slot(hash);
+	if (neg_set[slot].hash == 0) {
+		neg_set[slot].hash = hash;
+		neg_count++;
+	}
+	if (when >= neg_set[slot].when) {
+		neg_set[slot].when = when;
+		neg_set[slot].message = message;
+	}
+}
+
+/* neg_message -- find or add a negative response's message.
+ *
+ * Returns its index in neg_messages, plus one.
+ */
+static uint32_t
+neg_message(const char *message) {
+	size_t i;
+
+	for (i = 0; i < neg_nmessages; i++)
+		if (strcmp(neg_messages[i], message) == 0)
+			return ((uint32_t)i + 1);
+	neg_messages = realloc(neg_messages,
+			       (neg_nmessages + 1) * sizeof *neg_messages);
+	if (neg_messages == NULL)
+		my_panic(true, "realloc");
+	neg_messages[neg_nmessages++] = strdup(message);
+	return ((uint32_t)neg_nmessages);
+}
+
+/* neg_slot -- find where a hash is, or would go, in the negative set.
+ */
+static size_t
+neg_slot(uint64_t hash) {
+	size_t i = (size_t)hash & neg_mask;
+
+	while (neg_set[i].hash != 0 && neg_set[i].hash != hash)
+		i = (i + 1) & neg_mask;
+	return (i);
+}
+
+/* cache_mkdir -- make a directory and any missing parents, like mkdir -p.
+ */
+static bool
+cache_mkdir(const char *dir) {
+	char *path = strdup(dir), *p;
+	bool ok = true;
+
+	for (p = path + 1; ok; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		char save = *p;
+		*p = '\0';
+		if (mkdir(path, 0700) < 0 && errno != EEXIST)
+			ok = false;
+		*p = save;
+		if (save == '\0')
+			break;
+	}
+	DESTROY(path);
+	return (ok);
+}
+
+/* cache_trim -- drop responses unused for longer than their lifetime,
+ * then the least recently used, until the cache fits its size limit.
+ *
+ * only done after a run that stored something, since it reads the
+ * whole directory. abandoned fills are cleaned up here as well.
+ */
+static void
+cache_trim(void) {
+	struct cache_file *files = NULL;
+	size_t nfiles = 0, maxfiles = 0, i, dropped = 0;
+	time_t now = time(NULL);
+	off_t total = 0;
+	struct dirent *de;
+	DIR *dir;
+
+	if ((dir = opendir(cache_dir)) == NULL)
+		return;
+	while ((de = readdir(dir)) != NULL) {
+		struct stat sb;
+		char *path = NULL;
+
+		if (strlen(de->d_name) != CACHE_NAME_LEN &&
+		    strncmp(de->d_name, "tmp.", 4) != 0)
+			continue;
+		if (asprintf(&path, "%s/%s", cache_dir, de->d_name) < 0)
+			my_panic(true, "asprintf");
+		if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+			DESTROY(path);
+			continue;
+		}
+		/* last used before its fetch could still be fresh? */
+		if ((u_long)(now - sb.st_mtime) > cache_ttl) {
+			(void) unlink(path);
+			DESTROY(path);
+			dropped++;
+			continue;
+		}
+		DESTROY(path);
+		/* a fill in progress is counted, but not evicted. */
+		total += sb.st_size;
+		if (de->d_name[0] == 't')
+			continue;
+		if (nfiles == maxfiles) {
+			maxfiles = maxfiles == 0 ? 64 : maxfiles * 2;
+			files = realloc(files, maxfiles * sizeof *files);
+			if (files == NULL)
+				my_panic(true, "realloc");
+		}
+		files[nfiles++] = (struct cache_file){
+			strdup(de->d_name), sb.st_mtime, sb.st_size
+		};
+	}
+	closedir(dir);
+
+	qsort(files, nfiles, sizeof *files, cache_file_cmp);
+	for (i = 0; i < nfiles; i++) {
+		if ((size_t)total > cache_size) {
+			char *path = NULL;
+
+			if (asprintf(&path, "%s/%s",
+				     cache_dir, files[i].name) < 0)
+				my_panic(true, "asprintf");
+			if (unlink(path) == 0) {
+				total -= files[i].size;
+				dropped++;
+			}
+			DESTROY(path);
+		}
+		DESTROY(files[i].name);
+	}
+	DESTROY(files);
+	DEBUG(1, true, "cache: dropped %zu, %zu octets remain\n",
+	      dropped, (size_t)total);
+}
+
+/* cache_file_cmp -- qsort() comparator, least recently used first.
+ */
+static int
+cache_file_cmp(const void *a, const void *b) {
+	const struct cache_file *fa = a, *fb = b;
+
+	return (fa->used < fb->used ? -1 : fa->used > fb->used);
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct cache_fill *cache_fill_t;
+
+const char *cache_ready(void);
+FILE *cache_lookup(const char *);
+const char *cache_negative(const char *);
+void cache_negative_add(const char *, const char *);
+cache_fill_t cache_fill_start(const char *);
+void cache_fill(cache_fill_t, const char *, size_t);
+void cache_fill_end(cache_fill_t, bool);
+void cache_fini(void);
+
+#endif /*CACHE_H_INCLUDED*/
@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* record and replay of API responses, so that a batch can be run again
+ * exactly, offline. with -w, each live fetch's URL, the chunks of its
+ * body as libcurl handed them to writer_func() and when, and how it
+ * ended, go to a capture file. with -W, fetches are answered from such
+ * a file instead of the network: each takes the next unused capture of
+ * its URL, whose chunks go back through writer_func() at the pace they
+ * first came, scaled by DNSDBQ_REPLAY_SPEED (or at a speed of zero, as
+ * fast as they can be taken). the API key travels in a header, so it
+ * is never captured.
+ *
+ * the file is one line naming the format, then records, each a line of
+ * text, where a chunk's line is followed by its bytes and a newline:
+ *
+ *	F id us url			a fetch began
+ *	C id us length			a chunk of its body came
+ *	E id us rcode curlcode		it ended
+ *
+ * where "us" is microseconds since recording began, and ids count up
+ * from one in the order the fetches began.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "netio.h"
+#include "capture.h"
+#include "globals.h"
+
+#define	CAPTURE_MAGIC	"dnsdbq-capture 1\n"
+
+struct capture_chunk {
+	u_long		at;		// us after its fetch began
+	char		*data;		// in capture_buf
+	size_t		len;
+};
+
+struct capture_fetch {
+	char		*url;		// in capture_buf
+	u_long		began;		// us after recording began
+	u_long		ended;		// us after its fetch began
+	long		rcode;
+	CURLcode	result;
+	struct capture_chunk *chunks;
+	size_t		nchunks, maxchunks;
+	size_t		next;		// the next chunk to replay
+	struct timeval	started;	// when it was replayed
+	bool		complete;	// its end was recorded
+	bool		used;
+};
+
+/* recording. */
+static FILE *capture_out = NULL;
+static u_long capture_ids = 0;
+static struct timeval capture_t0;
+
+/* replaying. the fetches are kept in the order they began, and looked
+ * up through an index of the complete ones, sorted by URL and then by
+ * that order, so that repeats of a URL are replayed in turn.
+ */
+static char *capture_buf = NULL;
+static struct capture_fetch *capture_fetches = NULL;
+static size_t capture_nfetches = 0, capture_maxfetches = 0;
+static struct capture_fetch **capture_index = NULL;
+static size_t capture_nindex = 0;
+
+static u_long capture_since(const struct timeval *);
+static const char *capture_parse(char *, size_t);
+static int capture_cmp(const void *, const void *);
+
+/* capture_record -- start recording fetches to a capture file.
+ *
+ * Returns NULL on success, else an error message.
+ */
+const char *
+capture_record(const char *path) {
+	capture_out = fopen(path, "w");
+	if (capture_out == NULL)
+		return "-w file cannot be created";
+	fputs(CAPTURE_MAGIC, capture_out);
+	gettimeofday(&capture_t0, NULL);
+	return NULL;
+}
+
+/* capture_start -- record that a live fetch has begun.
+ */
+void
+capture_start(fetch_t fetch) {
+	if (capture_out == NULL)
+		return;
+	fetch->record = ++capture_ids;
+	fprintf(capture_out, "F %lu %lu %s\n",
+		fetch->record, capture_since(&capture_t0), fetch->url);
+}
+
+/* capture_chunk -- record a chunk of a live fetch's body.
+ */
+void
+capture_chunk(fetch_t fetch, const char *ptr, size_t len) {
+	if (fetch->record == 0)
+		return;
+	fprintf(capture_out, "C %lu %lu %zu\n",
+		fetch->record, capture_since(&capture_t0), len);
+	fwrite(ptr, 1, len, capture_out);
+	putc('\n', capture_out);
+}
+
+/* capture_end -- record how a live fetch ended.
+ */
+void
+capture_end(fetch_t fetch, CURLcode result) {
+	long rcode = 0;
+
+	if (fetch->record == 0)
+		return;
+	curl_easy_getinfo(fetch->easy, CURLINFO_RESPONSE_CODE, &rcode);
+	fprintf(capture_out, "E %lu %lu %ld %d\n",
+		fetch->record, capture_since(&capture_t0), rcode, (int)result);
+}
+
+/* capture_replay -- load a capture file, to answer fetches from.
+ *
+ * Returns NULL on success, else an error message.
+ */
+const char *
+capture_replay(const char *path) {
+	struct stat sb;
+	size_t size, len;
+	ssize_t n = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return "-W file cannot be opened";
+	if (fstat(fd, &sb) < 0)
+		my_panic(true, "fstat");
+	size = (size_t)sb.st_size;
+	capture_buf = malloc(size + 1);
+	if (capture_buf == NULL)
+		my_panic(true, "malloc");
+	for (len = 0; len < size; len += (size_t)n) {
+		n = read(fd, capture_buf + len, size - len);
+		if (n < 0)
+			my_panic(true, "read");
+		if (n == 0)
+			break;
+	}
+	close(fd);
+	capture_buf[len] = '\0';
+	return capture_parse(capture_buf, len);
+}
+
+/* capture_parse -- find the fetches, and their chunks, in a capture.
+ *
+ * the buffer is modified in place: each record's line is terminated,
+ * so that URLs can be used as strings. a torn final record, as from a
+ * recording which was interrupted, ends the capture early; fetches which
+ * never ended are not replayed at all.
+ */
+static const char *
+capture_parse(char *buf, size_t len) {
+	char *p, *end = buf + len;
+	size_t i;
+
+	if (len < sizeof CAPTURE_MAGIC - 1 ||
+	    memcmp(buf, CAPTURE_MAGIC, sizeof CAPTURE_MAGIC - 1) != 0)
+		return "-W file is not a dnsdbq capture";
+	for (p = buf + sizeof CAPTURE_MAGIC - 1; p < end; ) {
+		struct capture_fetch *cf;
+		struct capture_chunk *cc;
+		u_long id, us, clen;
+		long rcode, result;
+		char *nl, *q;
+
+		nl = memchr(p, '\n', (size_t)(end - p));
+		if (nl == NULL)
+			break;
+		*nl = '\0';
+		id = strtoul(p + 1, &q, 10);
+		us = strtoul(q, &q, 10);
+		if (*p == 'F') {
+			if (id != capture_nfetches + 1 || *q != ' ')
+				return "-W file has a malformed fetch";
+			if (capture_nfetches == capture_maxfetches) {
+				capture_maxfetches = capture_maxfetches == 0
+					? START_JOBS : capture_maxfetches * 2;
+				capture_fetches = realloc(capture_fetches,
+						capture_maxfetches *
+						sizeof *capture_fetches);
+				if (capture_fetches == NULL)
+					my_panic(true, "realloc");
+			}
+			cf = &capture_fetches[capture_nfetches++];
+			memset(cf, 0, sizeof *cf);
+			cf->url = q + 1;
+			cf->began = us;
+			p = nl + 1;
+			continue;
+		}
+		if (id == 0 || id > capture_nfetches)
+			return "-W file has a record for an unknown fetch";
+		cf = &capture_fetches[id - 1];
+		us = us > cf->began ? us - cf->began : 0;
+		if (*p == 'C') {
+			clen = strtoul(q, &q, 10);
+			if ((size_t)(end - nl) < clen + 2 || nl[clen + 1] != '\n')
+				break;
+			if (cf->nchunks == cf->maxchunks) {
+				cf->maxchunks = cf->maxchunks == 0
+					? 16 : cf->maxchunks * 2;
+				cf->chunks = realloc(cf->chunks,
+						     cf->maxchunks *
+						     sizeof *cf->chunks);
+				if (cf->chunks == NULL)
+					my_panic(true, "realloc");
+			}
+			cc = &cf->chunks[cf->nchunks++];
+			cc->at = us;
+			cc->data = nl + 1;
+			cc->len = clen;
+			p = nl + clen + 2;
+		} else if (*p == 'E') {
+			rcode = strtol(q, &q, 10);
+			result = strtol(q, &q, 10);
+			cf->rcode = rcode;
+			cf->result = (CURLcode)result;
+			cf->ended = us;
+			cf->complete = true;
+			p = nl + 1;
+		} else {
+			return "-W file has a malformed record";
+		}
+	}
+
+	CREATE(capture_index, (capture_nfetches + 1) * sizeof *capture_index);
+	for (i = 0; i < capture_nfetches; i++)
+		if (capture_fetches[i].complete)
+			capture_index[capture_nindex++] = &capture_fetches[i];
+	qsort(capture_index, capture_nindex, sizeof *capture_index,
+	      capture_cmp);
+	DEBUG(1, true, "capture: %zu fetches, %zu complete\n",
+	      capture_nfetches, capture_nindex);
+	return NULL;
+}
+
+/* capture_cmp -- qsort() comparator for the index: by URL, then order.
+ */
+static int
+capture_cmp(const void *a, const void *b) {
+	capture_fetch_t fa = *(const capture_fetch_t *)a;
+	capture_fetch_t fb = *(const capture_fetch_t *)b;
+	int x = strcmp(fa->url, fb->url);
+
+	if (x != 0)
+		return x;
+	return (fa > fb) - (fa < fb);
+}
+
+/* capture_find -- take the next unused capture of a URL, and start
+ * its clock; or return NULL if there isn't one.
+ */
+capture_fetch_t
+capture_find(const char *url) {
+	size_t lo = 0, hi = capture_nindex, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(capture_index[mid]->url, url) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < capture_nindex &&
+	       strcmp(capture_index[lo]->url, url) == 0; lo++)
+	{
+		capture_fetch_t cf = capture_index[lo];
+
+		if (!cf->used) {
+			cf->used = true;
+			gettimeofday(&cf->started, NULL);
+			return cf;
+		}
+	}
+	return NULL;
+}
+
+/* capture_rcode -- the HTTP response code a captured fetch had.
+ */
+long
+capture_rcode(capture_fetch_t cf) {
+	return cf->rcode;
+}
+
+/* capture_result -- the libcurl result a captured fetch ended with.
+ */
+CURLcode
+capture_result(capture_fetch_t cf) {
+	return cf->result;
+}
+
+/* capture_next -- take the next chunk of a replayed fetch, if it's due.
+ *
+ * Returns 0 having set *datap and *lenp if a chunk was due; else the
+ * milliseconds until one is (or until the fetch ends), or -1 if the
+ * fetch has ended.
+ */
+long
+capture_next(capture_fetch_t cf, char **datap, size_t *lenp) {
+	u_long due, now;
+
+	due = cf->next < cf->nchunks ? cf->chunks[cf->next].at : cf->ended;
+	if (replay_speed > 0.0) {
+		due = (u_long)((double)due / replay_speed);
+		now = capture_since(&cf->started);
+		if (due > now)
+			return (long)((due - now + 999) / 1000);
+	}
+	if (cf->next == cf->nchunks)
+		return -1;
+	*datap = cf->chunks[cf->next].data;
+	*lenp = cf->chunks[cf->next].len;
+	cf->next++;
+	return 0;
+}
+
+/* capture_fini -- finish recording, or let go of a replayed capture.
+ */
+void
+capture_fini(void) {
+	size_t i;
+
+	if (capture_out != NULL) {
+		bool bad = ferror(capture_out) != 0;
+
+		if (fclose(capture_out) != 0 || bad)
+			fprintf(stderr, "%s: warning: capture file: %s\n",
+				program_name, strerror(errno));
+		capture_out = NULL;
+	}
+	for (i = 0; i < capture_nfetches; i++)
+		DESTROY(capture_fetches[i].chunks);
+	DESTROY(capture_fetches);
+	DESTROY(capture_index);
+	DESTROY(capture_buf);
+	capture_nfetches = capture_maxfetches = capture_nindex = 0;
+}
+
+/* capture_since -- microseconds since some earlier time.
+ */
+static u_long
+capture_since(const struct timeval *then) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (u_long)((now.tv_sec - then->tv_sec) * 1000000L +
+			(now.tv_usec - then->tv_usec));
+}
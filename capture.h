@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <curl/curl.h>
+
+#include "netio.h"
+
+typedef struct capture_fetch *capture_fetch_t;
+
+const char *capture_record(const char *);
+void capture_start(fetch_t);
+void capture_chunk(fetch_t, const char *, size_t);
+void capture_end(fetch_t, CURLcode);
+const char *capture_replay(const char *);
+capture_fetch_t capture_find(const char *);
+long capture_rcode(capture_fetch_t);
+CURLcode capture_result(capture_fetch_t);
+long capture_next(capture_fetch_t, char **, size_t *);
+void capture_fini(void);
+
+#endif /*CAPTURE_H_INCLUDED*/
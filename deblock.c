@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#define DEBLOCK_X86 1
+#endif
+
+#include "deblock.h"
+
+#if DEBLOCK_X86 && defined(__SSE2__)
+static size_t scan_sse2(const char *, size_t, slice_t, size_t, size_t *);
+#endif
+static size_t scan_memchr(const char *, size_t, slice_t, size_t, size_t *);
+static size_t scan_scalar(const char *, size_t, size_t, slice_t, size_t,
+			  size_t, size_t *);
+
+/* deblock_scan -- find up to max complete records in buf, as slices.
+ *
+ * each slice is a record's offset and length within buf, not counting
+ * its terminating newline, so the caller can use the records in place.
+ * *used is set to the offset just past the last newline found, which is
+ * where the caller should resume. returns the number of slices found.
+ *
+ * this is memchr(), which "dnsdbq-bench -D" finds as fast as scanning in
+ * 64-octet blocks for records of the lengths the API sends, and faster
+ * for longer ones. the block scanner only wins for lines much shorter
+ * than any record.
+ */
+size_t
+deblock_scan(const char *buf, size_t len, slice_t slices, size_t max,
+	     size_t *used)
+{
+	return scan_memchr(buf, len, slices, max, used);
+}
+
+/* deblock_scanners -- return every scanner this CPU can run, the one
+ * deblock_scan() uses first, ending with one whose name is NULL. for
+ * dnsdbq-bench, which compares them.
+ */
+const struct deblock_scanner *
+deblock_scanners(void) {
+	static const struct deblock_scanner scanners[] = {
+		{ "memchr", scan_memchr },
+#if DEBLOCK_X86 && defined(__SSE2__)
+		{ "sse2", scan_sse2 },
+#endif
+		{ NULL, NULL }
+	};
+
+	return (scanners);
+}
+
+/* EMIT -- record the slice which ends at a newline at offset pos, and stop
+ * if the caller's slice array is now full. this is a macro so that it is
+ * inlined even in unoptimized builds, since it is the innermost loop.
+ */
+#define EMIT(pos) { \
+	slices[n].offset = start; \
+	slices[n].len = (pos) - start; \
+	start = (pos) + 1; \
+	if (++n == max) { \
+		*used = start; \
+		return n; \
+	} \
+}
+
+/* SKIP -- a 64-octet block had no newline, so this is a long record, and
+ * the C library's memchr() will find its end faster than our blocks can.
+ * the next block starts at that newline (or at the end, if there is none.)
+ */
+#define SKIP() { \
+	const char *p = memchr(buf + i + 64, '\n', len - i - 64); \
+	\
+	if (p == NULL) { \
+		*used = start; \
+		return n; \
+	} \
+	i = (size_t)(p - buf) - 64; \
+}
+
+#if DEBLOCK_X86 && defined(__SSE2__)
+/* scan_sse2 -- 64 octets at a time, 16 at a time, as every x86_64 can do.
+ */
+static size_t
+scan_sse2(const char *buf, size_t len, slice_t slices, size_t max,
+	  size_t *used)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i, n = 0, start = 0;
+
+	*used = 0;
+	if (max == 0)
+		return 0;
+	for (i = 0; i + 64 <= len; i += 64) {
+		const __m128i *v = (const __m128i *)(buf + i);
+		unsigned long long mask;
+
+		mask = (unsigned long long)(unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128(v), nl));
+		mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128(v + 1), nl)) << 16;
+		mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128(v + 2), nl)) << 32;
+		mask |= (unsigned long long)(unsigned int)_mm_movemask_epi8(
+			_mm_cmpeq_epi8(_mm_loadu_si128(v + 3), nl)) << 48;
+		if (mask == 0) {
+			SKIP();
+			continue;
+		}
+		while (mask != 0) {
+			size_t pos = i + (size_t)__builtin_ctzll(mask);
+
+			mask &= mask - 1;
+			EMIT(pos);
+		}
+	}
+	*used = start;
+	return scan_scalar(buf, len, i, slices, max, n, used);
+}
+#endif
+
+/* scan_memchr -- memchr() alone, as where there is nothing better.
+ */
+static size_t
+scan_memchr(const char *buf, size_t len, slice_t slices, size_t max,
+	    size_t *used)
+{
+	*used = 0;
+	return scan_scalar(buf, len, 0, slices, max, 0, used);
+}
+
+/* scan_scalar -- finish (or do) a scan from offset i with memchr().
+ *
+ * n slices have already been found, and *used is where the last ended.
+ */
+static size_t
+scan_scalar(const char *buf, size_t len, size_t i, slice_t slices,
+	    size_t max, size_t n, size_t *used)
+{
+	size_t start = *used;
+	const char *p;
+
+	if (n == max)
+		return n;
+	while (i < len && (p = memchr(buf + i, '\n', len - i)) != NULL) {
+		size_t pos = (size_t)(p - buf);
+
+		i = pos + 1;
+		EMIT(pos);
+	}
+	*used = start;
+	return n;
+}
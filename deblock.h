@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef DEBLOCK_H_INCLUDED
+#define DEBLOCK_H_INCLUDED 1
+
+#include <sys/types.h>
+
+/* one newline-terminated record within a buffer, not counting its \n. */
+struct slice { size_t offset, len; };
+typedef struct slice *slice_t;
+
+#define MAX_SLICES 256
+
+typedef size_t (*deblock_t)(const char *, size_t, slice_t, size_t, size_t *);
+
+/* one of the scanners deblock_scan() may choose among. */
+struct deblock_scanner {
+	const char	*name;
+	deblock_t	scan;
+};
+
+size_t deblock_scan(const char *, size_t, slice_t, size_t, size_t *);
+const struct deblock_scanner *deblock_scanners(void);
+
+#endif /*DEBLOCK_H_INCLUDED*/
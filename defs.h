@@ -21,7 +21,20 @@
 
 #define DEFAULT_SYS 0
 #define DEFAULT_VERB 0
-#define	MAX_JOBS 8
+#define	MAX_JOBS 64
+#define	START_JOBS 8
+#define	H2_STREAMS 100
+#define	JSON_CHUNK (4 << 20)
+#define	SORT_MEMORY ((size_t)256 << 20)
+#define	SORT_FANIN 16
+#define	CACHE_TTL (60UL * 60UL)
+#define	CACHE_SIZE ((size_t)256 << 20)
+#define	BATCH_RECALL ((size_t)16 << 20)
+#define	BATCH_BUCKETS 1024
+#define	BATCH_QUEUE 256
+#define	OUT_BUFFER ((size_t)64 << 10)
+#define	RENDER_BACKLOG 4
+#define	METRICS_INTERVAL 15
 #define DNSDBQ_SYSTEM "DNSDBQ_SYSTEM"
 
 #define CREATE(p, s) if ((p) != NULL) { my_panic(false, "non-NULL ptr"); } \
@@ -32,5 +45,7 @@
 
 typedef enum { pres_text, pres_json, pres_csv } present_e;
 typedef enum { batch_none, batch_original, batch_verbose } batch_e;
+typedef enum { cache_off, cache_on, cache_only } cache_e;
+typedef enum { capture_off, capture_rec, capture_play } capture_e;
 
 #endif /*DEFS_H_INCLUDED*/
@@ -0,0 +1,822 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* a stand-in for the DNSDB API, for load testing dnsdbq end to end with
+ * no network and no quota. it serves the REST surface dnsdbq uses:
+ *
+ *	/lookup/{rrset,rdata}/{name,ip,raw}/VALUE[/TYPE[/BAILIWICK]]
+ *	/summarize/... (the same)
+ *	/lookup/rate_limit
+ *
+ * with the limit, offset, max_count and time_{first,last}_{before,after}
+ * parameters. answers are synthetic but stable: each path always has the
+ * same records, seeded by a hash of it, and a share of paths have none,
+ * which is a 404 as the real API does it. latency, bandwidth, and errors
+ * (500 and 429) can be injected. it's one thread with a poll() loop,
+ * speaking plain HTTP/1.1 with keep-alive.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "obuf.h"
+
+#define	MOCK_CONNS 1024
+#define	MOCK_REQUEST 8192	// the longest request head we'll take
+#define	MOCK_LIMIT 10000	// the API's default result limit
+#define	MOCK_TICK 10		// ms between sends when pacing bandwidth
+
+/* one client connection, which is reading a request head, or waiting
+ * out the injected latency, or sending a response.
+ */
+struct mock_conn {
+	int		fd;
+	char		req[MOCK_REQUEST];
+	size_t		reqlen;
+	char		*resp;
+	size_t		resplen, sent;
+	double		send_at;	// when the response may start
+	double		started;	// when it did, for bandwidth pacing
+	bool		close;		// after this response
+};
+
+/* the records of one answer, before fencing and limits. */
+struct mock_rec {
+	u_long		count;
+	u_long		first, last;
+	bool		zone;
+};
+
+/* Forward. */
+
+__attribute__((noreturn)) void my_exit(int);
+__attribute__((noreturn)) void my_panic(bool, const char *);
+static __attribute__((noreturn)) void mock_usage(void);
+static void mock_accept(int);
+static bool mock_read(struct mock_conn *);
+static bool mock_write(struct mock_conn *, double);
+static void mock_close(struct mock_conn *);
+static void mock_request(struct mock_conn *);
+static void mock_respond(struct mock_conn *, int, const char *, size_t);
+static int mock_answer(const char *, obuf_t);
+static void mock_rate(obuf_t);
+static const char *mock_param(const char *, const char *, u_long *);
+static void mock_decode(char *);
+static void mock_name(obuf_t, uint64_t *, const char *);
+static void mock_rdata(obuf_t, uint64_t *, const char *, const char *,
+		       const char *, u_long);
+static uint64_t mock_hash(const char *, size_t);
+static uint64_t mock_random(uint64_t *);
+static double mock_now(void);
+
+/* Private. */
+
+static const char *program_name = "dnsdb-mock";
+static struct mock_conn *conns[MOCK_CONNS];
+static struct pollfd pollfds[MOCK_CONNS + 1];
+static size_t nconns = 0;
+
+static long latency = 0, jitter = 0;	// ms
+static long bandwidth = 0;		// octets per second, per response
+static long error_pct = 0, ratelimit_pct = 0, empty_pct = 10;
+static long max_records = 100;
+static const char *api_key = NULL;
+static int verbose = 0;
+static uint64_t inject_state = 0x2545f4914f6cdd1dULL;
+
+static const char * const mock_types[] = {
+	"A", "A", "A", "A", "AAAA", "AAAA", "CNAME", "NS", "MX", "TXT",
+};
+
+/* types whose rdata is a name, for rdata/name queries. */
+static const char * const mock_name_types[] = {
+	"CNAME", "CNAME", "NS", "NS", "MX", "PTR",
+};
+
+/* Public. */
+
+int
+main(int argc, char *argv[]) {
+	struct sockaddr_in sin;
+	const char *addr = "127.0.0.1";
+	long port = 8080;
+	int ch, lfd, on = 1;
+
+	while ((ch = getopt(argc, argv, "a:b:e:j:k:l:m:n:p:r:v")) != -1) {
+		switch (ch) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'b':
+			bandwidth = strtol(optarg, NULL, 10);
+			break;
+		case 'e':
+			error_pct = strtol(optarg, NULL, 10);
+			break;
+		case 'j':
+			jitter = strtol(optarg, NULL, 10);
+			break;
+		case 'k':
+			api_key = optarg;
+			break;
+		case 'l':
+			latency = strtol(optarg, NULL, 10);
+			break;
+		case 'm':
+			max_records = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			empty_pct = strtol(optarg, NULL, 10);
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			ratelimit_pct = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			mock_usage();
+		}
+	}
+	if (argc != optind || port <= 0 || port > 65535 || max_records < 0 ||
+	    latency < 0 || jitter < 0 || bandwidth < 0)
+		mock_usage();
+
+	signal(SIGPIPE, SIG_IGN);
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons((uint16_t)port);
+	if (inet_pton(AF_INET, addr, &sin.sin_addr) != 1)
+		mock_usage();
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		my_panic(true, "socket");
+	(void) setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof sin) < 0)
+		my_panic(true, "bind");
+	if (listen(lfd, 128) < 0)
+		my_panic(true, "listen");
+	(void) fcntl(lfd, F_SETFL, O_NONBLOCK);
+	if (verbose)
+		fprintf(stderr, "%s: listening on %s:%ld\n",
+			program_name, addr, port);
+
+	for (;;) {
+		double now = mock_now(), wake = -1.0;
+		int timeout = -1;
+		size_t i;
+
+		/* the listener is last, and only while there's room. */
+		for (i = 0; i < nconns; i++) {
+			struct mock_conn *c = conns[i];
+
+			pollfds[i].fd = c->fd;
+			pollfds[i].events = 0;
+			pollfds[i].revents = 0;
+			if (c->resp == NULL) {
+				pollfds[i].events = POLLIN;
+			} else if (c->send_at > now) {
+				if (wake < 0 || c->send_at < wake)
+					wake = c->send_at;
+			} else if (bandwidth != 0 &&
+				   (double)c->sent >= (now - c->started) *
+				   (double)bandwidth)
+			{
+				if (wake < 0 || now + MOCK_TICK / 1e3 < wake)
+					wake = now + MOCK_TICK / 1e3;
+			} else {
+				pollfds[i].events = POLLOUT;
+			}
+		}
+		pollfds[nconns].fd = nconns < MOCK_CONNS ? lfd : -1;
+		pollfds[nconns].events = POLLIN;
+		pollfds[nconns].revents = 0;
+		if (wake >= 0)
+			timeout = (int)((wake - now) * 1e3) + 1;
+
+		if (poll(pollfds, nconns + 1, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			my_panic(true, "poll");
+		}
+		now = mock_now();
+
+		/* walk backward, since closing moves the last one here. */
+		for (i = nconns; i-- > 0; ) {
+			struct mock_conn *c = conns[i];
+			bool ok = true;
+
+			if ((pollfds[i].revents & (POLLIN|POLLHUP|POLLERR))
+			    != 0 && c->resp == NULL)
+				ok = mock_read(c);
+			else if (c->resp != NULL && c->send_at <= now)
+				ok = mock_write(c, now);
+			if (!ok) {
+				mock_close(c);
+				conns[i] = conns[--nconns];
+			}
+		}
+		if ((pollfds[nconns].revents & POLLIN) != 0)
+			mock_accept(lfd);
+	}
+}
+
+/* my_exit -- there's nothing to tidy.
+ */
+__attribute__((noreturn)) void
+my_exit(int code) {
+	exit(code);
+}
+
+/* my_panic -- display an error on diagnostic output stream, exit ungracefully
+ */
+__attribute__((noreturn)) void
+my_panic(bool want_perror, const char *s) {
+	fprintf(stderr, "%s: ", program_name);
+	if (want_perror)
+		perror(s);
+	else
+		fprintf(stderr, "%s\n", s);
+	my_exit(1);
+}
+
+/* Private. */
+
+/* mock_usage -- say how to run this, and exit.
+ */
+static void
+mock_usage(void) {
+	fprintf(stderr,
+		"usage: %s [-v] [-a addr] [-p port] [-k api_key]\n"
+		"\t[-l latency_ms] [-j jitter_ms] [-b octets_per_sec]\n"
+		"\t[-e error_pct] [-r ratelimit_pct] [-n empty_pct]"
+		" [-m max_records]\n", program_name);
+	exit(1);
+}
+
+/* mock_accept -- take as many new connections as are waiting.
+ */
+static void
+mock_accept(int lfd) {
+	int fd, on = 1;
+
+	while (nconns < MOCK_CONNS && (fd = accept(lfd, NULL, NULL)) >= 0) {
+		struct mock_conn *c = NULL;
+
+		(void) fcntl(fd, F_SETFL, O_NONBLOCK);
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+		CREATE(c, sizeof *c);
+		c->fd = fd;
+		conns[nconns++] = c;
+	}
+}
+
+/* mock_read -- take what a client has sent, and answer a whole request.
+ *
+ * Returns false if the connection should be closed.
+ */
+static bool
+mock_read(struct mock_conn *c) {
+	ssize_t n;
+
+	n = read(c->fd, c->req + c->reqlen, sizeof c->req - c->reqlen - 1);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR);
+	if (n == 0)
+		return (false);
+	c->reqlen += (size_t)n;
+	c->req[c->reqlen] = '\0';
+	if (strstr(c->req, "\r\n\r\n") != NULL)
+		mock_request(c);
+	else if (c->reqlen == sizeof c->req - 1)
+		return (false);
+	return (true);
+}
+
+/* mock_write -- send what the bandwidth allows of a response.
+ *
+ * Returns false if the connection should be closed.
+ */
+static bool
+mock_write(struct mock_conn *c, double now) {
+	size_t want = c->resplen - c->sent;
+	ssize_t n;
+
+	if (c->started == 0.0)
+		c->started = now;
+	if (bandwidth != 0) {
+		double allowed = (now - c->started + MOCK_TICK / 1e3) *
+			(double)bandwidth - (double)c->sent;
+
+		if (allowed < 1.0)
+			return (true);
+		if ((double)want > allowed)
+			want = (size_t)allowed;
+	}
+	n = write(c->fd, c->resp + c->sent, want);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR);
+	c->sent += (size_t)n;
+	if (c->sent < c->resplen)
+		return (true);
+
+	/* done; keep any pipelined request which followed this one. */
+	DESTROY(c->resp);
+	c->resplen = c->sent = 0;
+	c->started = 0.0;
+	if (c->close)
+		return (false);
+	if (c->reqlen != 0 && strstr(c->req, "\r\n\r\n") != NULL)
+		mock_request(c);
+	return (true);
+}
+
+/* mock_close -- forget a connection.
+ */
+static void
+mock_close(struct mock_conn *c) {
+	close(c->fd);
+	DESTROY(c->resp);
+	DESTROY(c);
+}
+
+/* mock_request -- answer the request at the front of a connection's
+ * buffer, and remove it from there.
+ */
+static void
+mock_request(struct mock_conn *c) {
+	char *end = strstr(c->req, "\r\n\r\n"), *target = NULL, *p;
+	size_t headlen = (size_t)(end + 4 - c->req), len;
+	bool key_ok = api_key == NULL;
+	struct obuf body;
+	char *text;
+	int code;
+
+	*end = '\0';
+	c->close = false;
+	obuf_init(&body, -1);
+
+	/* "GET /target HTTP/1.1", then headers. */
+	if (strncmp(c->req, "GET ", 4) == 0 &&
+	    (p = strchr(c->req + 4, ' ')) != NULL)
+	{
+		target = c->req + 4;
+		*p++ = '\0';
+		if (strncmp(p, "HTTP/1.0", 8) == 0)
+			c->close = true;
+		while ((p = strstr(p, "\r\n")) != NULL) {
+			char *value, *eol;
+
+			p += 2;
+			if ((value = strchr(p, ':')) == NULL)
+				continue;
+			for (value++; *value == ' '; value++)
+				continue;
+			if ((eol = strstr(value, "\r\n")) == NULL)
+				eol = value + strlen(value);
+			if (strncasecmp(p, "Connection:", 11) == 0 &&
+			    strncasecmp(value, "close", 5) == 0)
+				c->close = true;
+			else if (api_key != NULL &&
+				 strncasecmp(p, "X-Api-Key:", 10) == 0 &&
+				 strlen(api_key) == (size_t)(eol - value) &&
+				 strncmp(value, api_key, strlen(api_key)) == 0)
+				key_ok = true;
+		}
+	}
+
+	if (target == NULL) {
+		obuf_puts(&body, "Error: bad request.\n");
+		code = 400;
+		c->close = true;
+	} else if (!key_ok) {
+		obuf_puts(&body, "Error: API key not valid.\n");
+		code = 403;
+	} else if (error_pct != 0 &&
+		   (long)(mock_random(&inject_state) % 100) < error_pct) {
+		obuf_puts(&body, "Error: internal server error.\n");
+		code = 500;
+	} else if (ratelimit_pct != 0 &&
+		   (long)(mock_random(&inject_state) % 100) < ratelimit_pct) {
+		obuf_puts(&body, "Error: rate limit exceeded.\n");
+		code = 429;
+	} else {
+		code = mock_answer(target, &body);
+	}
+	if (verbose)
+		fprintf(stderr, "%s: %d %s\n", program_name, code,
+			target != NULL ? target : "-");
+
+	text = obuf_take(&body, &len);
+	mock_respond(c, code, text, len);
+	DESTROY(text);
+	memmove(c->req, c->req + headlen, c->reqlen - headlen);
+	c->reqlen -= headlen;
+	c->req[c->reqlen] = '\0';
+}
+
+/* mock_respond -- make a connection's response, to go out after the
+ * injected latency.
+ */
+static void
+mock_respond(struct mock_conn *c, int code, const char *body, size_t len) {
+	const char *reason;
+	double delay;
+	int n;
+
+	switch (code) {
+	case 200:	reason = "OK"; break;
+	case 400:	reason = "Bad Request"; break;
+	case 403:	reason = "Forbidden"; break;
+	case 404:	reason = "Not Found"; break;
+	case 429:	reason = "Too Many Requests"; break;
+	default:	reason = "Internal Server Error"; break;
+	}
+	n = asprintf(&c->resp, "HTTP/1.1 %d %s\r\n"
+		     "Content-Type: application/x-ndjson\r\n"
+		     "Content-Length: %zu\r\n"
+		     "%s\r\n%.*s",
+		     code, reason, len,
+		     c->close ? "Connection: close\r\n" : "",
+		     (int)len, body);
+	if (n < 0)
+		my_panic(true, "asprintf");
+	c->resplen = (size_t)n;
+	c->sent = 0;
+	delay = (double)latency;
+	if (jitter != 0)
+		delay += (double)(mock_random(&inject_state) %
+				  (uint64_t)jitter);
+	c->send_at = mock_now() + delay / 1e3;
+}
+
+/* mock_answer -- generate the body answering one request target.
+ *
+ * Returns the HTTP status code.
+ */
+static int
+mock_answer(const char *target, obuf_t body) {
+	char *path = strdup(target), *query, *fields[8], *p;
+	u_long limit = MOCK_LIMIT, offset = 0, max_count = 0;
+	u_long first_before = 0, first_after = 0;
+	u_long last_before = 0, last_after = 0;
+	u_long sum = 0, min_first = 0, max_last = 0, n, i, emitted = 0;
+	const char *rrtype, *value, *bailiwick, *msg = NULL;
+	struct obuf name;
+	bool summarize, rdata;
+	uint64_t seed;
+	int nfields = 0, code = 200;
+
+	/* the records depend only on what was asked, never on fencing. */
+	seed = mock_hash(target, strcspn(target, "?"));
+	obuf_init(&name, -1);
+
+	if ((query = strchr(path, '?')) != NULL)
+		*query++ = '\0';
+	for (p = strtok(path, "/"); p != NULL && nfields < 8;
+	     p = strtok(NULL, "/"))
+		fields[nfields++] = p;
+
+	if (nfields == 2 && strcmp(fields[1], "rate_limit") == 0) {
+		mock_rate(body);
+		goto done;
+	}
+	/* {lookup,summarize}/{rrset,rdata}/{name,ip,raw}/VALUE[/T[/B]] */
+	if (nfields < 4 || nfields > 6 ||
+	    (strcmp(fields[0], "lookup") != 0 &&
+	     strcmp(fields[0], "summarize") != 0) ||
+	    (strcmp(fields[1], "rrset") != 0 &&
+	     strcmp(fields[1], "rdata") != 0) ||
+	    (strcmp(fields[2], "name") != 0 &&
+	     strcmp(fields[2], "ip") != 0 &&
+	     strcmp(fields[2], "raw") != 0))
+	{
+		obuf_puts(body, "Error: unknown request.\n");
+		code = 400;
+		goto done;
+	}
+	summarize = fields[0][0] == 's';
+	rdata = fields[1][1] == 'd';
+	for (i = 3; i < (u_long)nfields; i++)
+		mock_decode(fields[i]);
+	value = fields[3];
+	rrtype = nfields > 4 && strcasecmp(fields[4], "ANY") != 0
+		? fields[4] : NULL;
+	bailiwick = nfields > 5 ? fields[5] : NULL;
+
+	if (query != NULL) {
+		for (p = strtok(query, "&"); p != NULL && msg == NULL;
+		     p = strtok(NULL, "&"))
+			if ((msg = mock_param(p, "limit", &limit)) == NULL &&
+			    (msg = mock_param(p, "offset", &offset)) == NULL &&
+			    (msg = mock_param(p, "max_count",
+					      &max_count)) == NULL &&
+			    (msg = mock_param(p, "time_first_before",
+					      &first_before)) == NULL &&
+			    (msg = mock_param(p, "time_first_after",
+					      &first_after)) == NULL &&
+			    (msg = mock_param(p, "time_last_before",
+					      &last_before)) == NULL)
+				msg = mock_param(p, "time_last_after",
+						 &last_after);
+		if (msg != NULL && *msg != '\0') {
+			obuf_printf(body, "Error: %s.\n", msg);
+			code = 400;
+			goto done;
+		}
+	}
+	if (limit == 0 || limit > MOCK_LIMIT)
+		limit = MOCK_LIMIT;
+
+	if ((long)(seed % 100) < empty_pct)
+		n = 0;
+	else
+		n = 1 + (u_long)(mock_random(&seed) %
+				 (uint64_t)(max_records + 1));
+
+	for (i = 0; i < n && (summarize || emitted < offset + limit); i++) {
+		struct mock_rec rec;
+		const char *type = rrtype;
+
+		rec.count = 1 + (u_long)(mock_random(&seed) % 1000);
+		rec.first = 1262304000 +
+			(u_long)(mock_random(&seed) % (15 * 365 * 86400));
+		rec.last = rec.first +
+			(u_long)(mock_random(&seed) % (5 * 365 * 86400));
+		rec.zone = mock_random(&seed) % 100 < 10;
+		if (type == NULL) {
+			if (strcmp(fields[2], "ip") == 0)
+				type = strchr(value, ':') != NULL
+					? "AAAA" : "A";
+			else if (rdata)
+				type = mock_name_types[mock_random(&seed) %
+					(sizeof mock_name_types /
+					 sizeof mock_name_types[0])];
+			else
+				type = mock_types[mock_random(&seed) %
+					(sizeof mock_types /
+					 sizeof mock_types[0])];
+		}
+
+		/* fencing, as the API does it. */
+		if ((first_before != 0 && rec.first > first_before) ||
+		    (first_after != 0 && rec.first < first_after) ||
+		    (last_before != 0 && rec.last > last_before) ||
+		    (last_after != 0 && rec.last < last_after))
+			continue;
+		if (summarize) {
+			if (max_count != 0 && sum >= max_count)
+				break;
+			sum += rec.count;
+			if (min_first == 0 || rec.first < min_first)
+				min_first = rec.first;
+			if (rec.last > max_last)
+				max_last = rec.last;
+			emitted++;
+			continue;
+		}
+		if (emitted++ < offset)
+			continue;
+
+		name.len = 0;
+		mock_name(&name, &seed, rdata ? NULL : value);
+		obuf_printf(body, "{\"count\":%lu,\"%s\":%lu,\"%s\":%lu,"
+			    "\"rrname\":\"%.*s\",\"rrtype\":\"%s\","
+			    "\"bailiwick\":\"", rec.count,
+			    rec.zone ? "zone_time_first" : "time_first",
+			    rec.first,
+			    rec.zone ? "zone_time_last" : "time_last",
+			    rec.last, (int)name.len, name.base, type);
+		if (bailiwick != NULL && !rdata) {
+			obuf_puts(body, bailiwick);
+		} else {
+			/* the last two labels of the owner name. */
+			size_t off = name.len - 1;
+			int dots = 0;
+
+			while (off > 0 && dots < 2)
+				if (name.base[--off] == '.')
+					dots++;
+			if (dots == 2)
+				off++;
+			obuf_write(body, name.base + off, name.len - off);
+		}
+		obuf_puts(body, "\",\"rdata\":[\"");
+		mock_rdata(body, &seed, type, fields[2],
+			   rdata ? value : NULL, i);
+		obuf_puts(body, "\"]}\n");
+	}
+
+	if (summarize && emitted != 0)
+		obuf_printf(body, "{\"count\":%lu,\"num_results\":%lu,"
+			    "\"time_first\":%lu,\"time_last\":%lu}\n",
+			    sum, emitted, min_first, max_last);
+	else if (summarize || emitted <= offset) {
+		obuf_puts(body, "Error: no results found for query.\n");
+		code = 404;
+	}
+ done:
+	obuf_fini(&name);
+	DESTROY(path);
+	return (code);
+}
+
+/* mock_rate -- generate a rate_limit answer; this server has no quota.
+ */
+static void
+mock_rate(obuf_t body) {
+	obuf_printf(body, "{\"rate\":{\"reset\":\"n/a\",\"limit\":"
+		    "\"unlimited\",\"remaining\":\"unlimited\","
+		    "\"results_max\":%d,\"offset_max\":%d}}\n",
+		    MOCK_LIMIT, MOCK_LIMIT);
+}
+
+/* mock_param -- if a "key=value" is the given key, take its value.
+ *
+ * Returns NULL if it isn't that key, "" if it is and the value is good,
+ * or else an error message.
+ */
+static const char *
+mock_param(const char *kv, const char *key, u_long *valuep) {
+	size_t len = strlen(key);
+	char *end;
+
+	if (strncmp(kv, key, len) != 0 || kv[len] != '=')
+		return (NULL);
+	errno = 0;
+	*valuep = strtoul(kv + len + 1, &end, 10);
+	if (errno != 0 || *end != '\0' || end == kv + len + 1)
+		return ("bad parameter value");
+	return ("");
+}
+
+/* mock_decode -- undo URL %-encoding, in place.
+ */
+static void
+mock_decode(char *str) {
+	char *in, *out;
+
+	for (in = out = str; *in != '\0'; in++, out++) {
+		if (in[0] == '%' && isxdigit((unsigned char)in[1]) &&
+		    isxdigit((unsigned char)in[2]))
+		{
+			char hex[3] = { in[1], in[2], '\0' };
+
+			*out = (char)strtol(hex, NULL, 16);
+			in += 2;
+		} else {
+			*out = *in;
+		}
+	}
+	*out = '\0';
+}
+
+/* mock_name -- generate an owner name; the given one, with any leading
+ * wildcard label filled in, or if that is NULL, some other name.
+ */
+static void
+mock_name(obuf_t ob, uint64_t *seed, const char *name) {
+	static const char alnum[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+	u_long len, i;
+
+	if (name == NULL || strncmp(name, "*.", 2) == 0) {
+		len = 3 + (u_long)(mock_random(seed) % 12);
+		for (i = 0; i < len; i++)
+			obuf_putc(ob, alnum[mock_random(seed) %
+					    (sizeof alnum - 1)]);
+		obuf_putc(ob, '.');
+		if (name == NULL) {
+			obuf_printf(ob, "example%lu.com.",
+				    (u_long)(mock_random(seed) % 5000));
+			return;
+		}
+		name += 2;
+	}
+	obuf_puts(ob, name);
+	if (*name == '\0' || name[strlen(name) - 1] != '.')
+		obuf_putc(ob, '.');
+}
+
+/* mock_rdata -- generate one rdata value of a type; if it's an rdata
+ * query, the value asked for, in that type's form.
+ */
+static void
+mock_rdata(obuf_t ob, uint64_t *seed, const char *type, const char *kind,
+	   const char *value, u_long nth)
+{
+	if (value != NULL && strcmp(kind, "ip") == 0) {
+		/* a prefix gets addresses within it. */
+		const char *comma = strchr(value, ',');
+
+		const char *last;
+
+		if (comma == NULL) {
+			obuf_puts(ob, value);
+		} else if (strchr(value, ':') != NULL) {
+			obuf_printf(ob, "%.*s%lx", (int)(comma - value),
+				    value, nth % 65536);
+		} else {
+			/* vary the last octet. */
+			for (last = comma; last > value && last[-1] != '.';
+			     last--)
+				continue;
+			obuf_printf(ob, "%.*s%lu", (int)(last - value),
+				    value, nth % 256);
+		}
+	} else if (value != NULL && strcmp(kind, "raw") == 0) {
+		obuf_printf(ob, "\\\\# %zu %s", strlen(value) / 2, value);
+	} else if (value != NULL) {
+		if (strcmp(type, "MX") == 0)
+			obuf_puts(ob, "10 ");
+		mock_name(ob, seed, value);
+	} else if (strcmp(type, "A") == 0) {
+		obuf_printf(ob, "%lu.%lu.%lu.%lu",
+			    (u_long)(1 + mock_random(seed) % 223),
+			    (u_long)(mock_random(seed) % 256),
+			    (u_long)(mock_random(seed) % 256),
+			    (u_long)(mock_random(seed) % 256));
+	} else if (strcmp(type, "AAAA") == 0) {
+		obuf_printf(ob, "2001:db8::%lx",
+			    (u_long)(mock_random(seed) % 65536));
+	} else if (strcmp(type, "MX") == 0) {
+		obuf_puts(ob, "10 ");
+		mock_name(ob, seed, NULL);
+	} else if (strcmp(type, "TXT") == 0) {
+		obuf_printf(ob, "\\\"v=spf1 ip4:192.0.2.%lu ~all\\\"",
+			    (u_long)(mock_random(seed) % 256));
+	} else {
+		mock_name(ob, seed, NULL);
+	}
+}
+
+/* mock_hash -- FNV-1a, to seed an answer from what was asked.
+ */
+static uint64_t
+mock_hash(const char *str, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (hash);
+}
+
+/* mock_random -- xorshift64*, stepping the given state.
+ */
+static uint64_t
+mock_random(uint64_t *state) {
+	if (*state == 0)
+		*state = 0x9e3779b97f4a7c15ULL;
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1dULL);
+}
+
+/* mock_now -- seconds on a clock which never goes backward.
+ */
+static double
+mock_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+}
@@ -25,6 +25,8 @@
 /* modern glibc will complain about the above if it doesn't see this. */
 #define _DEFAULT_SOURCE
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/time.h>
 
@@ -33,6 +35,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -47,7 +52,11 @@
 
 #define MAIN_PROGRAM
 #include "defs.h"
+#include "cache.h"
+#include "capture.h"
+#include "deblock.h"
 #include "netio.h"
+#include "metrics.h"
 #include "pdns.h"
 #if WANT_PDNS_DNSDB
 #include "pdns_dnsdb.h"
@@ -55,13 +64,81 @@
 #if WANT_PDNS_CIRCL
 #include "pdns_circl.h"
 #endif
+#include "render.h"
 #include "sort.h"
+#include "stats.h"
 #include "time.h"
+#include "ns_ttl.h"
 #include "globals.h"
 #undef MAIN_PROGRAM
 
 #define QPARAM_GETOPT "A:B:L:l:cgG"
 
+/* one newline-aligned piece of a mapped -J file, and what became of it. */
+struct json_chunk {
+	const char	*base;
+	size_t		len;
+	char		*out;		// presenter (or sort) output
+	size_t		outlen;
+	int		count;
+	struct record_stats stats;
+	bool		done;
+};
+
+/* shared state between ruminate_mapped() and its json_worker()s. */
+struct json_work {
+	pthread_mutex_t	mutex;
+	pthread_cond_t	cond;
+	struct json_chunk *chunks;
+	size_t		nchunks;
+	size_t		next;		// next chunk to be claimed
+	size_t		merged;		// chunks already written out
+	size_t		window;		// most chunks claimed but not merged
+	qparam_ct	qpp;
+};
+
+/* one answer in do_batch(), shared by every line asking that question. */
+struct batch_answer {
+	struct batch_answer *hnext;	// hash chain
+	struct batch_answer *newer;	// recall order, once done
+	char		*key;		// command and effective qparams
+	char		*out;		// the framed answer, once done
+	size_t		outlen;
+	char		*status;	// ...and its status, if any
+	char		*message;
+	u_int		refs;		// batch lines yet to emit it
+	bool		done;
+	bool		failed;		// not to be recalled
+};
+
+/* one parsed batch line in do_batch()'s queue, awaiting launch. */
+struct batch_question {
+	char		*command;	// owns the strings in qd
+	struct qdesc	qd;
+	struct qparam	qp;		// in effect for this line
+	bool		ok;		// false if the line didn't parse
+};
+
+/* do_batch()'s input, and the questions parsed from it. */
+struct batch {
+	int		fd;
+	char		*buf;		// input not yet parsed...
+	size_t		off, len;	// ...is buf[off .. len)
+	size_t		size;
+	bool		eof;
+	struct batch_question *queue;	// ring of BATCH_QUEUE
+	size_t		qhead, nqueued;
+	struct qparam	qp;		// changed by $OPTIONS
+	qparam_ct	qpp;		// ...back to these
+};
+
+/* one batch line in do_batch()'s reorder buffer, awaiting its turn. */
+struct batch_line {
+	writer_t	writer;		// spooled; NULL if a repeat
+	query_t		query;		// NULL if a repeat or didn't parse
+	struct batch_answer *answer;	// NULL if the line didn't parse
+};
+
 /* Forward. */
 
 static void help(void);
@@ -70,11 +147,25 @@ static void qdesc_debug(const char *, qdesc_ct);
 static void qparam_debug(const char *, qparam_ct);
 static __attribute__((noreturn)) void usage(const char *, ...);
 static bool parse_long(const char *, long *);
+static bool parse_size(const char *, size_t *);
 static const char *qparam_ready(qparam_t);
 static const char *qparam_option(int, const char *, qparam_t);
 static verb_ct find_verb(const char *);
 static void read_configs(void);
 static void do_batch(FILE *, qparam_ct);
+static void batch_read(struct batch *, bool);
+static void batch_enqueue(struct batch *, char *);
+static struct batch_line batch_ask(struct batch_question *);
+static void batch_merge(struct batch_question *, writer_t);
+static void batch_wait(struct batch_line *, size_t *);
+static size_t batch_emit(struct batch_line *, size_t *);
+static bool batch_line_ready(const struct batch_line *);
+static void batch_line_fini(struct batch_line *);
+static char *batch_key(qdesc_ct, qparam_ct);
+static uint32_t batch_hash(const char *);
+static struct batch_answer *batch_recall(const char *);
+static struct batch_answer *batch_remember(char *);
+static void batch_forget(bool);
 static const char *batch_options(const char *, qparam_t, qparam_ct);
 static const char *batch_parse(char *, qdesc_t);
 static char *makepath(mode_e, const char *, const char *,
@@ -82,6 +173,10 @@ static char *makepath(mode_e, const char *, const char *,
 static query_t query_launcher(qdesc_ct, qparam_ct, writer_t);
 static void launch(query_t, pdns_fence_ct);
 static void ruminate_json(int, qparam_ct);
+static int json_threads(void);
+static void ruminate_mapped(char *, size_t, fetch_t, int);
+static void *json_worker(void *);
+static void json_chunk_run(struct json_chunk *, query_t);
 static const char *lookup_ok(void);
 static const char *summarize_ok(void);
 static const char *check_7bit(const char *);
@@ -110,6 +205,13 @@ const struct verb verbs[] = {
 static size_t ideal_buffer;
 static bool allow_8bit = false;
 
+/* answers to recent batch questions, for repeats of them. */
+static struct batch_answer *batch_answers[BATCH_BUCKETS];
+static struct batch_answer *recall_oldest = NULL, *recall_newest = NULL;
+static size_t recall_bytes = 0;
+static u_long batch_repeats = 0;
+static bool batch_interactive = false;
+
 /* Public. */
 
 int
@@ -123,7 +225,7 @@ main(int argc, char *argv[]) {
 	int ch;
 
 	/* global dynamic initialization. */
-	ideal_buffer = 4 * (size_t) sysconf(_SC_PAGESIZE);
+	ideal_buffer = 256 * (size_t) sysconf(_SC_PAGESIZE);
 	gettimeofday(&startup_time, NULL);
 	if ((program_name = strrchr(argv[0], '/')) == NULL)
 		program_name = argv[0];
@@ -132,12 +234,47 @@ main(int argc, char *argv[]) {
 	value = getenv(env_time_fmt);
 	if (value != NULL && strcasecmp(value, "iso") == 0)
 		iso8601 = true;
+	value = getenv(env_sort_mem);
+	if (value != NULL && !parse_size(value, &sort_memory))
+		usage("%s must be a size such as 512M", env_sort_mem);
+	value = getenv(env_cache_dir);
+	if (value != NULL && *value != '\0') {
+		cache_dir = strdup(value);
+		cache_mode = cache_on;
+	}
+	value = getenv(env_cache_ttl);
+	if (value != NULL && ns_parse_ttl(value, &cache_ttl) < 0)
+		usage("%s must be a duration such as 1h", env_cache_ttl);
+	value = getenv(env_cache_neg_ttl);
+	if (value != NULL && ns_parse_ttl(value, &cache_neg_ttl) < 0)
+		usage("%s must be a duration such as 1h", env_cache_neg_ttl);
+	value = getenv(env_cache_size);
+	if (value != NULL && !parse_size(value, &cache_size))
+		usage("%s must be a size such as 512M", env_cache_size);
+	value = getenv(env_workers);
+	if (value != NULL && (!parse_long(value, &render_workers) ||
+			      render_workers < 0))
+		usage("%s must be a number of threads", env_workers);
+	value = getenv(env_replay_speed);
+	if (value != NULL) {
+		char *end;
+
+		if (strcasecmp(value, "max") == 0) {
+			replay_speed = 0.0;
+		} else {
+			replay_speed = strtod(value, &end);
+			if (*value == '\0' || *end != '\0' ||
+			    replay_speed < 0.0)
+				usage("%s must be a speed such as 1 or max",
+				      env_replay_speed);
+		}
+	}
 	pverb = &verbs[DEFAULT_VERB];
 
 	/* process the command line options. */
 	while ((ch = getopt(argc, argv,
-			    "R:r:N:n:i:M:u:p:t:b:k:J:O:V:"
-			    "dfhIjmqSsUv8" QPARAM_GETOPT))
+			    "R:r:N:n:i:M:u:p:t:b:k:J:O:P:V:C:X:w:W:"
+			    "dfhIjmqSsTUv28" QPARAM_GETOPT))
 	       != -1)
 	{
 		switch (ch) {
@@ -294,10 +431,51 @@ main(int argc, char *argv[]) {
 			if (!parse_long(optarg, &offset) || (offset < 0))
 				usage("-O must be zero or positive");
 			break;
+		case 'P': {
+			long jobs;
+
+			if (!parse_long(optarg, &jobs) || jobs <= 0 ||
+			    jobs > INT_MAX)
+				usage("-P must be positive");
+			max_jobs = (int)jobs;
+			jobs_set = true;
+			break;
+		    }
+		case 'C':
+			if (strcasecmp(optarg, "on") == 0)
+				cache_mode = cache_on;
+			else if (strcasecmp(optarg, "only") == 0)
+				cache_mode = cache_only;
+			else if (strcasecmp(optarg, "off") == 0)
+				cache_mode = cache_off;
+			else
+				usage("-C must specify on, only, or off");
+			break;
 		case 'u':
 			if ((psys = pick_system(optarg)) == NULL)
 				usage("-u must refer to a pdns system");
 			break;
+		case 'T':
+			timing_stats = true;
+			break;
+		case 'X':
+			if ((msg = metrics_open(optarg)) != NULL)
+				usage("%s", msg);
+			break;
+		case 'w':
+			if (capture_mode != capture_off)
+				usage("-w or -W can only appear once");
+			if ((msg = capture_record(optarg)) != NULL)
+				usage("%s", msg);
+			capture_mode = capture_rec;
+			break;
+		case 'W':
+			if (capture_mode != capture_off)
+				usage("-w or -W can only appear once");
+			if ((msg = capture_replay(optarg)) != NULL)
+				usage("%s", msg);
+			capture_mode = capture_play;
+			break;
 		case 'U':
 			donotverify = true;
 			break;
@@ -393,6 +571,9 @@ main(int argc, char *argv[]) {
 		case '8':
 			allow_8bit = true;
 			break;
+		case '2':
+			http2 = true;
+			break;
 		default:
 			usage("unrecognized option");
 		}
@@ -463,6 +644,8 @@ main(int argc, char *argv[]) {
 	/* validate some interrelated options. */
 	if (multiple && batching == batch_none)
 		usage("using -m without -f makes no sense.");
+	if (jobs_set && batching == batch_none && json_fd == -1)
+		usage("using -P without -f or -J makes no sense.");
 	if (sorting == no_sort && json_fd == -1 && qp.complete)
 		usage("warning: -A and -B w/o -c or -J reqs -s or -S");
 	if ((msg = (*pverb->ok)()) != NULL)
@@ -470,6 +653,14 @@ main(int argc, char *argv[]) {
 	if ((msg = psys->verb_ok(pverb->name)) != NULL)
 		usage(msg);
 
+	/* the cache is only for API lookups, and a capture (-w or -W)
+	 * is of what the API itself said.
+	 */
+	if (json_fd != -1 || info || capture_mode != capture_off)
+		cache_mode = cache_off;
+	if (cache_mode != cache_off && (msg = cache_ready()) != NULL)
+		usage(msg);
+
 	/* get some input from somewhere, and use it to drive our output. */
 	if (json_fd != -1) {
 		/* read a JSON file. */
@@ -491,6 +682,8 @@ main(int argc, char *argv[]) {
 			usage("can't mix -g with -J");
 		if (offset != 0)
 			usage("can't mix -O with -J");
+		if (capture_mode != capture_off)
+			usage("can't mix -w or -W with -J");
 		ruminate_json(json_fd, &qp);
 		close(json_fd);
 	} else if (batching != batch_none) {
@@ -581,6 +774,19 @@ __attribute__((noreturn)) void
 my_exit(int code) {
 	/* writers and readers which are still known, must be freed. */
 	unmake_writers();
+	render_fini();
+
+	/* with -T, what was recorded along the way goes to stderr. */
+	stats_report();
+
+	/* with -X, the metrics are written one last time. */
+	metrics_fini();
+
+	/* with -w, the capture is finished; with -W, let go of it. */
+	capture_fini();
+
+	/* output which is still buffered, must be written. */
+	obuf_fini(&stdout_obuf);
 
 	/* if curl is operating, it must be shut down. */
 	unmake_curl();
@@ -592,6 +798,9 @@ my_exit(int code) {
 	/* sort key specifications and computations, are to be freed. */
 	sort_destroy();
 
+	/* the response cache may need trimming. */
+	cache_fini();
+
 	/* terminate process. */
 	DEBUG(1, true, "about to call exit(%d)\n", code);
 	exit(code);
@@ -627,11 +836,13 @@ static void
 help(void) {
 	verb_ct v;
 
-	printf("usage: %s [-cdfgGhIjmqSsUv8] [-p dns|json|csv]\n",
+	printf("usage: %s [-cdfgGhIjmqSsTUv28] [-p dns|json|csv]\n",
 	       program_name);
 	puts("\t[-k (first|last|count|name|data)[,...]]\n"
 	     "\t[-l QUERY-LIMIT] [-L OUTPUT-LIMIT] [-A after] [-B before]\n"
-	     "\t[-u system] [-O offset] [-V verb] [-M max_count] {\n"
+	     "\t[-u system] [-O offset] [-V verb] [-M max_count]\n"
+	     "\t[-P jobs] [-C on|only|off] [-X metrics_file|fd]\n"
+	     "\t[-w capture_file | -W capture_file] {\n"
 	     "\t\t-f |\n"
 	     "\t\t-J inputfile |\n"
 	     "\t\t[-t rrtype] [-b bailiwick] {\n"
@@ -645,6 +856,8 @@ help(void) {
 	puts("for -A and -B, use absolute format YYYY-MM-DD[ HH:MM:SS],\n"
 	     "\tor relative format %dw%dd%dh%dm%ds.\n"
 	     "use -c to get complete (strict) time matching for -A and -B.\n"
+	     "use -C on to cache API responses, -C only to use no network,\n"
+	     "\tor -C off to ignore the cache.\n"
 	     "use -d one or more times to ramp up the diagnostic output.\n"
 	     "for -f, stdin must contain lines of the following forms:\n"
 	     "\trrset/name/NAME[/TYPE[/BAILIWICK]]\n"
@@ -664,12 +877,20 @@ help(void) {
 	     "use -m with -f for multiple upstream queries in single result.\n"
 	     "use -m with -f -f for multiple upstream queries out of order.\n"
 	     "use -O # to skip this many results in what is returned.\n"
+	     "use -P # with -f to cap how many queries run in parallel.\n"
+	     "use -P # with -J to set how many threads decode the file.\n"
 	     "use -q for warning reticence.\n"
 	     "use -s to sort in ascending order, "
 	     "or -S for descending order.\n"
 	     "\t-s/-S can be repeated before several -k arguments.\n"
+	     "use -T to report per-fetch timing as JSON on stderr at exit.\n"
 	     "use -U to turn off SSL certificate verification.\n"
 	     "use -v to show the program version.\n"
+	     "use -w to record API responses to a capture file, and -W to\n"
+	     "\treplay them from it instead of the network.\n"
+	     "use -X to write progress metrics periodically, in the\n"
+	     "\tPrometheus text format, to a file or a numbered descriptor.\n"
+	     "use -2 to multiplex queries over few HTTP/2 connections.\n"
 	     "use -8 to allow arbitrary 8-bit values in -r and -n arguments");
 
 	puts("for -u, system must be one of:");
@@ -800,6 +1021,30 @@ parse_long(const char *in, long *out) {
 	return true;
 }
 
+/* parse a size in octets, with an optional k, m, or g suffix. Return true
+ * if ok, else return false.
+ */
+static bool
+parse_size(const char *in, size_t *out) {
+	unsigned long long result, scale = 1;
+	char *ep;
+
+	errno = 0;
+	result = strtoull(in, &ep, 10);
+	if (errno != 0 || ep == in || result == 0)
+		return false;
+	switch (tolower((u_char)*ep)) {
+	case 'k': scale = 1ULL << 10; ep++; break;
+	case 'm': scale = 1ULL << 20; ep++; break;
+	case 'g': scale = 1ULL << 30; ep++; break;
+	default: break;
+	}
+	if (*ep != '\0' || result > SIZE_MAX / scale)
+		return false;
+	*out = (size_t)(result * scale);
+	return true;
+}
+
 /* qparam_ready -- check and possibly adjust the contents of a qparam.
  */
 static const char *
@@ -1011,104 +1256,465 @@ read_configs(void) {
 
 
 /* do_batch -- implement "filter" mode, reading commands from a batch file.
+ *
+ * batch input is read as it arrives, and parsed into a bounded queue of
+ * questions, while the answers to earlier questions are still arriving.
  */
 static void
 do_batch(FILE *f, qparam_ct qpp) {
-	struct qparam qp = *qpp;
+	struct batch b = { .fd = fileno(f), .qp = *qpp, .qpp = qpp };
+	struct batch_line *lines = NULL;
 	writer_t writer = NULL;
-	char *command = NULL;
-	size_t n = 0;
+	size_t nlines = 0;
 
-	/* if doing multiple parallel upstreams, start a writer. */
+	/* if doing multiple parallel upstreams, start a writer. otherwise
+	 * each line gets a spooled writer of its own, and several lines
+	 * run at once, with their answers emitted whole, and in order
+	 * (unless -ff -m, which emits each as soon as it is done.)
+	 */
 	bool one_writer = multiple && batching != batch_verbose;
 	if (one_writer)
-		writer = writer_init(qp.output_limit);
+		writer = writer_init(b.qp.output_limit);
+	else
+		CREATE(lines, (size_t)max_jobs * sizeof *lines);
+	CREATE(b.queue, BATCH_QUEUE * sizeof *b.queue);
+	batch_interactive = isatty(STDOUT_FILENO) != 0;
 
-	while (getline(&command, &n, f) > 0) {
-		const char *msg;
-		struct qdesc qd;
-		char *nl;
+	for (;;) {
+		/* take in whatever input is here, without waiting for it. */
+		batch_read(&b, false);
 
-		/* the last line of the file may not have a newline. */
-		nl = strchr(command, '\n');
-		if (nl != NULL)
-			*nl = '\0';
+		/* ask every queued question there is room for. */
+		while (b.nqueued > 0) {
+			struct batch_question *q = &b.queue[b.qhead];
 
-		DEBUG(1, true, "do_batch(%s)\n", command);
+			if (one_writer) {
+				batch_merge(q, writer);
+			} else {
+				if (nlines >= (size_t)io_jobs())
+					break;
+				lines[nlines++] = batch_ask(q);
+			}
+			DESTROY(q->command);
+			b.qhead = (b.qhead + 1) % BATCH_QUEUE;
+			b.nqueued--;
+		}
+		if (!one_writer)
+			(void) batch_emit(lines, &nlines);
+		if (b.eof && b.nqueued == 0)
+			break;
 
-		/* if this is a $OPTIONS, parse it and change our qparams. */
-		if (strncasecmp(command, "$options",
-				(sizeof "$options") - 1) == 0)
-		{
-			if ((msg = batch_options(command, &qp, qpp)) != NULL)
-				fprintf(stderr, "%s: warning: "
-					"batch option parse error: %s\n",
-					program_name, msg);
+		/* a caller who waits for each answer before sending the
+		 * next question must get that answer before we block. if
+		 * there are no answers to wait for, wait for input instead.
+		 * (a shared writer has no lines, only fetches in flight.)
+		 */
+		if (one_writer ? !io_busy() : nlines == 0) {
+			obuf_flush(&stdout_obuf);
+			batch_read(&b, true);
 			continue;
 		}
 
-		/* if not parallelizing, start a writer here instead. */
-		if (!one_writer)
-			writer = writer_init(qp.output_limit);
+		/* otherwise wait for answers, or for input if there's room
+		 * for it.
+		 */
+		io_input(!b.eof && b.nqueued < BATCH_QUEUE ? b.fd : -1);
+		(void) io_engine_query(multiple ? NULL : lines[0].query);
+		(void) batch_emit(lines, &nlines);
+	}
+	io_input(-1);
+	DESTROY(b.queue);
+	DESTROY(b.buf);
 
-		/* crack the batch line if possible. */
-		msg = batch_parse(command, &qd);
-		if (msg != NULL) {
-			fprintf(stderr, "%s: batch entry parse error: %s\n",
+	/* if parallelized, run remaining jobs to completion, then finish up.
+	 */
+	if (one_writer) {
+		io_engine(0);
+		writer_fini(writer);
+		writer = NULL;
+	} else {
+		while (nlines > 0)
+			batch_wait(lines, &nlines);
+		DESTROY(lines);
+		batch_forget(true);
+		DEBUG(1, true, "batch: %lu repeated questions\n",
+		      batch_repeats);
+	}
+}
+
+/* batch_read -- take in batch input, parsing each line into the queue of
+ * questions, until the queue is full, the input has ended, or more input
+ * would have to be waited for. if "wait" is true, the first read may wait.
+ */
+static void
+batch_read(struct batch *b, bool wait) {
+	while (!b->eof && b->nqueued < BATCH_QUEUE) {
+		const char *nl = NULL;
+		struct pollfd pfd;
+		char *command;
+		ssize_t len;
+
+		/* parse the next complete line, if one is in hand. */
+		if (b->off < b->len)
+			nl = memchr(b->buf + b->off, '\n', b->len - b->off);
+		if (nl != NULL) {
+			command = strndup(b->buf + b->off,
+					  (size_t)(nl - (b->buf + b->off)));
+			if (command == NULL)
+				my_panic(true, "strndup");
+			b->off = (size_t)(nl - b->buf) + 1;
+			batch_enqueue(b, command);
+			continue;
+		}
+
+		/* otherwise read more, if it's here, or if we may wait. */
+		pfd = (struct pollfd){ .fd = b->fd, .events = POLLIN };
+		if (!wait && poll(&pfd, 1, 0) == 0)
+			break;
+		if (b->off > 0) {
+			memmove(b->buf, b->buf + b->off, b->len - b->off);
+			b->len -= b->off;
+			b->off = 0;
+		}
+		if (b->size - b->len < BUFSIZ) {
+			b->size = b->size == 0 ? BUFSIZ * 4 : b->size * 2;
+			b->buf = realloc(b->buf, b->size);
+			if (b->buf == NULL)
+				my_panic(true, "realloc");
+		}
+		len = read(b->fd, b->buf + b->len, b->size - b->len);
+		if (len < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			my_panic(true, "read");
+		}
+		wait = false;
+		if (len > 0) {
+			b->len += (size_t)len;
+			continue;
+		}
+
+		/* the last line of the file may not have a newline. */
+		b->eof = true;
+		if (b->off < b->len) {
+			command = strndup(b->buf + b->off, b->len - b->off);
+			if (command == NULL)
+				my_panic(true, "strndup");
+			b->off = b->len;
+			batch_enqueue(b, command);
+		}
+	}
+}
+
+/* batch_enqueue -- parse one batch line, and queue it as a question unless
+ * it was a $OPTIONS. takes ownership of the line.
+ */
+static void
+batch_enqueue(struct batch *b, char *command) {
+	struct batch_question *q;
+	const char *msg;
+
+	DEBUG(1, true, "do_batch(%s)\n", command);
+
+	/* if this is a $OPTIONS, parse it and change our qparams. */
+	if (strncasecmp(command, "$options", (sizeof "$options") - 1) == 0) {
+		if ((msg = batch_options(command, &b->qp, b->qpp)) != NULL)
+			fprintf(stderr, "%s: warning: "
+				"batch option parse error: %s\n",
 				program_name, msg);
-		} else {
-			/* start one or two curl jobs based on this search. */
-			query_t query = query_launcher(&qd, &qp, writer);
+		DESTROY(command);
+		return;
+	}
 
-			/* if merging, drain some jobs; else, drain all jobs.
-			 */
-			if (one_writer)
-				io_engine(MAX_JOBS);
-			else
-				io_engine(0);
-			if (query->status != NULL && batching != batch_verbose)
-			{
-				assert(query->message != NULL);
-				fprintf(stderr,
-					"%s: batch line status: %s (%s)\n",
-					program_name,
-					query->status, query->message);
-			}
+	/* crack the batch line if possible. */
+	q = &b->queue[(b->qhead + b->nqueued) % BATCH_QUEUE];
+	memset(q, 0, sizeof *q);
+	q->command = command;
+	q->qp = b->qp;
+	msg = batch_parse(command, &q->qd);
+	if (msg != NULL)
+		fprintf(stderr, "%s: batch entry parse error: %s\n",
+			program_name, msg);
+	q->ok = msg == NULL;
+	b->nqueued++;
+}
+
+/* batch_ask -- start the fetches for a batch question (unless it's one
+ * being answered already), into a spooled writer of its own.
+ */
+static struct batch_line
+batch_ask(struct batch_question *q) {
+	struct batch_line line = { NULL, NULL, NULL };
+
+	/* a question asked before (or still being asked) is given
+	 * the same answer, without asking the API again.
+	 */
+	if (q->ok) {
+		char *key = batch_key(&q->qd, &q->qp);
+
+		line.answer = batch_recall(key);
+		if (line.answer != NULL) {
+			DEBUG(1, true, "batch repeat (%s)\n", key);
+			DESTROY(key);
+			line.answer->refs++;
+			batch_repeats++;
+			return (line);
 		}
+		line.answer = batch_remember(key);
+	}
 
-		if (!one_writer) {
-			/* think about showing the end-of-object separator.
-			 * We reach here after all the queries from
-			 * this batch line have finished.
-			 */
-			switch (batching) {
-			case batch_none:
-				break;
-			case batch_original:
-				assert(writer->ps_buf == NULL &&
-				       writer->ps_len == 0);
-				writer->ps_buf = strdup("--\n");
-				writer->ps_len = strlen(writer->ps_buf);
-				break;
-			case batch_verbose:
-				/* query_done() will do this. */
+	line.writer = writer_init(q->qp.output_limit);
+	writer_spool(line.writer);
+
+	/* start one or two curl jobs based on this search. */
+	if (q->ok)
+		line.query = query_launcher(&q->qd, &q->qp, line.writer);
+	return (line);
+}
+
+/* batch_merge -- start the fetches for a batch question whose answer is
+ * to be merged into a writer shared by all, and drain some jobs.
+ */
+static void
+batch_merge(struct batch_question *q, writer_t writer) {
+	query_t query;
+
+	if (!q->ok)
+		return;
+	query = query_launcher(&q->qd, &q->qp, writer);
+	io_engine(io_jobs());
+	if (query->status != NULL) {
+		assert(query->message != NULL);
+		fprintf(stderr, "%s: batch line status: %s (%s)\n",
+			program_name, query->status, query->message);
+	}
+}
+
+/* batch_wait -- run the batch until at least one line has been emitted.
+ */
+static void
+batch_wait(struct batch_line *lines, size_t *nlines) {
+	while (batch_emit(lines, nlines) == 0)
+		io_engine_query(multiple ? NULL : lines[0].query);
+}
+
+/* batch_emit -- emit every line that may now go out, and return how many.
+ *
+ * lines go out in input order, except with -ff -m where any finished
+ * line may go out ahead of those still running.
+ */
+static size_t
+batch_emit(struct batch_line *lines, size_t *nlines) {
+	size_t i = 0, emitted = 0;
+
+	while (i < *nlines) {
+		if (!batch_line_ready(&lines[i])) {
+			if (!multiple)
 				break;
-			default:
-				abort();
-			}
-			writer_fini(writer);
-			writer = NULL;
-			fflush(stdout);
+			i++;
+			continue;
 		}
+		batch_line_fini(&lines[i]);
+		(*nlines)--;
+		memmove(&lines[i], &lines[i + 1],
+			(*nlines - i) * sizeof *lines);
+		emitted++;
+	}
+	return (emitted);
+}
+
+/* batch_line_ready -- has this batch line's answer finished?
+ */
+static bool
+batch_line_ready(const struct batch_line *line) {
+	if (line->query != NULL)
+		return (line->query->done);
+	return (line->answer == NULL || line->answer->done);
+}
+
+/* batch_line_fini -- report and frame one finished batch line's answer,
+ * and write it out.
+ */
+static void
+batch_line_fini(struct batch_line *line) {
+	struct batch_answer *answer = line->answer;
+	query_t query = line->query;
+	const char *status = NULL, *message = NULL;
+
+	if (query != NULL) {
+		status = query->status;
+		message = query->message;
+	} else if (answer != NULL) {
+		status = answer->status;
+		message = answer->message;
+	}
+	if (status != NULL && batching != batch_verbose) {
+		assert(message != NULL);
+		fprintf(stderr, "%s: batch line status: %s (%s)\n",
+			program_name, status, message);
+	}
+
+	/* a repeat goes out just as the first asking of it did. */
+	if (line->writer == NULL) {
+		assert(answer != NULL && answer->done);
+		obuf_write(&stdout_obuf, answer->out, answer->outlen);
+		answer->refs--;
+		line->answer = NULL;
+		batch_forget(false);
+		if (batch_interactive)
+			obuf_flush(&stdout_obuf);
+		return;
+	}
+
+	/* think about showing the end-of-object separator. */
+	switch (batching) {
+	case batch_none:
+		break;
+	case batch_original:
+		assert(line->writer->ps_buf == NULL &&
+		       line->writer->ps_len == 0);
+		line->writer->ps_buf = strdup("--\n");
+		line->writer->ps_len = strlen(line->writer->ps_buf);
+		break;
+	case batch_verbose:
+		/* query_done() will have done this. */
+		break;
+	default:
+		abort();
 	}
+
+	if (answer == NULL) {
+		writer_fini(line->writer);
+	} else {
+		/* keep the answer whole, for any repeats of this question.
+		 * failures might not happen twice, so are not recalled.
+		 */
+		if (status != NULL) {
+			answer->status = strdup(status);
+			answer->message = strdup(message);
+			answer->failed = strcmp(status, "NOERROR") != 0;
+		}
+		answer->out = writer_fini_spool(line->writer,
+						&answer->outlen);
+		obuf_write(&stdout_obuf, answer->out, answer->outlen);
+		answer->done = true;
+		if (recall_newest != NULL)
+			recall_newest->newer = answer;
+		else
+			recall_oldest = answer;
+		recall_newest = answer;
+		recall_bytes += answer->outlen;
+		answer->refs--;
+		line->answer = NULL;
+		batch_forget(false);
+	}
+	line->writer = NULL;
+	line->query = NULL;
+
+	/* someone watching should see each answer as soon as it's done. */
+	if (batch_interactive)
+		obuf_flush(&stdout_obuf);
+}
+
+/* batch_key -- describe a batch question for recognizing its repeats:
+ * the command path, and all the search parameters in effect for it.
+ *
+ * Returns a string that must be free()d.
+ */
+static char *
+batch_key(qdesc_ct qdp, qparam_ct qpp) {
+	char *command, *key;
+	int x;
+
+	command = makepath(qdp->mode, qdp->thing, qdp->rrtype,
+			   qdp->bailiwick, qdp->pfxlen);
+	x = asprintf(&key, "%s %lu %lu %ld %ld %d %d", command,
+		     qpp->after, qpp->before,
+		     qpp->query_limit, qpp->output_limit,
+		     qpp->complete, qpp->gravel);
+	if (x < 0)
+		my_panic(true, "asprintf");
 	DESTROY(command);
+	return (key);
+}
 
-	/* if parallelized, run remaining jobs to completion, then finish up.
-	 */
-	if (one_writer) {
-		io_engine(0);
-		writer_fini(writer);
-		writer = NULL;
+/* batch_hash -- FNV-1a over a batch key.
+ */
+static uint32_t
+batch_hash(const char *key) {
+	uint32_t hash = 2166136261U;
+
+	while (*key != '\0') {
+		hash ^= (u_char)*key++;
+		hash *= 16777619U;
+	}
+	return (hash);
+}
+
+/* batch_recall -- find a still-useful answer to this batch question.
+ */
+static struct batch_answer *
+batch_recall(const char *key) {
+	struct batch_answer *answer;
+
+	for (answer = batch_answers[batch_hash(key) % BATCH_BUCKETS];
+	     answer != NULL;
+	     answer = answer->hnext)
+		if (!answer->failed && strcmp(answer->key, key) == 0)
+			return (answer);
+	return (NULL);
+}
+
+/* batch_remember -- make an answer to a batch question not asked before.
+ * The answer takes ownership of the key.
+ */
+static struct batch_answer *
+batch_remember(char *key) {
+	struct batch_answer *answer = NULL, **bucket;
+
+	CREATE(answer, sizeof *answer);
+	answer->key = key;
+	answer->refs = 1;
+	bucket = &batch_answers[batch_hash(key) % BATCH_BUCKETS];
+	answer->hnext = *bucket;
+	*bucket = answer;
+	return (answer);
+}
+
+/* batch_forget -- release the oldest finished answers while their total
+ * size is over budget, or all of them, or any that failed, so long as no
+ * batch line is still waiting to emit them.
+ */
+static void
+batch_forget(bool all) {
+	struct batch_answer **pp = &recall_oldest, *prev = NULL;
+
+	while (*pp != NULL) {
+		struct batch_answer *answer = *pp, **hp;
+
+		if (answer->refs != 0 ||
+		    !(all || answer->failed || recall_bytes > BATCH_RECALL))
+		{
+			prev = answer;
+			pp = &answer->newer;
+			continue;
+		}
+
+		/* unlink it from its hash chain and the recall order. */
+		hp = &batch_answers[batch_hash(answer->key) % BATCH_BUCKETS];
+		while (*hp != answer)
+			hp = &(*hp)->hnext;
+		*hp = answer->hnext;
+		*pp = answer->newer;
+		if (recall_newest == answer)
+			recall_newest = prev;
+
+		recall_bytes -= answer->outlen;
+		DESTROY(answer->key);
+		DESTROY(answer->out);
+		DESTROY(answer->status);
+		DESTROY(answer->message);
+		DESTROY(answer);
 	}
 }
 
@@ -1415,6 +2021,10 @@ launch(query_t query, pdns_fence_ct fp) {
 }
 
 /* ruminate_json -- process a json file from the filesys rather than the API.
+ *
+ * a regular file is mapped into memory and deblocked in place, so that
+ * each record goes to data_blob() without being copied. anything else
+ * (such as a pipe) is read in large page-aligned blocks.
  */
 static void
 ruminate_json(int json_fd, qparam_ct qpp) {
@@ -1422,7 +2032,9 @@ ruminate_json(int json_fd, qparam_ct qpp) {
 	query_t query = NULL;
 	void *buf = NULL;
 	writer_t writer;
+	struct stat sb;
 	ssize_t len;
+	int threads;
 
 	writer = writer_init(qpp->output_limit);
 	CREATE(query, sizeof(struct query));
@@ -1432,15 +2044,253 @@ ruminate_json(int json_fd, qparam_ct qpp) {
 	fetch->query = query;
 	query->fetches = fetch;
 	writer->queries = query;
-	CREATE(buf, ideal_buffer);
-	while ((len = read(json_fd, buf, sizeof buf)) > 0) {
+	memset(&sb, 0, sizeof sb);
+	if (fstat(json_fd, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+		size_t size = (size_t)sb.st_size;
+
+		buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, json_fd, 0);
+		if (buf != MAP_FAILED) {
+			DEBUG(1, true, "ruminate_json: mapped %zu octets\n",
+			      size);
+			(void) madvise(buf, size, MADV_SEQUENTIAL);
+			threads = json_threads();
+			/* an output limit without sorting depends on the
+			 * order of arrival, so that case stays serial.
+			 */
+			if (threads > 1 && size > JSON_CHUNK &&
+			    (sorting != no_sort || qpp->output_limit <= 0))
+				ruminate_mapped(buf, size, query->fetches,
+						threads);
+			else
+				writer_func(buf, 1, size, query->fetches);
+			munmap(buf, size);
+			buf = NULL;
+			goto done;
+		}
+		buf = NULL;
+	}
+#ifdef F_SETPIPE_SZ
+	/* a bigger pipe means fewer, larger reads. this can fail. */
+	if (S_ISFIFO(sb.st_mode))
+		(void) fcntl(json_fd, F_SETPIPE_SZ, (int)ideal_buffer);
+#endif
+	if (posix_memalign(&buf, (size_t) sysconf(_SC_PAGESIZE),
+			   ideal_buffer) != 0)
+		my_panic(false, "posix_memalign failed");
+	while ((len = read(json_fd, buf, ideal_buffer)) > 0) {
 		writer_func(buf, 1, (size_t)len, query->fetches);
 	}
 	DESTROY(buf);
+ done:
 	writer_fini(writer);
 	writer = NULL;
 }
 
+/* json_threads -- how many workers to use for a mapped -J file.
+ *
+ * -P sets this explicitly; otherwise use one per online processor.
+ */
+static int
+json_threads(void) {
+	long ncpu;
+
+	if (jobs_set)
+		return max_jobs;
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		return 1;
+	return ncpu > MAX_JOBS ? MAX_JOBS : (int)ncpu;
+}
+
+/* ruminate_mapped -- process a mapped -J file with a pool of threads.
+ *
+ * the complete lines are cut into newline-aligned chunks which the
+ * workers claim in order, each rendering its chunk's records into a
+ * private memory stream. this thread writes those streams out (or on
+ * to the sort) strictly in chunk order, so the output is the same as
+ * for a serial run. no more than a window of chunks can be claimed
+ * ahead of the merge, which bounds the memory held in the streams.
+ * anything after the last newline is left to writer_func(), as before.
+ */
+static void
+ruminate_mapped(char *buf, size_t size, fetch_t fetch, int threads) {
+	writer_t writer = fetch->query->writer;
+	struct json_work work;
+	pthread_t *tids = NULL;
+	char *nl, *p, *end;
+	size_t chunk, i;
+	int t, rc;
+
+	nl = memrchr(buf, '\n', size);
+	if (nl == NULL) {
+		writer_func(buf, 1, size, fetch);
+		return;
+	}
+	end = nl + 1;
+
+	/* at least one chunk per thread, and none much over JSON_CHUNK. */
+	chunk = (size_t)(end - buf) / (size_t)threads;
+	if (chunk > JSON_CHUNK)
+		chunk = JSON_CHUNK;
+	memset(&work, 0, sizeof work);
+	work.qpp = &fetch->query->params;
+	work.window = 2 * (size_t)threads;
+	for (p = buf; p < end; p = nl + 1) {
+		if ((size_t)(end - p) <= chunk)
+			nl = end - 1;
+		else if ((nl = memchr(p + chunk, '\n',
+				      (size_t)(end - p) - chunk)) == NULL)
+			nl = end - 1;
+		if (work.nchunks % 1024 == 0) {
+			work.chunks = realloc(work.chunks,
+					      (work.nchunks + 1024) *
+					      sizeof *work.chunks);
+			if (work.chunks == NULL)
+				my_panic(true, "realloc");
+		}
+		memset(&work.chunks[work.nchunks], 0, sizeof *work.chunks);
+		work.chunks[work.nchunks].base = p;
+		work.chunks[work.nchunks].len = (size_t)(nl + 1 - p);
+		work.nchunks++;
+	}
+	DEBUG(1, true, "ruminate_mapped: %zu chunks, %d threads\n",
+	      work.nchunks, threads);
+
+	pthread_mutex_init(&work.mutex, NULL);
+	pthread_cond_init(&work.cond, NULL);
+	CREATE(tids, (size_t)threads * sizeof *tids);
+	for (t = 0; t < threads; t++)
+		if ((rc = pthread_create(&tids[t], NULL,
+					 json_worker, &work)) != 0)
+		{
+			errno = rc;
+			my_panic(true, "pthread_create");
+		}
+
+	for (i = 0; i < work.nchunks; i++) {
+		struct json_chunk *jc = &work.chunks[i];
+
+		pthread_mutex_lock(&work.mutex);
+		while (!jc->done)
+			pthread_cond_wait(&work.cond, &work.mutex);
+		pthread_mutex_unlock(&work.mutex);
+
+		if (jc->outlen != 0) {
+			if (sorting != no_sort) {
+				sorter_load(writer->sorter,
+					    jc->out, jc->outlen);
+			} else {
+				if (presentation == pres_csv)
+					present_csv_header(writer);
+				obuf_write(writer->out, jc->out, jc->outlen);
+			}
+		}
+		writer->count += jc->count;
+		metrics.tuples += (u_long)jc->count;
+		stats_records_add(&fetch->query->stats, &jc->stats);
+		DESTROY(jc->out);
+
+		pthread_mutex_lock(&work.mutex);
+		work.merged++;
+		pthread_cond_broadcast(&work.cond);
+		pthread_mutex_unlock(&work.mutex);
+	}
+
+	for (t = 0; t < threads; t++)
+		pthread_join(tids[t], NULL);
+	DESTROY(tids);
+	DESTROY(work.chunks);
+	pthread_cond_destroy(&work.cond);
+	pthread_mutex_destroy(&work.mutex);
+
+	if (end < buf + size)
+		writer_func(end, 1, (size_t)(buf + size - end), fetch);
+}
+
+/* json_worker -- thread body; claim and render chunks until none remain.
+ */
+static void *
+json_worker(void *arg) {
+	struct json_work *work = arg;
+	struct writer writer;
+	struct query query;
+
+	/* a private writer and query, so that nothing is shared with
+	 * the other workers except the (read only) mapped file.
+	 */
+	memset(&writer, 0, sizeof writer);
+	memset(&query, 0, sizeof query);
+	writer.csv_headerp = true;
+	writer.queries = &query;
+	query.writer = &writer;
+	query.params = *work->qpp;
+
+	pthread_mutex_lock(&work->mutex);
+	for (;;) {
+		struct json_chunk *jc;
+
+		while (work->next < work->nchunks &&
+		       work->next >= work->merged + work->window)
+			pthread_cond_wait(&work->cond, &work->mutex);
+		if (work->next == work->nchunks)
+			break;
+		jc = &work->chunks[work->next++];
+		pthread_mutex_unlock(&work->mutex);
+
+		json_chunk_run(jc, &query);
+
+		pthread_mutex_lock(&work->mutex);
+		jc->done = true;
+		pthread_cond_broadcast(&work->cond);
+	}
+	pthread_mutex_unlock(&work->mutex);
+	return NULL;
+}
+
+/* json_chunk_run -- deblock and render one chunk into its memory stream.
+ */
+static void
+json_chunk_run(struct json_chunk *jc, query_t query) {
+	writer_t writer = query->writer;
+	struct slice slices[MAX_SLICES];
+	const char *p = jc->base, *end = jc->base + jc->len;
+	struct obuf spool;
+	FILE *out = NULL;
+
+	/* sort records are written by stdio, presentations to a spool. */
+	obuf_init(&spool, -1);
+	writer->out = &spool;
+	if (sorting != no_sort) {
+		out = open_memstream(&jc->out, &jc->outlen);
+		if (out == NULL)
+			my_panic(true, "open_memstream");
+		writer->sort_spool = out;
+	}
+	writer->count = 0;
+	memset(&query->stats, 0, sizeof query->stats);
+	while (p < end) {
+		size_t i, n, used;
+
+		n = deblock_scan(p, (size_t)(end - p),
+				 slices, MAX_SLICES, &used);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++)
+			writer->count += data_blob(query,
+						   p + slices[i].offset,
+						   slices[i].len);
+		p += used;
+	}
+	if (out != NULL)
+		fclose(out);
+	else
+		jc->out = obuf_take(&spool, &jc->outlen);
+	writer->out = NULL;
+	writer->sort_spool = NULL;
+	jc->count = writer->count;
+	jc->stats = query->stats;
+}
+
 /* check if its argument is 7 bit clean ASCII.
  *
  * returns NULL on success, else an error message.
@@ -17,6 +17,7 @@
 #ifndef GLOBALS_H_INCLUDED
 #define GLOBALS_H_INCLUDED 1
 
+#include "obuf.h"
 #include "sort.h"
 
 #ifdef MAIN_PROGRAM
@@ -34,9 +35,15 @@ extern const struct verb verbs[];
 EXTERN	const char id_swclient[]	INIT("dnsdbq");
 EXTERN	const char id_version[]		INIT("2.1.1");
 EXTERN	const char *program_name	INIT(NULL);
-EXTERN	const char path_sort[]		INIT("/usr/bin/sort");
 EXTERN	const char json_header[]	INIT("Accept: application/json");
 EXTERN	const char env_time_fmt[]	INIT("DNSDBQ_TIME_FORMAT");
+EXTERN	const char env_sort_mem[]	INIT("DNSDBQ_SORT_MEMORY");
+EXTERN	const char env_cache_dir[]	INIT("DNSDBQ_CACHE_DIR");
+EXTERN	const char env_cache_ttl[]	INIT("DNSDBQ_CACHE_TTL");
+EXTERN	const char env_cache_neg_ttl[]	INIT("DNSDBQ_CACHE_NEGATIVE_TTL");
+EXTERN	const char env_cache_size[]	INIT("DNSDBQ_CACHE_SIZE");
+EXTERN	const char env_workers[]	INIT("DNSDBQ_WORKERS");
+EXTERN	const char env_replay_speed[]	INIT("DNSDBQ_REPLAY_SPEED");
 EXTERN	struct qparam qparam_empty INIT({ .query_limit = -1L, .output_limit = -1L });
 EXTERN	verb_ct pverb			INIT(NULL);
 EXTERN	pdns_system_ct psys		INIT(NULL);
@@ -45,14 +52,28 @@ EXTERN	bool donotverify		INIT(false);
 EXTERN	bool quiet			INIT(false);
 EXTERN	bool iso8601			INIT(false);
 EXTERN	bool multiple			INIT(false);
+EXTERN	bool http2			INIT(false);
+EXTERN	bool timing_stats		INIT(false);
+EXTERN	int max_jobs			INIT(MAX_JOBS);
+EXTERN	bool jobs_set			INIT(false);
 EXTERN	long offset			INIT(0L);
 EXTERN	long max_count			INIT(0L);
 EXTERN	sort_e sorting			INIT(no_sort);
+EXTERN	size_t sort_memory		INIT(SORT_MEMORY);
 EXTERN	batch_e batching		INIT(batch_none);
+EXTERN	cache_e cache_mode		INIT(cache_off);
+EXTERN	char *cache_dir			INIT(NULL);
+EXTERN	u_long cache_ttl		INIT(CACHE_TTL);
+EXTERN	u_long cache_neg_ttl		INIT(CACHE_TTL);
+EXTERN	size_t cache_size		INIT(CACHE_SIZE);
+EXTERN	long render_workers		INIT(0L);
+EXTERN	capture_e capture_mode		INIT(capture_off);
+EXTERN	double replay_speed		INIT(1.0);
 EXTERN	present_e presentation		INIT(pres_text);
 EXTERN	present_t presenter		INIT(NULL);
 EXTERN	struct timeval startup_time	INIT({});
 EXTERN	int exit_code			INIT(0);
+EXTERN	struct obuf stdout_obuf		INIT({ .fd = STDOUT_FILENO });
 
 #undef INIT
 #undef EXTERN
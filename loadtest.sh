@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Copyright (c) 2014-2020 by Farsight Security, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# loadtest.sh -- run a large "dnsdbq -f -m" batch against dnsdb-mock, and
+# report queries/s and fetch latency percentiles, from dnsdbq's -T report.
+#
+# usage: loadtest.sh [-n queries] [-p port] [-P jobs] [-D dnsdbq_flags]
+#	[-- dnsdb-mock flags]
+
+queries=1000
+port=18053
+jobs=
+flags=
+dir=`dirname "$0"`
+
+while getopts n:p:P:D: opt; do
+	case $opt in
+	n) queries=$OPTARG ;;
+	p) port=$OPTARG ;;
+	P) jobs="-P $OPTARG" ;;
+	D) flags=$OPTARG ;;
+	*) echo "usage: $0 [-n queries] [-p port] [-P jobs]" \
+		"[-D dnsdbq_flags] [-- dnsdb-mock flags]" >&2
+	   exit 1 ;;
+	esac
+done
+shift `expr $OPTIND - 1`
+
+tmp=`mktemp -d` || exit 1
+mock=
+trap '[ -n "$mock" ] && kill $mock; rm -rf "$tmp"' 0
+trap 'exit 1' 1 2 15
+
+"$dir/dnsdb-mock" -p "$port" "$@" &
+mock=$!
+sleep 1
+
+# a mix of the three kinds of question a batch tends to ask.
+awk -v n="$queries" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		k = i % 10
+		if (k < 6)
+			printf "rrset/name/host%d.example%d.com\n", i, i % 97
+		else if (k < 8)
+			printf "rdata/name/ns%d.example%d.net\n", i, i % 89
+		else
+			printf "rdata/ip/10.%d.%d.0,24\n", i / 256 % 256, i % 256
+	}
+}' > "$tmp/batch"
+
+# no cache, and no configuration but this.
+cat > "$tmp/.dnsdb-query.conf" <<END
+DNSDBQ_SYSTEM=dnsdb
+APIKEY=mock
+DNSDB_SERVER=http://127.0.0.1:$port
+END
+env -u DNSDBQ_CACHE_DIR -u DNSDB_API_KEY -u DNSDB_SERVER HOME="$tmp" \
+	"$dir/dnsdbq" -f -m -T -q $jobs $flags \
+	< "$tmp/batch" > "$tmp/out" 2> "$tmp/err"
+status=$?
+grep '^{"elapsed_us"' "$tmp/err" > "$tmp/report"
+if [ ! -s "$tmp/report" ]; then
+	echo "$0: no report from dnsdbq (exit $status)" >&2
+	cat "$tmp/err" >&2
+	exit 1
+fi
+
+grep -o '"total_us":[0-9]*' "$tmp/report" | cut -d: -f2 | sort -n \
+	> "$tmp/lat"
+elapsed=`grep -o '"elapsed_us":[0-9]*' "$tmp/report" | cut -d: -f2`
+records=`wc -l < "$tmp/out"`
+errors=`grep -o '"rcode":[0-9]*' "$tmp/report" | \
+	grep -cv '"rcode":200$\|"rcode":404$'`
+
+awk -v q="$queries" -v us="$elapsed" -v recs="$records" -v errs="$errors" '
+	{ lat[NR] = $1 }
+	function pct(p,   i) {
+		i = int(NR * p / 100 + 0.999)
+		if (i < 1) i = 1
+		return lat[i] / 1000
+	}
+	END {
+		printf "queries     %d\n", q
+		printf "fetches     %d (%d failed)\n", NR, errs
+		printf "lines out   %d\n", recs
+		printf "elapsed     %.3f s\n", us / 1e6
+		printf "queries/s   %.1f\n", q / (us / 1e6)
+		printf "latency ms  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+			pct(50), pct(90), pct(99), lat[NR] / 1000
+	}' "$tmp/lat"
+exit $status
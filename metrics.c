@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* progress metrics for long batch jobs, in the Prometheus text format.
+ * they are written out every METRICS_INTERVAL seconds from the I/O loop,
+ * and once more at exit: to a file, which is replaced whole each time by
+ * way of a temporary file and rename() so that a collector (such as
+ * node_exporter's textfile collector) never sees half of one; or to a
+ * descriptor, which gets one complete exposition after another.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "metrics.h"
+#include "obuf.h"
+#include "globals.h"
+
+struct metrics metrics;
+
+static const double metrics_bounds[METRICS_BUCKETS] = {
+	0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60
+};
+
+static char *metrics_path = NULL;	// if writing to a file...
+static int metrics_fd = -1;		// ...or else to this descriptor
+static bool metrics_on = false;
+static time_t metrics_last = 0;
+
+static void metrics_observe(struct metrics_hist *, double);
+static void metrics_write(void);
+static void metrics_hist_write(obuf_t, const char *, const char *,
+			       const struct metrics_hist *);
+static void metrics_put(obuf_t, const char *, const char *,
+			const char *, u_long);
+static time_t metrics_now(void);
+
+/* metrics_open -- start writing metrics to a file, or if the argument
+ * is a number, to that descriptor.
+ *
+ * Returns NULL on success, else an error message.
+ */
+const char *
+metrics_open(const char *where) {
+	char *end;
+	long fd;
+
+	errno = 0;
+	fd = strtol(where, &end, 10);
+	if (*where != '\0' && *end == '\0' && errno == 0) {
+		if (fd < 0 || fd > INT_MAX ||
+		    fcntl((int)fd, F_GETFD) < 0)
+			return "-X descriptor is not open";
+		metrics_fd = (int)fd;
+	} else {
+		if (*where == '\0')
+			return "-X needs a file name or a descriptor";
+		metrics_path = strdup(where);
+	}
+	metrics_on = true;
+	metrics_last = metrics_now();
+	return NULL;
+}
+
+/* metrics_fetch -- count one finished fetch and how it went.
+ */
+void
+metrics_fetch(CURL *easy, CURLcode result) {
+	double total = 0.0, ttfb = 0.0;
+	long rcode = 0;
+
+	metrics.completed++;
+	if (result != CURLE_OK) {
+		metrics.failed++;
+		if ((int)result >= 0 && result < CURL_LAST)
+			metrics.curl_codes[result]++;
+	}
+	if (!metrics_on)
+		return;
+	curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &rcode);
+	metrics.rcodes[rcode > 0 && rcode < METRICS_RCODES ? rcode : 0]++;
+	curl_easy_getinfo(easy, CURLINFO_TOTAL_TIME, &total);
+	curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+	metrics_observe(&metrics.total, total);
+	if (ttfb > 0.0)
+		metrics_observe(&metrics.ttfb, ttfb);
+}
+
+/* metrics_tick -- write the metrics out, if it's been long enough.
+ */
+void
+metrics_tick(void) {
+	time_t now;
+
+	if (!metrics_on)
+		return;
+	now = metrics_now();
+	if (now - metrics_last < METRICS_INTERVAL)
+		return;
+	metrics_last = now;
+	metrics_write();
+}
+
+/* metrics_timeout -- shorten an I/O wait (in ms, -1 for none) so that
+ * metrics_tick() will still be called on time when nothing is happening.
+ */
+int
+metrics_timeout(int timeout) {
+	if (metrics_on && (timeout < 0 || timeout > METRICS_INTERVAL * 1000))
+		timeout = METRICS_INTERVAL * 1000;
+	return (timeout);
+}
+
+/* metrics_fini -- write the metrics out one last time, and stop.
+ */
+void
+metrics_fini(void) {
+	if (!metrics_on)
+		return;
+	metrics_write();
+	metrics_on = false;
+	DESTROY(metrics_path);
+	metrics_fd = -1;
+}
+
+/* metrics_observe -- add one sample to a histogram.
+ */
+static void
+metrics_observe(struct metrics_hist *hist, double value) {
+	size_t i;
+
+	for (i = 0; i < METRICS_BUCKETS; i++)
+		if (value <= metrics_bounds[i])
+			break;
+	hist->buckets[i]++;
+	hist->sum += value;
+	hist->count++;
+}
+
+/* metrics_write -- format the metrics and write them to where they go.
+ *
+ * a failure to write is reported once, and stops the metrics, but is not
+ * a reason to abandon the job whose progress they are describing.
+ */
+static void
+metrics_write(void) {
+	struct obuf ob;
+	char *text, *tmp = NULL;
+	size_t len, off;
+	int fd, i;
+
+	obuf_init(&ob, -1);
+	metrics_put(&ob, "fetches_in_flight", "gauge",
+		    "Fetches now running.", metrics.in_flight);
+	metrics_put(&ob, "fetches_completed_total", "counter",
+		    "Fetches finished, well or not.", metrics.completed);
+	metrics_put(&ob, "fetches_failed_total", "counter",
+		    "Fetches which libcurl says failed.", metrics.failed);
+	obuf_puts(&ob, "# HELP dnsdbq_fetches_failed_by_code_total "
+		  "Failed fetches, by libcurl error code.\n"
+		  "# TYPE dnsdbq_fetches_failed_by_code_total counter\n");
+	for (i = 0; i < CURL_LAST; i++)
+		if (metrics.curl_codes[i] != 0)
+			obuf_printf(&ob, "dnsdbq_fetches_failed_by_code_total"
+				    "{curl_code=\"%d\"} %lu\n",
+				    i, metrics.curl_codes[i]);
+	obuf_puts(&ob, "# HELP dnsdbq_responses_total "
+		  "Finished fetches, by HTTP response code.\n"
+		  "# TYPE dnsdbq_responses_total counter\n");
+	for (i = 0; i < METRICS_RCODES; i++)
+		if (metrics.rcodes[i] != 0)
+			obuf_printf(&ob, "dnsdbq_responses_total"
+				    "{rcode=\"%d\"} %lu\n",
+				    i, metrics.rcodes[i]);
+	metrics_put(&ob, "received_bytes_total", "counter",
+		    "Response octets from the network.", metrics.bytes);
+	metrics_put(&ob, "tuples_emitted_total", "counter",
+		    "Records passed to the presenter or the sort.",
+		    metrics.tuples);
+	metrics_hist_write(&ob, "fetch_seconds",
+			   "Time from the start of a fetch to its end.",
+			   &metrics.total);
+	metrics_hist_write(&ob, "fetch_first_byte_seconds",
+			   "Time from the start of a fetch to its first octet.",
+			   &metrics.ttfb);
+	text = obuf_take(&ob, &len);
+
+	if (metrics_path != NULL) {
+		if (asprintf(&tmp, "%s.tmp", metrics_path) < 0)
+			my_panic(true, "asprintf");
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	} else {
+		fd = metrics_fd;
+	}
+	for (off = 0; fd != -1 && off < len; ) {
+		ssize_t n = write(fd, text + off, len - off);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += (size_t)n;
+	}
+	if (metrics_path != NULL && fd != -1 &&
+	    (close(fd) < 0 || (off == len && rename(tmp, metrics_path) < 0)))
+		off = 0;
+	if (fd == -1 || off < len) {
+		fprintf(stderr, "%s: warning: cannot write metrics to %s: %s\n",
+			program_name, or_else(metrics_path, "descriptor"),
+			strerror(errno));
+		if (tmp != NULL)
+			(void) unlink(tmp);
+		metrics_on = false;
+	}
+	DESTROY(tmp);
+	DESTROY(text);
+}
+
+/* metrics_hist_write -- format one histogram, with cumulative buckets.
+ */
+static void
+metrics_hist_write(obuf_t ob, const char *name, const char *help,
+		   const struct metrics_hist *hist)
+{
+	u_long cumulative = 0;
+	int i;
+
+	obuf_printf(ob, "# HELP dnsdbq_%s %s\n# TYPE dnsdbq_%s histogram\n",
+		    name, help, name);
+	for (i = 0; i < METRICS_BUCKETS; i++) {
+		cumulative += hist->buckets[i];
+		obuf_printf(ob, "dnsdbq_%s_bucket{le=\"%g\"} %lu\n",
+			    name, metrics_bounds[i], cumulative);
+	}
+	obuf_printf(ob, "dnsdbq_%s_bucket{le=\"+Inf\"} %lu\n"
+		    "dnsdbq_%s_sum %.6f\ndnsdbq_%s_count %lu\n",
+		    name, hist->count, name, hist->sum, name, hist->count);
+}
+
+/* metrics_put -- format one metric having a single value.
+ */
+static void
+metrics_put(obuf_t ob, const char *name, const char *type,
+	    const char *help, u_long value)
+{
+	obuf_printf(ob, "# HELP dnsdbq_%s %s\n# TYPE dnsdbq_%s %s\n"
+		    "dnsdbq_%s %lu\n", name, help, name, type, name, value);
+}
+
+/* metrics_now -- seconds on a clock which never goes backward.
+ */
+static time_t
+metrics_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef METRICS_H_INCLUDED
+#define METRICS_H_INCLUDED 1
+
+#include <sys/types.h>
+#include <stdbool.h>
+#include <curl/curl.h>
+
+#define	METRICS_BUCKETS 12
+#define	METRICS_RCODES 600
+
+/* a latency histogram; each bucket counts only its own range. */
+struct metrics_hist {
+	u_long		buckets[METRICS_BUCKETS + 1];	// the last is +Inf
+	double		sum;
+	u_long		count;
+};
+
+/* counters for -X. the hot ones are bumped in line, unconditionally,
+ * which is cheaper than asking first whether anyone wants them.
+ */
+struct metrics {
+	u_long		in_flight;
+	u_long		completed;
+	u_long		failed;
+	u_long		bytes;
+	u_long		tuples;
+	u_long		curl_codes[CURL_LAST];
+	u_long		rcodes[METRICS_RCODES];	// anything odd counts as 0
+	struct metrics_hist total, ttfb;
+};
+
+extern struct metrics metrics;
+
+const char *metrics_open(const char *);
+void metrics_fetch(CURL *, CURLcode);
+void metrics_tick(void);
+int metrics_timeout(int);
+void metrics_fini(void);
+
+#endif /*METRICS_H_INCLUDED*/
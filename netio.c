@@ -19,29 +19,109 @@
 #define _DEFAULT_SOURCE
 
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "defs.h"
+#include "cache.h"
+#include "capture.h"
+#include "deblock.h"
+#include "metrics.h"
 #include "netio.h"
 #include "pdns.h"
+#include "render.h"
+#include "stats.h"
 #include "globals.h"
 
 static void io_drain(void);
+static void io_replay(void);
+static void io_replay_add(fetch_t);
+static bool io_replay_capture(fetch_t, size_t *);
 static void fetch_reap(fetch_t);
 static void fetch_done(fetch_t);
 static void fetch_unlink(fetch_t);
 static void query_done(query_t);
+static void query_header(query_t);
+static void writer_close(writer_t);
+static bool writer_line(fetch_t, const char *, size_t);
+static void fetch_save(fetch_t, const char *, size_t);
+static int io_socket_cb(CURL *, curl_socket_t, int, void *, void *);
+static int io_timer_cb(CURLM *, long, void *);
+static void io_action(curl_socket_t, int);
+static void io_wait(void);
+static CURL *easy_get(void);
+static void easy_put(CURL *);
+static void aimd_update(CURL *, CURLcode);
 
 static writer_t writers = NULL;
 static CURLM *multi = NULL;
+static CURLSH *share = NULL;
 static bool curl_cleanup_needed = false;
-static query_t paused[MAX_JOBS];
-static int npaused = 0;
+static u_long queries_done = 0;
+
+/* fetches answered without the network (from the cache or a -W capture),
+ * which are replayed through writer_func() when io_engine() next runs, so
+ * that all of a query's fetches exist before any of them can finish it.
+ * a capture replayed at its original pace stays here until it ends, and
+ * io_wait() wakes up when the soonest of those has its next chunk due.
+ */
+static fetch_t *io_replays = NULL;
+static size_t io_nreplays = 0, io_maxreplays = 0;
+static long io_replay_wait = -1;	/* ms; -1 if nothing is waiting. */
+
+/* event loop state. libcurl tells us (via io_socket_cb() and io_timer_cb())
+ * which sockets it wants watched and when it next needs a timeout tick;
+ * we do the waiting, and tell libcurl what happened via io_action().
+ */
+static long io_timeout = -1;	/* ms; -1 means libcurl has no timer. */
+static int io_running = 0;	/* transfers libcurl says are unfinished. */
+static int io_attached = 0;	/* easy handles we've added to "multi". */
+static int io_registered = 0;	/* sockets libcurl has asked us to watch. */
+static char io_known;		/* socketp marker for registered sockets. */
+#ifdef __linux__
+static int io_epfd = -1;
+#else
+static struct pollfd *io_pollfds = NULL;
+static size_t io_npollfds = 0;
+#endif
+
+/* a non-curl descriptor (batch input) which io_engine_query() also waits
+ * for. a regular file can't be waited for, but is always ready anyway.
+ */
+static int io_input_fd = -1;
+static bool io_input_always = false;
+static bool io_input_seen = false;
+
+/* easy handle pool. a finished fetch's handle is reset and kept here for
+ * the next fetch, rather than being torn down and built up again.
+ */
+static CURL **easy_pool = NULL;
+static size_t easy_pool_len = 0, easy_pool_size = 0;
+
+/* adaptive concurrency. the batch window grows by about one fetch per
+ * window's worth of healthy completions, and is halved on a 429, a 5xx,
+ * a transport error, or a time-to-first-byte well above the best seen.
+ * after a cut, another window's worth of completions must pass before
+ * the next cut, so that one bad burst only counts once.
+ */
+#define AIMD_SLACK 0.050	/* seconds of TTFB growth we ignore. */
+static double aimd_window = 0.0;
+static double aimd_ttfb_min = 0.0, aimd_ttfb_avg = 0.0;
+static int aimd_holdoff = 0;
+
+/* reuse statistics, reported at -d. */
+static u_long stat_fetches = 0, stat_easy_reused = 0,
+	stat_conns_made = 0, stat_conns_reused = 0;
 
 /* make_curl -- perform global initializations of libcurl.
  */
@@ -55,23 +135,100 @@ make_curl(void) {
 			program_name);
 		my_exit(1);
 	}
+#ifdef __linux__
+	io_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (io_epfd < 0)
+		my_panic(true, "epoll_create1");
+#endif
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, io_socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, io_timer_cb);
+#if CURL_AT_LEAST_VERSION(7,43,0)
+	if (http2) {
+		/* put up to H2_STREAMS fetches on each connection, and
+		 * only open as many connections as -P needs for that.
+		 */
+		curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+				  CURLPIPE_MULTIPLEX);
+		curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+				  (long)((max_jobs + H2_STREAMS - 1) /
+					 H2_STREAMS));
+#if CURL_AT_LEAST_VERSION(7,67,0)
+		curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+				  (long)H2_STREAMS);
+#endif /* CURL_AT_LEAST_VERSION */
+	}
+#endif /* CURL_AT_LEAST_VERSION */
+
+	/* every fetch goes to the same server, so let all of them share
+	 * DNS answers, TLS sessions, and (where supported) connections.
+	 * we are single threaded, so no lock functions are needed.
+	 */
+	share = curl_share_init();
+	if (share == NULL) {
+		fprintf(stderr, "%s: curl_share_init() failed\n",
+			program_name);
+		my_exit(1);
+	}
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if CURL_AT_LEAST_VERSION(7,57,0)
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif /* CURL_AT_LEAST_VERSION */
 }
 
 /* unmake_curl -- clean up and discard libcurl's global state.
  */
 void
 unmake_curl(void) {
+	if (stat_fetches != 0)
+		DEBUG(1, true, "curl: %lu fetches, %lu easy handles reused, "
+		      "%lu of %lu connections reused\n",
+		      stat_fetches, stat_easy_reused, stat_conns_reused,
+		      stat_conns_made + stat_conns_reused);
+	stat_fetches = stat_easy_reused = 0;
+	stat_conns_made = stat_conns_reused = 0;
+
+	/* pooled handles must go before the share they are attached to. */
+	while (easy_pool_len > 0)
+		curl_easy_cleanup(easy_pool[--easy_pool_len]);
+	DESTROY(easy_pool);
+	easy_pool_size = 0;
+	queries_done = 0;
+	DESTROY(io_replays);
+	io_nreplays = io_maxreplays = 0;
 	if (multi != NULL) {
 		curl_multi_cleanup(multi);
 		multi = NULL;
 	}
+#ifdef __linux__
+	if (io_epfd != -1) {
+		close(io_epfd);
+		io_epfd = -1;
+	}
+#else
+	DESTROY(io_pollfds);
+	io_npollfds = 0;
+#endif
+	aimd_window = aimd_ttfb_min = aimd_ttfb_avg = 0.0;
+	aimd_holdoff = 0;
+	io_input_fd = -1;
+	io_input_always = io_input_seen = false;
+	io_timeout = -1;
+	io_running = 0;
+	io_attached = 0;
+	metrics.in_flight = 0;
+	io_registered = 0;
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
 	if (curl_cleanup_needed) {
 		curl_global_cleanup();
 		curl_cleanup_needed = false;
 	}
 }
 
-/* fetch -- given a url, tell libcurl to go fetch it.
+/* fetch -- given a url, tell libcurl to go fetch it, unless it's cached.
  */
 void
 create_fetch(query_t query, char *url) {
@@ -82,15 +239,65 @@ create_fetch(query_t query, char *url) {
 	CREATE(fetch, sizeof *fetch);
 	fetch->query = query;
 	query = NULL;
-	fetch->easy = curl_easy_init();
+	fetch->url = url;
+	url = NULL;
+
+	/* linked-list insert. */
+	fetch->next = fetch->query->fetches;
+	fetch->query->fetches = fetch;
+	fetch->render = render_wanted(fetch->query->writer);
+
+	if (capture_mode == capture_play) {
+		fetch->replay = capture_find(fetch->url);
+		if (fetch->replay != NULL) {
+			fetch->rcode = capture_rcode(fetch->replay);
+		} else if (!fetch->query->status_set) {
+			query_status(fetch->query, "ERROR", "not in capture");
+			fetch->query->status_set = true;
+			if (!quiet)
+				fprintf(stderr, "%s: warning: not in capture "
+					"[%s]\n", program_name, fetch->url);
+			exit_code = 1;
+		}
+		io_replay_add(fetch);
+		return;
+	}
+
+	if (cache_mode != cache_off && !fetch->query->writer->info) {
+		const char *message = cache_negative(fetch->url);
+		bool negative = message != NULL;
+
+		if (!negative)
+			fetch->cached = cache_lookup(fetch->url);
+		if (negative && !fetch->query->status_set) {
+			/* as the 404 which put it there did. */
+			query_status(fetch->query, "NOERROR", message);
+			fetch->query->status_set = true;
+		} else if (fetch->cached == NULL && !negative &&
+			   cache_mode == cache_only &&
+			   !fetch->query->status_set)
+		{
+			query_status(fetch->query, "ERROR", "not in cache");
+			fetch->query->status_set = true;
+			if (!quiet)
+				fprintf(stderr, "%s: warning: not in cache "
+					"[%s]\n", program_name, fetch->url);
+			exit_code = 1;
+		}
+		if (fetch->cached != NULL || negative ||
+		    cache_mode == cache_only)
+		{
+			io_replay_add(fetch);
+			return;
+		}
+		fetch->fill = cache_fill_start(fetch->url);
+	}
+
+	fetch->easy = easy_get();
 	if (fetch->easy == NULL) {
 		/* an error will have been output by libcurl in this case. */
-		DESTROY(fetch);
-		DESTROY(url);
 		my_exit(1);
 	}
-	fetch->url = url;
-	url = NULL;
 	curl_easy_setopt(fetch->easy, CURLOPT_URL, fetch->url);
 	if (donotverify) {
 		curl_easy_setopt(fetch->easy, CURLOPT_SSL_VERIFYPEER, 0L);
@@ -106,20 +313,29 @@ create_fetch(query_t query, char *url) {
 #if CURL_AT_LEAST_VERSION(7,42,0)
 	/* do not allow curl to swallow /./ and /../ in our URLs */
 	curl_easy_setopt(fetch->easy, CURLOPT_PATH_AS_IS, 1L);
+#endif /* CURL_AT_LEAST_VERSION */
+#if CURL_AT_LEAST_VERSION(7,47,0)
+	if (http2) {
+		/* ask for h2 over TLS, and prefer waiting for a stream on
+		 * an existing connection over opening a new connection.
+		 */
+		curl_easy_setopt(fetch->easy, CURLOPT_HTTP_VERSION,
+				 (long)CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(fetch->easy, CURLOPT_PIPEWAIT, 1L);
+	}
 #endif /* CURL_AT_LEAST_VERSION */
 	if (debug_level >= 3)
 		curl_easy_setopt(fetch->easy, CURLOPT_VERBOSE, 1L);
 
-	/* linked-list insert. */
-	fetch->next = fetch->query->fetches;
-	fetch->query->fetches = fetch;
-
 	res = curl_multi_add_handle(multi, fetch->easy);
 	if (res != CURLM_OK) {
 		fprintf(stderr, "%s: curl_multi_add_handle() failed: %s\n",
 			program_name, curl_multi_strerror(res));
 		my_exit(1);
 	}
+	io_attached++;
+	metrics.in_flight++;
+	capture_start(fetch);
 }
 
 /* fetch_reap -- reap one fetch.
@@ -127,19 +343,71 @@ create_fetch(query_t query, char *url) {
 static void
 fetch_reap(fetch_t fetch) {
 	if (fetch->easy != NULL) {
-		curl_multi_remove_handle(multi, fetch->easy);
-		curl_easy_cleanup(fetch->easy);
+		if (curl_multi_remove_handle(multi, fetch->easy) == CURLM_OK) {
+			io_attached--;
+			metrics.in_flight--;
+		}
+		easy_put(fetch->easy);
 		fetch->easy = NULL;
 	}
 	if (fetch->hdrs != NULL) {
 		curl_slist_free_all(fetch->hdrs);
 		fetch->hdrs = NULL;
 	}
+	if (fetch->cached != NULL) {
+		fclose(fetch->cached);
+		fetch->cached = NULL;
+	}
+	if (fetch->fill != NULL) {
+		cache_fill_end(fetch->fill, false);
+		fetch->fill = NULL;
+	}
 	DESTROY(fetch->url);
 	DESTROY(fetch->buf);
+	DESTROY(fetch->message);
 	DESTROY(fetch);
 }
 
+/* easy_get -- take an easy handle from the pool, or make a new one.
+ */
+static CURL *
+easy_get(void) {
+	CURL *easy;
+
+	stat_fetches++;
+	if (easy_pool_len > 0) {
+		easy = easy_pool[--easy_pool_len];
+		stat_easy_reused++;
+	} else {
+		easy = curl_easy_init();
+		if (easy == NULL)
+			return NULL;
+	}
+	/* curl_easy_reset() in easy_put() also forgot our share. */
+	curl_easy_setopt(easy, CURLOPT_SHARE, share);
+	return easy;
+}
+
+/* easy_put -- reset an easy handle and return it to the pool.
+ */
+static void
+easy_put(CURL *easy) {
+	if (easy_pool_len == easy_pool_size) {
+		size_t size = easy_pool_size == 0 ? START_JOBS
+			: easy_pool_size * 2;
+		CURL **pool = realloc(easy_pool, size * sizeof *pool);
+
+		if (pool == NULL) {
+			curl_easy_cleanup(easy);
+			return;
+		}
+		easy_pool = pool;
+		easy_pool_size = size;
+	}
+	curl_easy_reset(easy);
+	easy_pool[easy_pool_len++] = easy;
+}
+
 /* fetch_done -- deal with consequences of end-of-fetch.
  */
 static void
@@ -176,28 +444,17 @@ writer_init(long output_limit) {
 
 	CREATE(writer, sizeof(struct writer));
 	writer->output_limit = output_limit;
+	writer->out = &stdout_obuf;
 
 	if (sorting != no_sort) {
-		/* sorting involves a subprocess (POSIX sort(1) command),
-		 * which will by definition not output anything until
-		 * after it receives EOF. this means we can pipe both
-		 * to its stdin and from its stdout, without risk of
-		 * deadlock. it also means a full store-and-forward of
-		 * the result, which increases latency to the first
-		 * output for our user.
+		/* sorting is a full store-and-forward of the result,
+		 * which increases latency to the first output for our
+		 * user. records are held in memory up to a budget, and
+		 * spilled to temporary files beyond that. with an output
+		 * limit, only that many need be kept at all.
 		 */
-		int p1[2], p2[2];
-
-		if (pipe(p1) < 0 || pipe(p2) < 0)
-			my_panic(true, "pipe");
-		if ((writer->sort_pid = fork()) < 0)
-			my_panic(true, "fork");
-		if (writer->sort_pid == 0)
-			exec_sort(p1, p2);
-		close(p1[0]);
-		writer->sort_stdin = fdopen(p1[1], "w");
-		writer->sort_stdout = fdopen(p2[0], "r");
-		close(p2[1]);
+		writer->sorter = sorter_new(output_limit > 0
+					    ? (size_t)output_limit : 0);
 	}
 
 	writer->next = writers;
@@ -205,6 +462,18 @@ writer_init(long output_limit) {
 	return (writer);
 }
 
+/* writer_spool -- hold a writer's output in memory until writer_fini().
+ *
+ * this lets several batch lines run at once, each into its own spool,
+ * while their answers still come out whole and in the right order.
+ */
+void
+writer_spool(writer_t writer) {
+	assert(writer->out == &stdout_obuf);
+	obuf_init(&writer->spool, -1);
+	writer->out = &writer->spool;
+}
+
 /* query_status -- install a status code and description in a query.
  */
 void
@@ -227,51 +496,27 @@ size_t
 writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 	fetch_t fetch = (fetch_t) blob;
 	query_t query = fetch->query;
-	writer_t writer = query->writer;
-	qparam_ct qp = &query->params;
 	size_t bytes = size * nmemb;
-	char *nl;
+	const char *p, *end, *nl;
 
 	DEBUG(3, true, "writer_func(%d, %d): %d\n",
 	      (int)size, (int)nmemb, (int)bytes);
 
-	/* if we're in asynchronous batch mode, only one query can reach
-	 * the writer at a time. fetches within a query can interleave. */
-	if (batching == batch_verbose) {
-		if (multiple) {
-			if (writer->active == NULL) {
-				/* grab the token. */
-				writer->active = query;
-				DEBUG(2, true, "active (%d) %s\n",
-				      npaused, query->command);
-			} else if (writer->active != query) {
-				/* pause the query. */
-				paused[npaused++] = query;
-				DEBUG(2, true, "pause (%d) %s\n",
-				      npaused, query->command);
-				return CURL_WRITEFUNC_PAUSE;
-			}
-		}
-		if (!query->hdr_sent) {
-			printf("++ %s\n", query->command);
-			query->hdr_sent = true;
-		}
-	}
-
-	fetch->buf = realloc(fetch->buf, fetch->len + bytes);
-	memcpy(fetch->buf + fetch->len, ptr, bytes);
-	fetch->len += bytes;
+	query_header(query);
+	if (fetch->easy != NULL)
+		metrics.bytes += bytes;
+	capture_chunk(fetch, ptr, bytes);
 
-	/* when the fetch is a live web result, emit
+	/* when the fetch is a live (or replayed) web result, emit
 	 * !2xx errors and info payloads as reports.
 	 */
-	if (fetch->easy != NULL) {
-		if (fetch->rcode == 0)
+	if (fetch->easy != NULL || fetch->replay != NULL) {
+		if (fetch->rcode == 0 && fetch->easy != NULL)
 			curl_easy_getinfo(fetch->easy,
 					  CURLINFO_RESPONSE_CODE,
 					  &fetch->rcode);
 		if (fetch->rcode != 200) {
-			char *message = strndup(fetch->buf, fetch->len);
+			char *message = strndup(ptr, bytes);
 			/* only report the first line of data */
 			char *eol = strpbrk(message, "\r\n");
 			if (eol != NULL)
@@ -282,11 +527,12 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 					     psys->status(fetch),
 					     message);
 				if (!quiet) {
-					char *url;
+					char *url = fetch->url;
 
-					curl_easy_getinfo(fetch->easy,
+					if (fetch->easy != NULL)
+						curl_easy_getinfo(fetch->easy,
 							CURLINFO_EFFECTIVE_URL,
-							  &url);
+							&url);
 					fprintf(stderr,
 						"%s: warning: "
 						"libcurl %ld [%s]\n",
@@ -298,48 +544,133 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 			if (!quiet)
 				fprintf(stderr, "%s: warning: libcurl: [%s]\n",
 					program_name, message);
+			/* a NOERROR response is remembered with this. */
+			if (fetch->fill != NULL && fetch->message == NULL) {
+				fetch->message = message;
+				message = NULL;
+			}
 			DESTROY(message);
-			fetch->buf[0] = '\0';
-			fetch->len = 0;
 			return (bytes);
 		}
 	}
 
-	/* deblock. */
-	while ((nl = memchr(fetch->buf, '\n', fetch->len)) != NULL) {
-		size_t pre_len = (size_t)(nl - fetch->buf),
-			post_len = (fetch->len - pre_len) - 1;
+	/* a good live response may also be going into the cache. */
+	if (fetch->fill != NULL)
+		cache_fill(fetch->fill, ptr, bytes);
 
-		if (sorting == no_sort && writer->output_limit > 0 &&
-		    writer->count >= writer->output_limit)
-		{
-			DEBUG(9, true, "hit output limit %ld\n",
-			      qp->output_limit);
-			/* cause CURLE_WRITE_ERROR for this transfer. */
-			bytes = 0;
-			/* inform io_engine() that the abort is intentional. */
-			fetch->stopped = true;
-		} else if (writer->info) {
-			/* concatenate this fragment (with \n) to info_buf. */
-			char *temp = NULL;
-
-			asprintf(&temp, "%s%*.*s\n",
-				 or_else(writer->ps_buf, ""),
-				 (int)pre_len, (int)pre_len, fetch->buf);
-			DESTROY(writer->ps_buf);
-			writer->ps_buf = temp;
-			writer->ps_len += pre_len + 1;
-		} else {
-			query->writer->count +=
-				data_blob(query,
-					  fetch->buf,
-					  pre_len);
+	/* deblock. complete lines are handed on straight out of the
+	 * caller's buffer, a batch of slices at a time; only a line which
+	 * straddles two calls is ever copied, into fetch->buf, until its
+	 * newline arrives.
+	 */
+	p = ptr;
+	end = ptr + bytes;
+	if (fetch->len != 0) {
+		nl = memchr(p, '\n', (size_t)(end - p));
+		if (nl == NULL) {
+			fetch_save(fetch, p, (size_t)(end - p));
+			return (bytes);
 		}
-		memmove(fetch->buf, nl + 1, post_len);
-		fetch->len = post_len;
+		fetch_save(fetch, p, (size_t)(nl - p));
+		p = nl + 1;
+		if (!writer_line(fetch, fetch->buf, fetch->len))
+			goto stopped;
+		fetch->len = 0;
 	}
+	while (p < end) {
+		struct slice slices[MAX_SLICES];
+		size_t i, n, used;
 
+		n = deblock_scan(p, (size_t)(end - p),
+				 slices, MAX_SLICES, &used);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++)
+			if (!writer_line(fetch, p + slices[i].offset,
+					 slices[i].len))
+				goto stopped;
+		p += used;
+	}
+	if (p < end)
+		fetch_save(fetch, p, (size_t)(end - p));
+	if (fetch->render) {
+		render_submit(query->writer);
+		render_sink(query->writer, false);
+	}
 	return (bytes);
+
+ stopped:
+	/* cause CURLE_WRITE_ERROR for this transfer. */
+	fetch->len = 0;
+	return (0);
+}
+
+/* writer_line -- process one deblocked line of json text for a fetch.
+ *
+ * Returns false if the output limit has been reached.
+ */
+static bool
+writer_line(fetch_t fetch, const char *line, size_t len) {
+	query_t query = fetch->query;
+	writer_t writer = query->writer;
+
+	if (sorting == no_sort && writer->output_limit > 0 &&
+	    writer->count >= writer->output_limit)
+	{
+		DEBUG(9, true, "hit output limit %ld\n",
+		      query->params.output_limit);
+		/* inform io_engine() that the abort is intentional. */
+		fetch->stopped = true;
+		return false;
+	}
+	if (writer->info) {
+		/* concatenate this fragment (with \n) to info_buf. */
+		char *temp = NULL;
+
+		asprintf(&temp, "%s%*.*s\n",
+			 or_else(writer->ps_buf, ""),
+			 (int)len, (int)len, line);
+		DESTROY(writer->ps_buf);
+		writer->ps_buf = temp;
+		writer->ps_len += len + 1;
+	} else if (fetch->render) {
+		render_line(fetch, line, len);
+	} else {
+		int n = data_blob(query, line, len);
+
+		writer->count += n;
+		metrics.tuples += (u_long)n;
+	}
+	return true;
+}
+
+/* fetch_save -- append to a fetch's partial line buffer, growing it.
+ */
+static void
+fetch_save(fetch_t fetch, const char *ptr, size_t len) {
+	if (fetch->len + len > fetch->bufsize) {
+		size_t size = fetch->bufsize == 0 ? BUFSIZ : fetch->bufsize;
+
+		while (size < fetch->len + len)
+			size *= 2;
+		fetch->buf = realloc(fetch->buf, size);
+		if (fetch->buf == NULL)
+			my_panic(true, "realloc");
+		fetch->bufsize = size;
+	}
+	memcpy(fetch->buf + fetch->len, ptr, len);
+	fetch->len += len;
+}
+
+/* query_header -- in verbose batch mode, each query has a writer of its
+ * own, and its answer starts with a ++ line naming it.
+ */
+static void
+query_header(query_t query) {
+	if (batching == batch_verbose && !query->hdr_sent) {
+		obuf_printf(query->writer->out, "++ %s\n", query->command);
+		query->hdr_sent = true;
+	}
 }
 
 /* query_done -- do something with leftover buffer data when a query ends.
@@ -347,45 +678,24 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 static void
 query_done(query_t query) {
 	DEBUG(2, true, "query_done(%s)\n", query->command);
+	query->done = true;
+	queries_done++;
 
-	/* if this was an actively written query, unpause another. */
 	if (batching == batch_verbose) {
 		writer_t writer = query->writer;
 
-		if (multiple) {
-			assert(writer->active == query);
-			writer->active = NULL;
-		}
 		assert(writer->ps_buf == NULL && writer->ps_len == 0);
 		writer->ps_len = (size_t)
 			asprintf(&writer->ps_buf, "-- %s (%s)\n",
 				 or_else(query->status, "NOERROR"),
 				 or_else(query->message, "no error"));
-		if (npaused > 0) {
-			query_t unpause;
-			fetch_t fetch;
-			int i;
-
-			/* unpause the next query's fetches. */
-			unpause = paused[0];
-			npaused--;
-			for (i = 0; i < npaused; i++)
-				paused[i] = paused[i + 1];
-			for (fetch = unpause->fetches;
-			     fetch != NULL;
-			     fetch = fetch->next) {
-				DEBUG(2, true, "unpause (%d) %s\n",
-				      npaused, unpause->command);
-				curl_easy_pause(fetch->easy, CURLPAUSE_CONT);
-			}
-		}
 	}
 }
 
-/* writer_fini -- stop a writer's fetches, and perhaps execute a POSIX "sort".
+/* writer_close -- stop a writer's fetches, and perhaps execute a POSIX "sort".
  */
-void
-writer_fini(writer_t writer) {
+static void
+writer_close(writer_t writer) {
 	/* unlink this writer from the global chain. */
 	if (writers == writer) {
 		writers = writer->next;
@@ -403,6 +713,9 @@ writer_fini(writer_t writer) {
 		prev->next = writer->next;
 	}
 
+	/* collect whatever is still out in the rendering pool. */
+	render_sink(writer, true);
+
 	/* finish and close any fetches still cooking. */
 	while (writer->queries != NULL) {
 		query_t query = writer->queries,
@@ -427,6 +740,7 @@ writer_fini(writer_t writer) {
 			query->fetches = fetch_next;
 		}
 		assert((query->status != NULL) == (query->message != NULL));
+		stats_query(query);
 		DESTROY(query->status);
 		DESTROY(query->message);
 		DESTROY(query->command);
@@ -435,128 +749,86 @@ writer_fini(writer_t writer) {
 	}
 
 	/* drain the sort if there is one. */
-	if (writer->sort_pid != 0) {
-		int status, count;
-		char *line = NULL;
-		size_t n = 0;
-
-		/* when sorting, there has been no output yet. gather the
-		 * intermediate representation from the POSIX sort stdout,
-		 * skip over the sort keys we added earlier, and process.
-		 */
-		fclose(writer->sort_stdin);
-		DEBUG(1, true, "closed sort_stdin, wrote %d objs\n",
-			 writer->count);
-		count = 0;
-		while (getline(&line, &n, writer->sort_stdout) > 0) {
-			/* if we're above the limit, ignore remaining output.
-			 * this is nec'y to avoid SIGPIPE from sort if we were
-			 * to close its stdout pipe without emptying it first.
-			 */
-			if (writer->output_limit > 0 &&
-			    count >= writer->output_limit)
-			{
-				if (!writer->sort_killed) {
-					kill(writer->sort_pid, SIGTERM);
-					writer->sort_killed = true;
-				}
-				continue;
-			}
+	if (writer->sorter != NULL) {
+		const char *json;
+		size_t len;
+		int count;
 
+		/* when sorting, there has been no output yet. */
+		DEBUG(1, true, "sorting, wrote %d objs\n", writer->count);
+		count = 0;
+		while ((writer->output_limit <= 0 ||
+			count < writer->output_limit) &&
+		       (json = sorter_next(writer->sorter, &len)) != NULL)
+		{
 			struct pdns_tuple tup;
-			char *nl, *linep;
 			const char *msg;
-			size_t len;
 
-			if ((nl = strchr(line, '\n')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no \\n found in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep = line;
 			DEBUG(2, true, "sort1: '%*.*s'\n",
-				 (int)(nl - linep),
-				 (int)(nl - linep),
-				 linep);
-			/* skip sort keys (first, last, count, name, data). */
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no SP found in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no second SP in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no third SP in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no fourth SP in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			if ((linep = strchr(linep, ' ')) == NULL) {
-				fprintf(stderr,
-					"%s: warning: no fifth SP in '%s'\n",
-					program_name, line);
-				continue;
-			}
-			linep += strspn(linep, " ");
-			DEBUG(2, true, "sort2: '%*.*s'\n",
-				 (int)(nl - linep),
-				 (int)(nl - linep),
-				 linep);
-			len = (size_t)(nl - linep);
-			msg = tuple_make(&tup, linep, len);
+			      (int)len, (int)len, json);
+			msg = tuple_make(&tup, json, len);
 			if (msg != NULL) {
 				fprintf(stderr,
 					"%s: warning: tuple_make: %s\n",
 					program_name, msg);
 				continue;
 			}
-			(*presenter)(&tup, linep, len, writer);
+			(*presenter)(&tup, json, len, writer);
 			tuple_unmake(&tup);
 			count++;
 		}
-		DESTROY(line);
-		fclose(writer->sort_stdout);
-		DEBUG(1, true, "closed sort_stdout, read %d objs (lim %ld)\n",
+		sorter_free(writer->sorter);
+		writer->sorter = NULL;
+		DEBUG(1, true, "sort done, read %d objs (lim %ld)\n",
 		      count, writer->output_limit);
-		if (waitpid(writer->sort_pid, &status, 0) < 0) {
-			perror("waitpid");
-		} else {
-			if (!writer->sort_killed && status != 0)
-				fprintf(stderr,
-					"%s: warning: sort "
-					"exit status is %u\n",
-					program_name, (unsigned)status);
-		}
 	}
 
 	/* burp out the stored postscript, if any, and destroy it. */
 	if (writer->ps_len > 0) {
-		if (writer->info)
+		if (writer->info) {
+			/* this goes by way of stdio. */
+			obuf_flush(writer->out);
 			psys->info_blob(writer->ps_buf, writer->ps_len);
-		else
-			fwrite(writer->ps_buf, 1, writer->ps_len, stdout);
+		} else {
+			obuf_write(writer->out, writer->ps_buf, writer->ps_len);
+		}
 		DESTROY(writer->ps_buf);
 		writer->ps_len = 0;
 	}
+}
 
+/* writer_fini -- finish a writer and write out anything it has spooled.
+ */
+void
+writer_fini(writer_t writer) {
+	char *spool;
+	size_t len;
+
+	if (writer->out == &stdout_obuf) {
+		writer_close(writer);
+		DESTROY(writer);
+		return;
+	}
+
+	/* a spooled writer's output goes out all at once, now. */
+	spool = writer_fini_spool(writer, &len);
+	obuf_write(&stdout_obuf, spool, len);
+	DESTROY(spool);
+}
+
+/* writer_fini_spool -- finish a spooled writer and hand back its output.
+ *
+ * Returns a string of *lenp octets that must be free()d.
+ */
+char *
+writer_fini_spool(writer_t writer, size_t *lenp) {
+	char *spool;
+
+	assert(writer->out == &writer->spool);
+	writer_close(writer);
+	spool = obuf_take(&writer->spool, lenp);
 	DESTROY(writer);
+	return (spool);
 }
 
 void
@@ -565,42 +837,366 @@ unmake_writers(void) {
 		writer_fini(writers);
 }
 
+/* io_jobs -- how many fetches the adaptive window says may be outstanding.
+ */
+int
+io_jobs(void) {
+	if (aimd_window == 0.0)
+		aimd_window = START_JOBS < max_jobs ? START_JOBS : max_jobs;
+	return (int)aimd_window;
+}
+
+/* io_busy -- are any fetches still running, or being replayed?
+ */
+bool
+io_busy(void) {
+	return (io_attached > 0 || io_nreplays > 0);
+}
+
+/* aimd_update -- adjust the concurrency window based on a finished fetch.
+ */
+static void
+aimd_update(CURL *easy, CURLcode result) {
+	const char *why = NULL;
+	long rcode = 0;
+	double ttfb;
+
+	(void) io_jobs();
+	curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &rcode);
+	if (result != CURLE_OK) {
+		why = "transport error";
+	} else if (rcode == 429) {
+		why = "rate limited";
+	} else if (rcode >= 500) {
+		why = "server error";
+	} else {
+#if CURL_AT_LEAST_VERSION(7,61,0)
+		curl_off_t us = 0;
+
+		curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME_T, &us);
+		ttfb = (double)us / 1e6;
+#else
+		ttfb = 0.0;
+		curl_easy_getinfo(easy, CURLINFO_STARTTRANSFER_TIME, &ttfb);
+#endif /* CURL_AT_LEAST_VERSION */
+		if (aimd_ttfb_min == 0.0 || ttfb < aimd_ttfb_min)
+			aimd_ttfb_min = ttfb;
+		if (aimd_ttfb_avg == 0.0)
+			aimd_ttfb_avg = ttfb;
+		else
+			aimd_ttfb_avg = (aimd_ttfb_avg * 7 + ttfb) / 8;
+		if (aimd_ttfb_avg > aimd_ttfb_min * 2 &&
+		    aimd_ttfb_avg - aimd_ttfb_min > AIMD_SLACK)
+		{
+			why = "ttfb rising";
+			/* at the floor, this latency is the new normal. */
+			if (aimd_window <= 1.0)
+				aimd_ttfb_min = aimd_ttfb_avg;
+		}
+	}
+
+	if (aimd_holdoff > 0)
+		aimd_holdoff--;
+	if (why != NULL) {
+		if (aimd_holdoff == 0 && aimd_window > 1.0) {
+			aimd_window /= 2;
+			if (aimd_window < 1.0)
+				aimd_window = 1.0;
+			aimd_holdoff = (int)aimd_window;
+			DEBUG(2, true, "aimd: %s (%ld), window %d\n",
+			      why, rcode, (int)aimd_window);
+		}
+	} else if (aimd_window < (double)max_jobs) {
+		int before = (int)aimd_window;
+
+		aimd_window += 1.0 / aimd_window;
+		if (aimd_window > (double)max_jobs)
+			aimd_window = (double)max_jobs;
+		if ((int)aimd_window != before)
+			DEBUG(2, true, "aimd: window %d\n",
+			      (int)aimd_window);
+	}
+}
+
 /* io_engine -- let libcurl run until there are few enough outstanding jobs.
+ *
+ * this is event driven: we sleep in epoll (or poll) until either a socket
+ * libcurl cares about becomes ready or libcurl's own timer expires, and
+ * we only look for finished transfers when libcurl's running count says
+ * that some transfer has actually completed.
  */
 void
 io_engine(int jobs) {
-	int still, repeats, numfds;
-
 	DEBUG(2, true, "io_engine(%d)\n", jobs);
+	io_replay();
 
-	/* let libcurl run while there are too many jobs remaining. */
-	still = 0;
-	repeats = 0;
-	while (curl_multi_perform(multi, &still) == CURLM_OK && still > jobs) {
-		DEBUG(3, true, "...waiting (still %d)\n", still);
-		numfds = 0;
-		if (curl_multi_wait(multi, NULL, 0, 0, &numfds) != CURLM_OK)
-			break;
-		if (numfds == 0) {
-			/* curl_multi_wait() can return 0 fds for no reason. */
-			if (++repeats > 1) {
-				struct timespec req, rem;
-
-				req = (struct timespec){
-					.tv_sec = 0,
-					.tv_nsec = 100*1000*1000  // 100ms
-				};
-				while (nanosleep(&req, &rem) == EINTR) {
-					/* as required by nanosleep(3). */
-					req = rem;
-				}
-			}
-		} else {
-			repeats = 0;
+	/* newly added handles are started by a timeout tick, and this also
+	 * gives us an accurate running count to compare against.
+	 */
+	io_action(CURL_SOCKET_TIMEOUT, 0);
+	while (io_running + (int)io_nreplays > jobs) {
+		DEBUG(3, true, "...waiting (running %d)\n", io_running);
+		io_wait();
+		metrics_tick();
+		io_replay();
+	}
+	io_drain();
+}
+
+/* io_engine_query -- let libcurl run until a query is done, or if the
+ * query is NULL, until any one query that was running is done, or until
+ * the io_input() descriptor, if any, is readable.
+ *
+ * Returns true if the io_input() descriptor is readable.
+ */
+bool
+io_engine_query(query_t query) {
+	u_long done = queries_done;
+
+	DEBUG(2, true, "io_engine_query(%s)\n",
+	      query != NULL ? query->command : "any");
+	io_input_seen = io_input_always;
+	io_replay();
+	io_action(CURL_SOCKET_TIMEOUT, 0);
+	while ((query != NULL ? !query->done : queries_done == done) &&
+	       (io_attached > 0 || io_nreplays > 0) && !io_input_seen)
+	{
+		DEBUG(3, true, "...waiting (running %d)\n", io_running);
+		io_wait();
+		metrics_tick();
+		io_replay();
+	}
+	io_drain();
+	return (io_input_seen);
+}
+
+/* io_input -- have io_engine_query() also wait for a descriptor to become
+ * readable, or if it is -1, stop doing so.
+ */
+void
+io_input(int fd) {
+	if (fd == io_input_fd)
+		return;
+#ifdef __linux__
+	if (io_input_fd != -1 && !io_input_always)
+		(void) epoll_ctl(io_epfd, EPOLL_CTL_DEL, io_input_fd, NULL);
+	io_input_always = false;
+	if (fd != -1) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(io_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			if (errno != EPERM)
+				my_panic(true, "epoll_ctl");
+			io_input_always = true;
 		}
+	}
+#endif
+	io_input_fd = fd;
+	io_input_seen = false;
+}
+
+/* io_action -- tell libcurl about a socket event or a timeout, then reap.
+ */
+static void
+io_action(curl_socket_t s, int mask) {
+	CURLMcode res;
+
+	res = curl_multi_socket_action(multi, s, mask, &io_running);
+	if (res != CURLM_OK) {
+		fprintf(stderr, "%s: curl_multi_socket_action() failed: %s\n",
+			program_name, curl_multi_strerror(res));
+		my_exit(1);
+	}
+	/* output that found its reader gone inside a callback ends us. */
+	obuf_closed();
+	/* fewer running than attached means some transfer has finished. */
+	if (io_running < io_attached)
 		io_drain();
+}
+
+/* io_wait -- block until libcurl has something to do, and then let it.
+ */
+static void
+io_wait(void) {
+	int timeout = (int)io_timeout;
+
+	/* libcurl has transfers running, so it must have either a timer
+	 * or some sockets. if it has neither, don't wait forever.
+	 */
+	if (io_timeout < 0 && io_registered == 0)
+		timeout = 1000;
+	/* a replayed fetch may have its next chunk due sooner. */
+	if (io_nreplays > 0 && io_replay_wait >= 0 &&
+	    (timeout < 0 || timeout > io_replay_wait))
+		timeout = (int)io_replay_wait;
+	timeout = metrics_timeout(timeout);
+#ifdef __linux__
+	struct epoll_event events[MAX_JOBS];
+	int i, n;
+
+	n = epoll_wait(io_epfd, events, MAX_JOBS, timeout);
+	if (n < 0) {
+		if (errno == EINTR)
+			return;
+		my_panic(true, "epoll_wait");
 	}
-	io_drain();
+	if (n == 0) {
+		io_timeout = -1;
+		io_action(CURL_SOCKET_TIMEOUT, 0);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		int mask = 0;
+
+		if (events[i].data.fd == io_input_fd) {
+			io_input_seen = true;
+			continue;
+		}
+		if ((events[i].events & EPOLLIN) != 0)
+			mask |= CURL_CSELECT_IN;
+		if ((events[i].events & EPOLLOUT) != 0)
+			mask |= CURL_CSELECT_OUT;
+		if ((events[i].events & (EPOLLERR|EPOLLHUP)) != 0)
+			mask |= CURL_CSELECT_ERR;
+		io_action(events[i].data.fd, mask);
+	}
+#else
+	struct pollfd *fds = NULL;
+	size_t i, nfds = io_npollfds;
+	int n;
+
+	/* io_action() can change io_pollfds, so poll a private copy,
+	 * with the io_input() descriptor (if any) after libcurl's.
+	 */
+	CREATE(fds, (nfds + 1) * sizeof *fds);
+	if (nfds != 0)
+		memcpy(fds, io_pollfds, nfds * sizeof *fds);
+	fds[nfds].fd = io_input_fd;
+	fds[nfds].events = POLLIN;
+	n = poll(fds, (nfds_t)nfds + 1, timeout);
+	if (n < 0) {
+		DESTROY(fds);
+		if (errno == EINTR)
+			return;
+		my_panic(true, "poll");
+	}
+	if (n == 0) {
+		io_timeout = -1;
+		io_action(CURL_SOCKET_TIMEOUT, 0);
+	}
+	if (fds[nfds].revents != 0) {
+		io_input_seen = true;
+		n--;
+	}
+	for (i = 0; n > 0 && i < nfds; i++) {
+		int mask = 0;
+
+		if (fds[i].revents == 0)
+			continue;
+		if ((fds[i].revents & POLLIN) != 0)
+			mask |= CURL_CSELECT_IN;
+		if ((fds[i].revents & POLLOUT) != 0)
+			mask |= CURL_CSELECT_OUT;
+		if ((fds[i].revents & (POLLERR|POLLHUP|POLLNVAL)) != 0)
+			mask |= CURL_CSELECT_ERR;
+		io_action(fds[i].fd, mask);
+		n--;
+	}
+	DESTROY(fds);
+#endif
+}
+
+/* io_socket_cb -- libcurl wants us to start, change, or stop watching a socket.
+ *
+ * This function's signature must conform to CURLMOPT_SOCKETFUNCTION.
+ */
+static int
+io_socket_cb(CURL *easy __attribute__((unused)),
+	     curl_socket_t s, int what,
+	     void *userp __attribute__((unused)),
+	     void *socketp)
+{
+	DEBUG(3, true, "io_socket_cb(%d, %d)\n", (int)s, what);
+#ifdef __linux__
+	if (what == CURL_POLL_REMOVE) {
+		/* the socket may already be closed, which is harmless. */
+		(void) epoll_ctl(io_epfd, EPOLL_CTL_DEL, s, NULL);
+	} else {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof ev);
+		if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+			ev.events |= EPOLLIN;
+		if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+			ev.events |= EPOLLOUT;
+		ev.data.fd = s;
+		if (epoll_ctl(io_epfd, socketp == NULL
+				? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+			      s, &ev) < 0)
+		{
+			/* a recycled descriptor number can confuse us. */
+			if (errno == EEXIST)
+				(void) epoll_ctl(io_epfd, EPOLL_CTL_MOD,
+						 s, &ev);
+			else if (errno == ENOENT)
+				(void) epoll_ctl(io_epfd, EPOLL_CTL_ADD,
+						 s, &ev);
+			else
+				my_panic(true, "epoll_ctl");
+		}
+	}
+#else
+	size_t i;
+
+	for (i = 0; i < io_npollfds; i++)
+		if (io_pollfds[i].fd == s)
+			break;
+	if (what == CURL_POLL_REMOVE) {
+		if (i < io_npollfds)
+			io_pollfds[i] = io_pollfds[--io_npollfds];
+	} else {
+		if (i == io_npollfds) {
+			io_pollfds = realloc(io_pollfds,
+					     ++io_npollfds *
+					     sizeof *io_pollfds);
+			if (io_pollfds == NULL)
+				my_panic(true, "realloc");
+			io_pollfds[i].fd = s;
+		}
+		io_pollfds[i].events = 0;
+		io_pollfds[i].revents = 0;
+		if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+			io_pollfds[i].events |= POLLIN;
+		if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+			io_pollfds[i].events |= POLLOUT;
+	}
+#endif
+	if (what == CURL_POLL_REMOVE) {
+		if (socketp != NULL)
+			io_registered--;
+		curl_multi_assign(multi, s, NULL);
+	} else if (socketp == NULL) {
+		io_registered++;
+		curl_multi_assign(multi, s, &io_known);
+	}
+	return 0;
+}
+
+/* io_timer_cb -- libcurl wants to be called back after some milliseconds.
+ *
+ * This function's signature must conform to CURLMOPT_TIMERFUNCTION.
+ */
+static int
+io_timer_cb(CURLM *m __attribute__((unused)),
+	    long timeout_ms,
+	    void *userp __attribute__((unused)))
+{
+	DEBUG(4, true, "io_timer_cb(%ld)\n", timeout_ms);
+	io_timeout = timeout_ms;
+	return 0;
 }
 
 /* io_drain -- drain the response code reports.
@@ -622,7 +1218,22 @@ io_drain(void) {
 		query = fetch->query;
 
 		if (cm->msg == CURLMSG_DONE) {
+			long conns = 0;
+
 			DEBUG(2, true, "io_drain(%s) DONE\n", query->command);
+			/* zero new connections means an old one was reused. */
+			if (curl_easy_getinfo(cm->easy_handle,
+					      CURLINFO_NUM_CONNECTS,
+					      &conns) == CURLE_OK)
+			{
+				if (conns == 0)
+					stat_conns_reused++;
+				else
+					stat_conns_made += (u_long)conns;
+			}
+			/* an intentional abort says nothing about the server. */
+			if (!fetch->stopped)
+				aimd_update(cm->easy_handle, cm->data.result);
 			if (cm->data.result == CURLE_COULDNT_RESOLVE_HOST) {
 				fprintf(stderr,
 					"%s: warning: libcurl failed since "
@@ -645,6 +1256,30 @@ io_drain(void) {
 					curl_easy_strerror(cm->data.result));
 				exit_code = 1;
 			}
+			if (fetch->fill != NULL) {
+				long rcode = 0;
+				bool whole = cm->data.result == CURLE_OK &&
+					!fetch->stopped;
+
+				curl_easy_getinfo(cm->easy_handle,
+						  CURLINFO_RESPONSE_CODE,
+						  &rcode);
+				/* remember lookups which found nothing, and
+				 * what was said about that.
+				 */
+				fetch->rcode = rcode;
+				if (whole && rcode != 200 &&
+				    fetch->message != NULL &&
+				    strcmp(psys->status(fetch), "NOERROR") == 0)
+					cache_negative_add(fetch->url,
+							   fetch->message);
+				cache_fill_end(fetch->fill,
+					       whole && rcode == 200);
+				fetch->fill = NULL;
+			}
+			capture_end(fetch, cm->data.result);
+			stats_fetch(fetch, cm->data.result);
+			metrics_fetch(cm->easy_handle, cm->data.result);
 			fetch_done(fetch);
 			fetch_unlink(fetch);
 			fetch_reap(fetch);
@@ -653,6 +1288,96 @@ io_drain(void) {
 	}
 }
 
+/* io_replay -- run the fetches answered from the cache or a capture, if
+ * any, through writer_func() just as though their responses had come from
+ * the API. a capture being replayed at its original pace gives what is due
+ * so far, and is kept for later if it has more to come.
+ */
+static void
+io_replay(void) {
+	size_t i = 0;
+
+	io_replay_wait = -1;
+	while (i < io_nreplays) {
+		fetch_t fetch = io_replays[i];
+		char buf[65536];
+		size_t len, total = 0;
+
+		DEBUG(2, true, "io_replay(%s)\n", fetch->query->command);
+		if (fetch->replay != NULL) {
+			if (!io_replay_capture(fetch, &total)) {
+				i++;
+				continue;
+			}
+		} else if (fetch->cached == NULL) {
+			/* a live 404 would have had a body, and so a header. */
+			query_header(fetch->query);
+		}
+		while (fetch->cached != NULL &&
+		       (len = fread(buf, 1, sizeof buf, fetch->cached)) > 0)
+		{
+			total += len;
+			if (writer_func(buf, 1, len, fetch) != len)
+				break;
+		}
+		io_nreplays--;
+		memmove(io_replays + i, io_replays + i + 1,
+			(io_nreplays - i) * sizeof *io_replays);
+		stats_replay(fetch, total);
+		fetch_done(fetch);
+		fetch_unlink(fetch);
+		fetch_reap(fetch);
+	}
+}
+
+/* io_replay_add -- queue a fetch to be answered by io_replay().
+ */
+static void
+io_replay_add(fetch_t fetch) {
+	if (io_nreplays == io_maxreplays) {
+		io_maxreplays = io_maxreplays == 0
+			? START_JOBS : io_maxreplays * 2;
+		io_replays = realloc(io_replays,
+				     io_maxreplays * sizeof *io_replays);
+		if (io_replays == NULL)
+			my_panic(true, "realloc");
+	}
+	io_replays[io_nreplays++] = fetch;
+}
+
+/* io_replay_capture -- give a fetch the chunks of its capture which are
+ * due, adding their length to *totalp.
+ *
+ * Returns true if the fetch has ended, as it did when it was captured.
+ */
+static bool
+io_replay_capture(fetch_t fetch, size_t *totalp) {
+	CURLcode result;
+	char *data;
+	size_t len;
+	long wait;
+
+	while ((wait = capture_next(fetch->replay, &data, &len)) == 0) {
+		*totalp += len;
+		if (writer_func(data, 1, len, fetch) != len)
+			return true;
+	}
+	if (wait > 0) {
+		if (io_replay_wait < 0 || wait < io_replay_wait)
+			io_replay_wait = wait;
+		return false;
+	}
+	result = capture_result(fetch->replay);
+	if (result != CURLE_OK && !fetch->stopped) {
+		fprintf(stderr,
+			"%s: warning: libcurl failed with "
+			"curl error %d (%s) (captured)\n",
+			program_name, result, curl_easy_strerror(result));
+		exit_code = 1;
+	}
+	return true;
+}
+
 /* escape -- HTML-encode a string, in place.
  */
 void
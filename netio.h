@@ -20,6 +20,8 @@
 #include <stdbool.h>
 #include <curl/curl.h>
 
+#include "obuf.h"
+
 /* search parameters, per query and globally. */
 struct qparam {
 	u_long		after;
@@ -39,13 +41,27 @@ struct fetch {
 	CURL		*easy;
 	struct curl_slist  *hdrs;
 	char		*url;
-	char		*buf;
+	char		*buf;		// trailing partial line, if any
 	size_t		len;
+	size_t		bufsize;
 	long		rcode;
 	bool		stopped;
+	FILE		*cached;	// if answered from the cache
+	struct cache_fill *fill;	// if going into the cache
+	char		*message;	// ...and the first line of a !2xx body
+	bool		render;		// lines go to the rendering pool
+	u_long		record;		// its id in the -w capture, if any
+	struct capture_fetch *replay;	// if answered from a -W capture
 };
 typedef struct fetch *fetch_t;
 
+/* what became of a query's records, for -T. */
+struct record_stats {
+	u_long		parsed;
+	u_long		filtered;	// by time fencing
+	u_long		emitted;	// to the presenter or the sort
+};
+
 /* one query; one per invocation (or per batch line if parallel.) */
 struct query {
 	struct query	*next;
@@ -56,8 +72,10 @@ struct query {
 	/* invariant: (status == NULL) == (writer == NULL) */
 	char		*status;
 	char		*message;
+	struct record_stats stats;
 	bool		hdr_sent;
 	bool		status_set;
+	bool		done;		// all of its fetches have finished
 };
 typedef struct query *query_t;
 
@@ -65,17 +83,17 @@ typedef struct query *query_t;
 struct writer {
 	struct writer	*next;
 	struct query	*queries;
-	struct query	*active;
-	FILE		*sort_stdin;
-	FILE		*sort_stdout;
-	pid_t		sort_pid;
-	bool		sort_killed;
+	obuf_t		out;		// where presenters write: stdout,
+	struct obuf	spool;		// ...or this, until writer_fini()
+	struct sorter	*sorter;	// if sorting
+	FILE		*sort_spool;	// ...or write sort records here
 	bool		csv_headerp;
 	bool		info;		// indicates -I (almost its own verb)
 	char		*ps_buf;	// postscript, from -I (info) or...
 	size_t		ps_len;		// ...the "--" marker if batching
 	long		output_limit;
 	int		count;
+	struct render_queue *render;	// batches out in the pool, if any
 };
 typedef struct writer *writer_t;
 
@@ -83,11 +101,17 @@ void make_curl(void);
 void unmake_curl(void);
 void create_fetch(query_t, char *);
 writer_t writer_init(long);
+void writer_spool(writer_t);
 void query_status(query_t, const char *, const char *);
 size_t writer_func(char *ptr, size_t size, size_t nmemb, void *blob);
 void writer_fini(writer_t);
+char *writer_fini_spool(writer_t, size_t *);
 void unmake_writers(void);
 void io_engine(int);
+bool io_engine_query(query_t);
+void io_input(int);
+int io_jobs(void);
+bool io_busy(void);
 void escape(CURL *, char **);
 
 #endif /*NETIO_H_INCLUDED*/
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "obuf.h"
+#include "globals.h"
+
+static void obuf_writev(int, struct iovec *, int);
+
+static bool obuf_epipe = false;
+
+/* obuf_init -- start an empty buffer for a descriptor, or -1 for a spool.
+ * no memory is allocated until something is written.
+ */
+void
+obuf_init(obuf_t ob, int fd) {
+	memset(ob, 0, sizeof *ob);
+	ob->fd = fd;
+}
+
+/* obuf_fini -- write out (or if a spool, discard) what a buffer holds,
+ * and release its memory.
+ */
+void
+obuf_fini(obuf_t ob) {
+	obuf_flush(ob);
+	DESTROY(ob->base);
+	ob->len = ob->size = 0;
+}
+
+/* obuf_flush -- write out all that a buffer holds, if it has a descriptor.
+ */
+void
+obuf_flush(obuf_t ob) {
+	struct iovec iov;
+
+	if (ob->fd == -1 || ob->len == 0)
+		return;
+	iov = (struct iovec){ .iov_base = ob->base, .iov_len = ob->len };
+	ob->len = 0;
+	obuf_writev(ob->fd, &iov, 1);
+}
+
+/* obuf_room -- make room for at least "need" more octets, by writing out
+ * what's there if the buffer has a descriptor, otherwise by growing it.
+ */
+void
+obuf_room(obuf_t ob, size_t need) {
+	size_t size;
+
+	if (ob->fd != -1 && ob->len + need > ob->size)
+		obuf_flush(ob);
+	if (ob->len + need <= ob->size)
+		return;
+	size = ob->size != 0 ? ob->size
+		: ob->fd != -1 ? OUT_BUFFER : BUFSIZ;
+	while (size < ob->len + need)
+		size *= 2;
+	ob->base = realloc(ob->base, size);
+	if (ob->base == NULL)
+		my_panic(true, "realloc");
+	ob->size = size;
+}
+
+/* obuf_write -- append some octets to a buffer.
+ *
+ * a block too large to be worth copying goes straight out to the
+ * descriptor, in the same writev() as whatever was already buffered.
+ */
+void
+obuf_write(obuf_t ob, const void *buf, size_t len) {
+	if (len == 0)
+		return;
+	if (ob->fd != -1 && len >= OUT_BUFFER / 2) {
+		struct iovec iov[2] = {
+			{ .iov_base = ob->base, .iov_len = ob->len },
+			{ .iov_base = (void *)(uintptr_t)buf, .iov_len = len }
+		};
+		bool pending = ob->len != 0;
+
+		ob->len = 0;
+		obuf_writev(ob->fd, pending ? iov : iov + 1, pending ? 2 : 1);
+		return;
+	}
+	if (len > ob->size - ob->len)
+		obuf_room(ob, len);
+	memcpy(ob->base + ob->len, buf, len);
+	ob->len += len;
+}
+
+/* obuf_printf -- append formatted text to a buffer.
+ */
+void
+obuf_printf(obuf_t ob, const char *fmt, ...) {
+	va_list ap;
+	int n;
+
+	if (ob->base == NULL)
+		obuf_room(ob, 1);
+	va_start(ap, fmt);
+	n = vsnprintf(ob->base + ob->len, ob->size - ob->len, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		my_panic(true, "vsnprintf");
+	if ((size_t)n >= ob->size - ob->len) {
+		/* didn't fit, so make room (which can move it) and redo. */
+		obuf_room(ob, (size_t)n + 1);
+		va_start(ap, fmt);
+		n = vsnprintf(ob->base + ob->len, ob->size - ob->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			my_panic(true, "vsnprintf");
+	}
+	ob->len += (size_t)n;
+}
+
+/* obuf_take -- hand over a spool's contents, leaving it empty.
+ *
+ * Returns a string of *lenp octets (not NUL terminated) that must be
+ * free()d, or NULL if nothing was written.
+ */
+char *
+obuf_take(obuf_t ob, size_t *lenp) {
+	char *base = ob->base;
+
+	*lenp = ob->len;
+	ob->base = NULL;
+	ob->len = ob->size = 0;
+	return (base);
+}
+
+/* obuf_closed -- if our reader went away while SIGPIPE was ignored (as
+ * libcurl ignores it while calling us back), die of it now, quietly, the
+ * way a write outside of a callback would have.
+ *
+ * this must not be called from inside a libcurl callback.
+ */
+void
+obuf_closed(void) {
+	if (!obuf_epipe)
+		return;
+	(void) signal(SIGPIPE, SIG_DFL);
+	(void) raise(SIGPIPE);
+}
+
+/* obuf_writev -- write out all of an iovec array, resuming after short
+ * writes. the array is consumed.
+ *
+ * once the reader has gone away (EPIPE), all further output is discarded
+ * until obuf_closed() is called.
+ */
+static void
+obuf_writev(int fd, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0 && !obuf_epipe) {
+		ssize_t n = writev(fd, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EPIPE) {
+				obuf_epipe = true;
+				break;
+			}
+			my_panic(true, "writev");
+		}
+		while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= (ssize_t)iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= (size_t)n;
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef OBUF_H_INCLUDED
+#define OBUF_H_INCLUDED 1
+
+#include <sys/types.h>
+#include <string.h>
+#include <unistd.h>
+
+/* an output buffer, which presenters format into. one having a descriptor
+ * is written out there in large writev()s; one without grows in memory,
+ * as a spool, until taken.
+ */
+struct obuf {
+	char	*base;
+	size_t	len;
+	size_t	size;
+	int	fd;		// -1 if a spool
+};
+typedef struct obuf *obuf_t;
+
+void obuf_init(obuf_t, int);
+void obuf_fini(obuf_t);
+void obuf_flush(obuf_t);
+void obuf_closed(void);
+void obuf_room(obuf_t, size_t);
+void obuf_write(obuf_t, const void *, size_t);
+void obuf_printf(obuf_t, const char *, ...)
+	__attribute__((format(printf, 2, 3)));
+char *obuf_take(obuf_t, size_t *);
+
+/* obuf_putc -- append one character, the common case without a call.
+ */
+static inline void
+obuf_putc(obuf_t ob, char ch) {
+	if (ob->len == ob->size)
+		obuf_room(ob, 1);
+	ob->base[ob->len++] = ch;
+}
+
+/* obuf_puts -- append a string, without its NUL.
+ */
+static inline void
+obuf_puts(obuf_t ob, const char *str) {
+	obuf_write(ob, str, strlen(str));
+}
+
+#endif /*OBUF_H_INCLUDED*/
@@ -15,6 +15,7 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
 
 #include "defs.h"
 #include "netio.h"
@@ -22,7 +23,12 @@
 #include "time.h"
 #include "globals.h"
 
-static void present_csv_line(pdns_tuple_ct, const char *);
+static void present_csv_line(pdns_tuple_ct, const char *, writer_t);
+static void present_quoted(obuf_t, const char *);
+static void present_rr(obuf_t, pdns_tuple_ct, const char *);
+static void present_time(obuf_t, u_long, bool);
+static const char *tuple_dom(pdns_tuple_t, const char *, size_t);
+static bool tuple_fast(pdns_tuple_t, const char *, size_t);
 
 /* present_text_look -- render one pdns tuple in "dig" style ascii text.
  */
@@ -30,73 +36,82 @@ void
 present_text_lookup(pdns_tuple_ct tup,
 		    const char *jsonbuf __attribute__ ((unused)),
 		    size_t jsonlen __attribute__ ((unused)),
-		    writer_t writer __attribute__ ((unused)))
+		    writer_t writer)
 {
+	obuf_t out = writer->out;
 	bool pflag, ppflag;
 	const char *prefix;
 
 	ppflag = false;
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL && tup->obj.time_last != NULL) {
-		printf(";; record times: %s",
-			time_str(tup->time_first, iso8601));
-		printf(" .. %s\n",
-			time_str(tup->time_last, iso8601));
+	if (tup->has.time_first && tup->has.time_last) {
+		obuf_puts(out, ";; record times: ");
+		present_time(out, tup->time_first, false);
+		obuf_puts(out, " .. ");
+		present_time(out, tup->time_last, false);
+		obuf_putc(out, '\n');
 		ppflag = true;
 	}
-	if (tup->obj.zone_first != NULL && tup->obj.zone_last != NULL) {
-		printf(";;   zone times: %s",
-			time_str(tup->zone_first, iso8601));
-		printf(" .. %s\n",
-			time_str(tup->zone_last, iso8601));
+	if (tup->has.zone_first && tup->has.zone_last) {
+		obuf_puts(out, ";;   zone times: ");
+		present_time(out, tup->zone_first, false);
+		obuf_puts(out, " .. ");
+		present_time(out, tup->zone_last, false);
+		obuf_putc(out, '\n');
 		ppflag = true;
 	}
 
 	/* Count and Bailiwick. */
 	prefix = ";;";
 	pflag = false;
-	if (tup->obj.count != NULL) {
-		printf("%s count: %lld", prefix, (long long)tup->count);
+	if (tup->has.count) {
+		obuf_printf(out, "%s count: %lld",
+			    prefix, (long long)tup->count);
 		prefix = ";";
 		pflag = true;
 		ppflag = true;
 	}
-	if (tup->obj.bailiwick != NULL) {
-		printf("%s bailiwick: %s", prefix, tup->bailiwick);
+	if (tup->has.bailiwick) {
+		obuf_printf(out, "%s bailiwick: %s", prefix, tup->bailiwick);
 		prefix = NULL;
 		pflag = true;
 		ppflag = true;
 	}
 	if (pflag)
-		putchar('\n');
+		obuf_putc(out, '\n');
 
 	/* Records. */
-	if (json_is_array(tup->obj.rdata)) {
-		size_t slot, nslots;
-
-		nslots = json_array_size(tup->obj.rdata);
-		for (slot = 0; slot < nslots; slot++) {
-			json_t *rr = json_array_get(tup->obj.rdata, slot);
-			const char *rdata = NULL;
-
-			if (json_is_string(rr))
-				rdata = json_string_value(rr);
-			else
-				rdata = "[bad value]";
-			printf("%s  %s  %s\n",
-				tup->rrname, tup->rrtype, rdata);
+	if (tup->rdatas != NULL) {
+		size_t slot;
+
+		for (slot = 0; slot < tup->nrdatas; slot++) {
+			const char *rdata = or_else(tup->rdatas[slot],
+						    "[bad value]");
+
+			present_rr(out, tup, rdata);
 			ppflag = true;
 		}
 	} else {
-		printf("%s  %s  %s\n",
-			tup->rrname, tup->rrtype, tup->rdata);
+		present_rr(out, tup, tup->rdata);
 		ppflag = true;
 	}
 
 	/* Cleanup. */
 	if (ppflag)
-		putchar('\n');
+		obuf_putc(out, '\n');
+}
+
+/* present_rr -- display one rdatum of an rrset as a "dig" style line.
+ */
+static void
+present_rr(obuf_t out, pdns_tuple_ct tup, const char *rdata) {
+	obuf_puts(out, tup->rrname);
+	obuf_write(out, "  ", 2);
+	obuf_puts(out, tup->rrtype);
+	obuf_write(out, "  ", 2);
+	obuf_puts(out, rdata);
+	obuf_putc(out, '\n');
 }
 
 /* present_text_summ -- render summarize object in "dig" style ascii text.
@@ -105,39 +120,42 @@ void
 present_text_summarize(pdns_tuple_ct tup,
 		       const char *jsonbuf __attribute__ ((unused)),
 		       size_t jsonlen __attribute__ ((unused)),
-		       writer_t writer __attribute__ ((unused)))
+		       writer_t writer)
 {
+	obuf_t out = writer->out;
 	const char *prefix;
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL && tup->obj.time_last != NULL) {
-		printf(";; record times: %s",
-		       time_str(tup->time_first, iso8601));
-		printf(" .. %s\n",
-		       time_str(tup->time_last, iso8601));
+	if (tup->has.time_first && tup->has.time_last) {
+		obuf_puts(out, ";; record times: ");
+		present_time(out, tup->time_first, false);
+		obuf_puts(out, " .. ");
+		present_time(out, tup->time_last, false);
+		obuf_putc(out, '\n');
 	}
-	if (tup->obj.zone_first != NULL && tup->obj.zone_last != NULL) {
-		printf(";;   zone times: %s",
-		       time_str(tup->zone_first, iso8601));
-		printf(" .. %s\n",
-		       time_str(tup->zone_last, iso8601));
-		putchar('\n');
+	if (tup->has.zone_first && tup->has.zone_last) {
+		obuf_puts(out, ";;   zone times: ");
+		present_time(out, tup->zone_first, false);
+		obuf_puts(out, " .. ");
+		present_time(out, tup->zone_last, false);
+		obuf_putc(out, '\n');
+		obuf_putc(out, '\n');
 	}
 
 	/* Count and Num_Results. */
 	prefix = ";;";
-	if (tup->obj.count != NULL) {
-		printf("%s count: %lld",
+	if (tup->has.count) {
+		obuf_printf(out, "%s count: %lld",
 		       prefix, (long long)tup->count);
 		prefix = ";";
 	}
-	if (tup->obj.num_results != NULL) {
-		printf("%s num_results: %lld",
+	if (tup->has.num_results) {
+		obuf_printf(out, "%s num_results: %lld",
 		       prefix, (long long)tup->num_results);
 		prefix = NULL;
 	}
 
-	putchar('\n');
+	obuf_putc(out, '\n');
 }
 
 /* present_json -- render one DNSDB tuple as newline-separated JSON.
@@ -148,10 +166,12 @@ void
 present_json(pdns_tuple_ct tup __attribute__ ((unused)),
 	     const char *jsonbuf,
 	     size_t jsonlen,
-	     writer_t writer __attribute__ ((unused)))
+	     writer_t writer)
 {
-	fwrite(jsonbuf, 1, jsonlen, stdout);
-	putchar('\n');
+	obuf_t out = writer->out;
+
+	obuf_write(out, jsonbuf, jsonlen);
+	obuf_putc(out, '\n');
 }
 
 /* present_csv_look -- render one DNSDB tuple as comma-separated values (CSV).
@@ -162,68 +182,96 @@ present_csv_lookup(pdns_tuple_ct tup,
 		   size_t jsonlen __attribute__ ((unused)),
 		   writer_t writer)
 {
-	if (!writer->csv_headerp) {
-		printf("time_first,time_last,zone_first,zone_last,"
-		       "count,bailiwick,"
-		       "rrname,rrtype,rdata\n");
-		writer->csv_headerp = true;
-	}
+	present_csv_header(writer);
 
-	if (json_is_array(tup->obj.rdata)) {
-		size_t slot, nslots;
+	if (tup->rdatas != NULL) {
+		size_t slot;
 
-		nslots = json_array_size(tup->obj.rdata);
-		for (slot = 0; slot < nslots; slot++) {
-			json_t *rr = json_array_get(tup->obj.rdata, slot);
-			const char *rdata = NULL;
+		for (slot = 0; slot < tup->nrdatas; slot++) {
+			const char *rdata = or_else(tup->rdatas[slot],
+						    "[bad value]");
 
-			if (json_is_string(rr))
-				rdata = json_string_value(rr);
-			else
-				rdata = "[bad value]";
-			present_csv_line(tup, rdata);
+			present_csv_line(tup, rdata, writer);
 		}
 	} else {
-		present_csv_line(tup, tup->rdata);
+		present_csv_line(tup, tup->rdata, writer);
+	}
+}
+
+/* present_csv_header -- emit the CSV column names for lookup, once per writer.
+ */
+void
+present_csv_header(writer_t writer) {
+	if (!writer->csv_headerp) {
+		obuf_puts(writer->out, "time_first,time_last,"
+			  "zone_first,zone_last,"
+			  "count,bailiwick,"
+			  "rrname,rrtype,rdata\n");
+		writer->csv_headerp = true;
 	}
 }
 
 /* present_csv_line -- display a CSV for one rdatum out of an rrset.
  */
 static void
-present_csv_line(pdns_tuple_ct tup, const char *rdata) {
+present_csv_line(pdns_tuple_ct tup, const char *rdata, writer_t writer) {
+	obuf_t out = writer->out;
+
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL)
-		printf("\"%s\"", time_str(tup->time_first, iso8601));
-	putchar(',');
-	if (tup->obj.time_last != NULL)
-		printf("\"%s\"", time_str(tup->time_last, iso8601));
-	putchar(',');
-	if (tup->obj.zone_first != NULL)
-		printf("\"%s\"", time_str(tup->zone_first, iso8601));
-	putchar(',');
-	if (tup->obj.zone_last != NULL)
-		printf("\"%s\"", time_str(tup->zone_last, iso8601));
-	putchar(',');
+	if (tup->has.time_first)
+		present_time(out, tup->time_first, true);
+	obuf_putc(out, ',');
+	if (tup->has.time_last)
+		present_time(out, tup->time_last, true);
+	obuf_putc(out, ',');
+	if (tup->has.zone_first)
+		present_time(out, tup->zone_first, true);
+	obuf_putc(out, ',');
+	if (tup->has.zone_last)
+		present_time(out, tup->zone_last, true);
+	obuf_putc(out, ',');
 
 	/* Count and bailiwick. */
-	if (tup->obj.count != NULL)
-		printf("%lld", (long long) tup->count);
-	putchar(',');
-	if (tup->obj.bailiwick != NULL)
-		printf("\"%s\"", tup->bailiwick);
-	putchar(',');
+	if (tup->has.count)
+		obuf_printf(out, "%lld", (long long) tup->count);
+	obuf_putc(out, ',');
+	if (tup->has.bailiwick)
+		present_quoted(out, tup->bailiwick);
+	obuf_putc(out, ',');
 
 	/* Records. */
-	if (tup->obj.rrname != NULL)
-		printf("\"%s\"", tup->rrname);
-	putchar(',');
-	if (tup->obj.rrtype != NULL)
-		printf("\"%s\"", tup->rrtype);
-	putchar(',');
-	if (tup->obj.rdata != NULL)
-		printf("\"%s\"", rdata);
-	putchar('\n');
+	if (tup->has.rrname)
+		present_quoted(out, tup->rrname);
+	obuf_putc(out, ',');
+	if (tup->has.rrtype)
+		present_quoted(out, tup->rrtype);
+	obuf_putc(out, ',');
+	if (tup->has.rdata)
+		present_quoted(out, rdata);
+	obuf_putc(out, '\n');
+}
+
+/* present_quoted -- display one double-quoted CSV field.
+ */
+static void
+present_quoted(obuf_t out, const char *str) {
+	obuf_putc(out, '"');
+	obuf_puts(out, str);
+	obuf_putc(out, '"');
+}
+
+/* present_time -- display one timestamp, double-quoted if a CSV field.
+ */
+static void
+present_time(obuf_t out, u_long t, bool quoted) {
+	char buf[TIME_BUFSIZ];
+	size_t len = time_fmt(t, iso8601, buf);
+
+	if (quoted)
+		obuf_putc(out, '"');
+	obuf_write(out, buf, len);
+	if (quoted)
+		obuf_putc(out, '"');
 }
 
 /* present_csv_summ -- render a summarize result as CSV.
@@ -232,145 +280,197 @@ void
 present_csv_summarize(pdns_tuple_ct tup,
 		      const char *jsonbuf __attribute__ ((unused)),
 		      size_t jsonlen __attribute__ ((unused)),
-		      writer_t writer __attribute__ ((unused)))
+		      writer_t writer)
 {
-	printf("time_first,time_last,zone_first,zone_last,"
-	       "count,num_results\n");
+	obuf_t out = writer->out;
+
+	obuf_puts(out, "time_first,time_last,zone_first,zone_last,"
+		  "count,num_results\n");
 
 	/* Timestamps. */
-	if (tup->obj.time_first != NULL)
-		printf("\"%s\"", time_str(tup->time_first, iso8601));
-	putchar(',');
-	if (tup->obj.time_last != NULL)
-		printf("\"%s\"", time_str(tup->time_last, iso8601));
-	putchar(',');
-	if (tup->obj.zone_first != NULL)
-		printf("\"%s\"", time_str(tup->zone_first, iso8601));
-	putchar(',');
-	if (tup->obj.zone_last != NULL)
-		printf("\"%s\"", time_str(tup->zone_last, iso8601));
-	putchar(',');
+	if (tup->has.time_first)
+		present_time(out, tup->time_first, true);
+	obuf_putc(out, ',');
+	if (tup->has.time_last)
+		present_time(out, tup->time_last, true);
+	obuf_putc(out, ',');
+	if (tup->has.zone_first)
+		present_time(out, tup->zone_first, true);
+	obuf_putc(out, ',');
+	if (tup->has.zone_last)
+		present_time(out, tup->zone_last, true);
+	obuf_putc(out, ',');
 
 	/* Count and num_results. */
-	if (tup->obj.count != NULL)
-		printf("%lld", (long long) tup->count);
-	putchar(',');
-	if (tup->obj.num_results != NULL)
-		printf("%lld", tup->num_results);
-	putchar('\n');
+	if (tup->has.count)
+		obuf_printf(out, "%lld", (long long) tup->count);
+	obuf_putc(out, ',');
+	if (tup->has.num_results)
+		obuf_printf(out, "%lld", tup->num_results);
+	obuf_putc(out, '\n');
 }
 
 /* tuple_make -- create one DNSDB tuple object out of a JSON object.
+ *
+ * the common case is handled by tuple_fast(), without building a DOM.
+ * anything it declines is handed to jansson, by way of tuple_dom().
  */
 const char *
 tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
+	memset(tup, 0, sizeof *tup);
+	DEBUG(4, true, "[%d] '%-*.*s'\n", (int)len, (int)len, (int)len, buf);
+	if (tuple_fast(tup, buf, len))
+		return (NULL);
+	DEBUG(4, true, "tuple_make: falling back to jansson\n");
+	tuple_unmake(tup);
+	memset(tup, 0, sizeof *tup);
+	return (tuple_dom(tup, buf, len));
+}
+
+/* tuple_unmake -- deallocate the heap storage associated with one tuple.
+ */
+void
+tuple_unmake(pdns_tuple_t tup) {
+	if (tup->main != NULL)
+		json_decref(tup->main);
+	if (tup->rdatas != tup->rdata_inline)
+		DESTROY(tup->rdatas);
+	DESTROY(tup->strings);
+}
+
+/* tuple_dom -- fill in a tuple from a jansson DOM of its JSON object.
+ */
+static const char *
+tuple_dom(pdns_tuple_t tup, const char *buf, size_t len) {
+	json_t *zone_first, *zone_last, *time_first, *time_last,
+		*count, *bailiwick, *num_results, *rrname, *rrtype, *rdata;
 	const char *msg = NULL;
 	json_error_t error;
 
-	memset(tup, 0, sizeof *tup);
-	DEBUG(4, true, "[%d] '%-*.*s'\n", (int)len, (int)len, (int)len, buf);
-	tup->obj.main = json_loadb(buf, len, 0, &error);
-	if (tup->obj.main == NULL) {
+	tup->main = json_loadb(buf, len, 0, &error);
+	if (tup->main == NULL) {
 		fprintf(stderr, "%s: warning: json_loadb: %d:%d: %s %s\n",
 			program_name, error.line, error.column,
 			error.text, error.source);
 		abort();
 	}
-	DEBUG(4, true, "%s\n", json_dumps(tup->obj.main, JSON_INDENT(2)));
+	DEBUG(4, true, "%s\n", json_dumps(tup->main, JSON_INDENT(2)));
 
 	/* Timestamps. */
-	tup->obj.zone_first = json_object_get(tup->obj.main,
-					      "zone_time_first");
-	if (tup->obj.zone_first != NULL) {
-		if (!json_is_integer(tup->obj.zone_first)) {
+	zone_first = json_object_get(tup->main, "zone_time_first");
+	if (zone_first != NULL) {
+		if (!json_is_integer(zone_first)) {
 			msg = "zone_time_first must be an integer";
 			goto ouch;
 		}
-		tup->zone_first = (u_long)
-			json_integer_value(tup->obj.zone_first);
+		tup->zone_first = (u_long)json_integer_value(zone_first);
+		tup->has.zone_first = true;
 	}
-	tup->obj.zone_last = json_object_get(tup->obj.main, "zone_time_last");
-	if (tup->obj.zone_last != NULL) {
-		if (!json_is_integer(tup->obj.zone_last)) {
+	zone_last = json_object_get(tup->main, "zone_time_last");
+	if (zone_last != NULL) {
+		if (!json_is_integer(zone_last)) {
 			msg = "zone_time_last must be an integer";
 			goto ouch;
 		}
-		tup->zone_last = (u_long)
-			json_integer_value(tup->obj.zone_last);
+		tup->zone_last = (u_long)json_integer_value(zone_last);
+		tup->has.zone_last = true;
 	}
-	tup->obj.time_first = json_object_get(tup->obj.main, "time_first");
-	if (tup->obj.time_first != NULL) {
-		if (!json_is_integer(tup->obj.time_first)) {
+	time_first = json_object_get(tup->main, "time_first");
+	if (time_first != NULL) {
+		if (!json_is_integer(time_first)) {
 			msg = "time_first must be an integer";
 			goto ouch;
 		}
-		tup->time_first = (u_long)
-			json_integer_value(tup->obj.time_first);
+		tup->time_first = (u_long)json_integer_value(time_first);
+		tup->has.time_first = true;
 	}
-	tup->obj.time_last = json_object_get(tup->obj.main, "time_last");
-	if (tup->obj.time_last != NULL) {
-		if (!json_is_integer(tup->obj.time_last)) {
+	time_last = json_object_get(tup->main, "time_last");
+	if (time_last != NULL) {
+		if (!json_is_integer(time_last)) {
 			msg = "time_last must be an integer";
 			goto ouch;
 		}
-		tup->time_last = (u_long)
-			json_integer_value(tup->obj.time_last);
+		tup->time_last = (u_long)json_integer_value(time_last);
+		tup->has.time_last = true;
 	}
 
 	/* Count. */
-	tup->obj.count = json_object_get(tup->obj.main, "count");
-	if (tup->obj.count != NULL) {
-		if (!json_is_integer(tup->obj.count)) {
+	count = json_object_get(tup->main, "count");
+	if (count != NULL) {
+		if (!json_is_integer(count)) {
 			msg = "count must be an integer";
 			goto ouch;
 		}
-		tup->count = json_integer_value(tup->obj.count);
+		tup->count = json_integer_value(count);
+		tup->has.count = true;
 	}
 	/* Bailiwick. */
-	tup->obj.bailiwick = json_object_get(tup->obj.main, "bailiwick");
-	if (tup->obj.bailiwick != NULL) {
-		if (!json_is_string(tup->obj.bailiwick)) {
+	bailiwick = json_object_get(tup->main, "bailiwick");
+	if (bailiwick != NULL) {
+		if (!json_is_string(bailiwick)) {
 			msg = "bailiwick must be a string";
 			goto ouch;
 		}
-		tup->bailiwick = json_string_value(tup->obj.bailiwick);
+		tup->bailiwick = json_string_value(bailiwick);
+		tup->has.bailiwick = true;
 	}
 	/* num_results -- just for a summarize. */
-	tup->obj.num_results = json_object_get(tup->obj.main, "num_results");
-	if (tup->obj.num_results != NULL) {
-		if (!json_is_integer(tup->obj.num_results)) {
+	num_results = json_object_get(tup->main, "num_results");
+	if (num_results != NULL) {
+		if (!json_is_integer(num_results)) {
 			msg = "num_results must be an integer";
 			goto ouch;
 		}
-		tup->num_results = json_integer_value(tup->obj.num_results);
+		tup->num_results = json_integer_value(num_results);
+		tup->has.num_results = true;
 	}
 
 	/* Records. */
-	tup->obj.rrname = json_object_get(tup->obj.main, "rrname");
-	if (tup->obj.rrname != NULL) {
-		if (!json_is_string(tup->obj.rrname)) {
+	rrname = json_object_get(tup->main, "rrname");
+	if (rrname != NULL) {
+		if (!json_is_string(rrname)) {
 			msg = "rrname must be a string";
 			goto ouch;
 		}
-		tup->rrname = json_string_value(tup->obj.rrname);
+		tup->rrname = json_string_value(rrname);
+		tup->has.rrname = true;
 	}
-	tup->obj.rrtype = json_object_get(tup->obj.main, "rrtype");
-	if (tup->obj.rrtype != NULL) {
-		if (!json_is_string(tup->obj.rrtype)) {
+	rrtype = json_object_get(tup->main, "rrtype");
+	if (rrtype != NULL) {
+		if (!json_is_string(rrtype)) {
 			msg = "rrtype must be a string";
 			goto ouch;
 		}
-		tup->rrtype = json_string_value(tup->obj.rrtype);
+		tup->rrtype = json_string_value(rrtype);
+		tup->has.rrtype = true;
 	}
-	tup->obj.rdata = json_object_get(tup->obj.main, "rdata");
-	if (tup->obj.rdata != NULL) {
-		if (json_is_string(tup->obj.rdata)) {
-			tup->rdata = json_string_value(tup->obj.rdata);
-		} else if (!json_is_array(tup->obj.rdata)) {
+	rdata = json_object_get(tup->main, "rdata");
+	if (rdata != NULL) {
+		if (json_is_string(rdata)) {
+			tup->rdata = json_string_value(rdata);
+		} else if (json_is_array(rdata)) {
+			size_t slot, nslots = json_array_size(rdata);
+
+			if (nslots <= RDATA_INLINE) {
+				tup->rdatas = tup->rdata_inline;
+			} else {
+				tup->rdatas = malloc(nslots *
+						     sizeof *tup->rdatas);
+				if (tup->rdatas == NULL)
+					my_panic(true, "malloc");
+			}
+			for (slot = 0; slot < nslots; slot++) {
+				json_t *rr = json_array_get(rdata, slot);
+
+				tup->rdatas[slot] = json_is_string(rr)
+					? json_string_value(rr) : NULL;
+			}
+			tup->nrdatas = nslots;
+		} else {
 			msg = "rdata must be a string or array";
 			goto ouch;
 		}
-		/* N.b., the array case is for the consumer to iterate over. */
+		tup->has.rdata = true;
 	}
 
 	assert(msg == NULL);
@@ -382,11 +482,398 @@ tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
 	return (msg);
 }
 
-/* tuple_unmake -- deallocate the heap storage associated with one tuple.
+/* the fast parser's position in a record, and where its strings go. */
+struct jcursor {
+	const char	*p, *end;
+	char		*out;
+};
+
+/* jc_ws -- skip JSON whitespace.
  */
-void
-tuple_unmake(pdns_tuple_t tup) {
-	json_decref(tup->obj.main);
+static inline void
+jc_ws(struct jcursor *jc) {
+	while (jc->p < jc->end &&
+	       (*jc->p == ' ' || *jc->p == '\t' ||
+		*jc->p == '\n' || *jc->p == '\r'))
+		jc->p++;
+}
+
+/* jc_string -- decode the string at the cursor, NUL terminated, into the
+ * string buffer, returning it (or NULL if it is not one we can handle).
+ *
+ * non-ASCII text is declined rather than validated as UTF-8, as is \u0000.
+ * decoded strings are never longer than their quoted form, so a buffer as
+ * large as the record always has room.
+ */
+static const char *
+jc_string(struct jcursor *jc) {
+	const char *p = jc->p, *end = jc->end;
+	char *o = jc->out, *ret = jc->out;
+
+	if (p == end || *p++ != '"')
+		return (NULL);
+	while (p < end) {
+		u_char ch = (u_char)*p++;
+		unsigned cp;
+		int i;
+
+		if (ch == '"') {
+			*o++ = '\0';
+			jc->out = o;
+			jc->p = p;
+			return (ret);
+		}
+		if (ch < 0x20 || ch >= 0x80)
+			return (NULL);
+		if (ch != '\\') {
+			*o++ = (char)ch;
+			continue;
+		}
+		if (p == end)
+			return (NULL);
+		switch (*p++) {
+		case '"':  *o++ = '"'; break;
+		case '\\': *o++ = '\\'; break;
+		case '/':  *o++ = '/'; break;
+		case 'b':  *o++ = '\b'; break;
+		case 'f':  *o++ = '\f'; break;
+		case 'n':  *o++ = '\n'; break;
+		case 'r':  *o++ = '\r'; break;
+		case 't':  *o++ = '\t'; break;
+		case 'u':
+			if (end - p < 4)
+				return (NULL);
+			cp = 0;
+			for (i = 0; i < 4; i++) {
+				int x = *p++;
+
+				if (x >= '0' && x <= '9')
+					x -= '0';
+				else if (x >= 'a' && x <= 'f')
+					x -= 'a' - 10;
+				else if (x >= 'A' && x <= 'F')
+					x -= 'A' - 10;
+				else
+					return (NULL);
+				cp = (cp << 4) | (unsigned)x;
+			}
+			/* surrogate pairs are left to jansson. */
+			if (cp == 0 || (cp >= 0xd800 && cp <= 0xdfff))
+				return (NULL);
+			if (cp < 0x80) {
+				*o++ = (char)cp;
+			} else if (cp < 0x800) {
+				*o++ = (char)(0xc0 | (cp >> 6));
+				*o++ = (char)(0x80 | (cp & 0x3f));
+			} else {
+				*o++ = (char)(0xe0 | (cp >> 12));
+				*o++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+				*o++ = (char)(0x80 | (cp & 0x3f));
+			}
+			break;
+		default:
+			return (NULL);
+		}
+	}
+	return (NULL);
+}
+
+/* jc_number -- scan the JSON number at the cursor. if it is an integer
+ * that fits, store it in *val and return 1; if it is well formed but not
+ * such an integer, return 0; if it is malformed, return -1.
+ */
+static int
+jc_number(struct jcursor *jc, json_int_t *val) {
+	const char *p = jc->p, *end = jc->end;
+	unsigned long long v = 0;
+	bool neg = false, real = false;
+	int digits = 0;
+
+	if (p < end && *p == '-') {
+		neg = true;
+		p++;
+	}
+	if (p == end || !isdigit((u_char)*p))
+		return (-1);
+	if (*p == '0' && p + 1 < end && isdigit((u_char)p[1]))
+		return (-1);
+	while (p < end && isdigit((u_char)*p)) {
+		digits++;
+		v = v * 10 + (unsigned)(*p++ - '0');
+	}
+	if (p < end && *p == '.') {
+		real = true;
+		if (++p == end || !isdigit((u_char)*p))
+			return (-1);
+		while (p < end && isdigit((u_char)*p))
+			p++;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		real = true;
+		if (++p < end && (*p == '+' || *p == '-'))
+			p++;
+		if (p == end || !isdigit((u_char)*p))
+			return (-1);
+		while (p < end && isdigit((u_char)*p))
+			p++;
+	}
+	/* jansson rejects integers too big for a json_int_t. */
+	if (!real && digits > 18)
+		return (-1);
+	jc->p = p;
+	if (real)
+		return (0);
+	*val = neg ? -(json_int_t)v : (json_int_t)v;
+	return (1);
+}
+
+/* jc_skip -- step over one JSON value of no interest to us.
+ */
+static bool
+jc_skip(struct jcursor *jc, int depth) {
+	char *out = jc->out;
+	json_int_t ignored;
+	char close;
+
+	jc_ws(jc);
+	if (jc->p == jc->end)
+		return (false);
+	switch (*jc->p) {
+	case '"':
+		if (jc_string(jc) == NULL)
+			return (false);
+		jc->out = out;
+		return (true);
+	case 't':
+	case 'f':
+	case 'n': {
+		static const char * const words[] = { "true", "false", "null" };
+		size_t i;
+
+		for (i = 0; i < sizeof words / sizeof words[0]; i++) {
+			size_t n = strlen(words[i]);
+
+			if ((size_t)(jc->end - jc->p) >= n &&
+			    memcmp(jc->p, words[i], n) == 0)
+			{
+				jc->p += n;
+				return (true);
+			}
+		}
+		return (false);
+	    }
+	case '{':
+	case '[':
+		if (depth >= 32)
+			return (false);
+		close = *jc->p == '{' ? '}' : ']';
+		jc->p++;
+		jc_ws(jc);
+		if (jc->p < jc->end && *jc->p == close) {
+			jc->p++;
+			return (true);
+		}
+		for (;;) {
+			if (close == '}') {
+				jc_ws(jc);
+				if (jc_string(jc) == NULL)
+					return (false);
+				jc->out = out;
+				jc_ws(jc);
+				if (jc->p == jc->end || *jc->p++ != ':')
+					return (false);
+			}
+			if (!jc_skip(jc, depth + 1))
+				return (false);
+			jc_ws(jc);
+			if (jc->p == jc->end)
+				return (false);
+			if (*jc->p == ',') {
+				jc->p++;
+				continue;
+			}
+			if (*jc->p++ != close)
+				return (false);
+			return (true);
+		}
+	default:
+		return (jc_number(jc, &ignored) >= 0);
+	}
+}
+
+/* jc_integer -- decode an integer field, or fail if it is anything else.
+ */
+static bool
+jc_integer(struct jcursor *jc, json_int_t *val, bool *has) {
+	if (jc_number(jc, val) != 1)
+		return (false);
+	*has = true;
+	return (true);
+}
+
+/* jc_text -- decode a string field, or fail if it is anything else.
+ */
+static bool
+jc_text(struct jcursor *jc, const char **val, bool *has) {
+	if ((*val = jc_string(jc)) == NULL)
+		return (false);
+	*has = true;
+	return (true);
+}
+
+/* jc_rdata -- decode rdata, which can be a string or an array of them.
+ */
+static bool
+jc_rdata(struct jcursor *jc, pdns_tuple_t tup) {
+	size_t max = RDATA_INLINE;
+	const char *rr;
+
+	/* a repeated key is rare enough to leave to jansson. */
+	if (tup->has.rdata)
+		return (false);
+	tup->has.rdata = true;
+	if (jc->p < jc->end && *jc->p == '"')
+		return ((tup->rdata = jc_string(jc)) != NULL);
+	if (jc->p == jc->end || *jc->p != '[')
+		return (false);
+	jc->p++;
+	tup->rdatas = tup->rdata_inline;
+	jc_ws(jc);
+	if (jc->p < jc->end && *jc->p == ']') {
+		jc->p++;
+		return (true);
+	}
+	for (;;) {
+		jc_ws(jc);
+		if ((rr = jc_string(jc)) == NULL)
+			return (false);
+		if (tup->nrdatas == max) {
+			const char **v = malloc(2 * max * sizeof *v);
+
+			if (v == NULL)
+				my_panic(true, "malloc");
+			memcpy(v, tup->rdatas, max * sizeof *v);
+			if (tup->rdatas != tup->rdata_inline)
+				free(tup->rdatas);
+			tup->rdatas = v;
+			max *= 2;
+		}
+		tup->rdatas[tup->nrdatas++] = rr;
+		jc_ws(jc);
+		if (jc->p == jc->end)
+			return (false);
+		if (*jc->p == ',') {
+			jc->p++;
+			continue;
+		}
+		return (*jc->p++ == ']');
+	}
+}
+
+/* tuple_fast -- fill in a tuple in a single pass, without a DOM.
+ *
+ * the fields of the pdns tuple schema are decoded straight into tup, their
+ * strings landing in one buffer the size of the record. returns false for
+ * anything not handled exactly as jansson would (non-ASCII text, reals or
+ * strings where we expect otherwise, deep nesting, malformed JSON), so that
+ * the caller can fall back to jansson for its result or its diagnostic.
+ */
+static bool
+tuple_fast(pdns_tuple_t tup, const char *buf, size_t len) {
+	struct jcursor jc = { buf, buf + len, NULL };
+	json_int_t v;
+
+	if ((tup->strings = malloc(len + 1)) == NULL)
+		my_panic(true, "malloc");
+	jc.out = tup->strings;
+
+	jc_ws(&jc);
+	if (jc.p == jc.end || *jc.p++ != '{')
+		return (false);
+	jc_ws(&jc);
+	if (jc.p < jc.end && *jc.p == '}') {
+		jc.p++;
+		goto done;
+	}
+	for (;;) {
+		const char *key;
+		size_t klen;
+
+		/* keys are compared in place; escaped ones are declined. */
+		jc_ws(&jc);
+		if (jc.p == jc.end || *jc.p++ != '"')
+			return (false);
+		key = jc.p;
+		while (jc.p < jc.end && *jc.p != '"') {
+			if (*jc.p == '\\' || (u_char)*jc.p < 0x20 ||
+			    (u_char)*jc.p >= 0x80)
+				return (false);
+			jc.p++;
+		}
+		if (jc.p == jc.end)
+			return (false);
+		klen = (size_t)(jc.p++ - key);
+		jc_ws(&jc);
+		if (jc.p == jc.end || *jc.p++ != ':')
+			return (false);
+		jc_ws(&jc);
+
+#define	KEY(s) (klen == sizeof s - 1 && memcmp(key, s, klen) == 0)
+		if (KEY("time_first")) {
+			if (!jc_integer(&jc, &v, &tup->has.time_first))
+				return (false);
+			tup->time_first = (u_long)v;
+		} else if (KEY("time_last")) {
+			if (!jc_integer(&jc, &v, &tup->has.time_last))
+				return (false);
+			tup->time_last = (u_long)v;
+		} else if (KEY("zone_time_first")) {
+			if (!jc_integer(&jc, &v, &tup->has.zone_first))
+				return (false);
+			tup->zone_first = (u_long)v;
+		} else if (KEY("zone_time_last")) {
+			if (!jc_integer(&jc, &v, &tup->has.zone_last))
+				return (false);
+			tup->zone_last = (u_long)v;
+		} else if (KEY("count")) {
+			if (!jc_integer(&jc, &tup->count, &tup->has.count))
+				return (false);
+		} else if (KEY("num_results")) {
+			if (!jc_integer(&jc, &tup->num_results,
+					&tup->has.num_results))
+				return (false);
+		} else if (KEY("bailiwick")) {
+			if (!jc_text(&jc, &tup->bailiwick,
+				     &tup->has.bailiwick))
+				return (false);
+		} else if (KEY("rrname")) {
+			if (!jc_text(&jc, &tup->rrname, &tup->has.rrname))
+				return (false);
+		} else if (KEY("rrtype")) {
+			if (!jc_text(&jc, &tup->rrtype, &tup->has.rrtype))
+				return (false);
+		} else if (KEY("rdata")) {
+			if (!jc_rdata(&jc, tup))
+				return (false);
+		} else if (!jc_skip(&jc, 0)) {
+			return (false);
+		}
+#undef	KEY
+
+		jc_ws(&jc);
+		if (jc.p == jc.end)
+			return (false);
+		if (*jc.p == ',') {
+			jc.p++;
+			continue;
+		}
+		if (*jc.p++ != '}')
+			return (false);
+		break;
+	}
+ done:
+	jc_ws(&jc);
+	return (jc.p == jc.end);
 }
 
 /* data_blob -- process one deblocked json blob as a counted string.
@@ -406,6 +893,7 @@ data_blob(query_t query, const char *buf, size_t len) {
 		fputc('\n', stderr);
 		goto more;
 	}
+	query->stats.parsed++;
 
 	/* there are two sets of timestamps in a tuple. we prefer
 	 * the on-the-wire times to the zone times, when available.
@@ -468,42 +956,28 @@ data_blob(query_t query, const char *buf, size_t len) {
 	DEBUG(3, false, " .. %s\n", time_str(last, false));
 	DEBUG(3, true, "\tA..B = %s", time_str(qp->after, false));
 	DEBUG(3, false, " .. %s\n", time_str(qp->before, false));
-	if (whynot != NULL)
+	if (whynot != NULL) {
+		query->stats.filtered++;
 		goto next;
+	}
 
 	if (sorting != no_sort) {
-		/* POSIX sort is given five extra fields at the
-		 * front of each line (first,last,count,name,data)
-		 * which are accessed as -k1 .. -k5 on the
-		 * sort command line. we strip them off later
-		 * when reading the result back. the reason
-		 * for all this PDP11-era logic is to avoid
-		 * having to store the full result in memory.
+		/* the sort keys (first, last, count, name, data) travel
+		 * with the record, so that the sorter need not store or
+		 * parse the tuple itself; only the json is kept for later.
 		 */
-		char *dyn_rrname = sortable_rrname(&tup),
-			*dyn_rdata = sortable_rdata(&tup);
-
-		DEBUG(3, true, "dyn_rrname = '%s'\n", dyn_rrname);
-		DEBUG(3, true, "dyn_rdata = '%s'\n", dyn_rdata);
-		fprintf(writer->sort_stdin, "%lu %lu %lu %s %s %*.*s\n",
-			(unsigned long)first,
-			(unsigned long)last,
-			(unsigned long)tup.count,
-			or_else(dyn_rrname, "n/a"),
-			or_else(dyn_rdata, "n/a"),
-			(int)len, (int)len, buf);
-		DEBUG(2, true, "sort0: '%lu %lu %lu %s %s %*.*s'\n",
-			 (unsigned long)first,
-			 (unsigned long)last,
-			 (unsigned long)tup.count,
-			 or_else(dyn_rrname, "n/a"),
-			 or_else(dyn_rdata, "n/a"),
-			 (int)len, (int)len, buf);
-		DESTROY(dyn_rrname);
-		DESTROY(dyn_rdata);
+		sort_rec_t rec = sort_rec_make(&tup, first, last, buf, len);
+
+		if (writer->sort_spool != NULL) {
+			sort_rec_write(writer->sort_spool, rec);
+			DESTROY(rec);
+		} else {
+			sorter_add(writer->sorter, rec);
+		}
 	} else {
 		(*presenter)(&tup, buf, len, writer);
 	}
+	query->stats.emitted++;
 	ret = 1;
  next:
 	tuple_unmake(&tup);
@@ -20,17 +20,24 @@
 #include <jansson.h>
 #include "netio.h"
 
-struct pdns_json {
-	json_t	*main,
-		*time_first, *time_last, *zone_first, *zone_last,
-		*bailiwick, *rrname, *rrtype, *rdata,
-		*count, *num_results;
+/* which members of a pdns tuple were present in its JSON object. */
+struct pdns_present {
+	bool	time_first, time_last, zone_first, zone_last,
+		bailiwick, rrname, rrtype, rdata,
+		count, num_results;
 };
 
+#define RDATA_INLINE 8
+
 struct pdns_tuple {
-	struct pdns_json  obj;
+	struct pdns_present has;
+	json_t		 *main;		// DOM, only if the fast parse gave up
+	char		 *strings;	// decoded strings, if it did not
 	u_long		  time_first, time_last, zone_first, zone_last;
 	const char	 *bailiwick, *rrname, *rrtype, *rdata;
+	const char	**rdatas;	// if rdata is an array; NULL slot if
+	size_t		  nrdatas;	// ...that element was not a string
+	const char	 *rdata_inline[RDATA_INLINE];
 	json_int_t	  count, num_results;
 };
 typedef struct pdns_tuple *pdns_tuple_t;
@@ -133,6 +140,7 @@ typedef const struct qdesc *qdesc_ct;
 void present_json(pdns_tuple_ct, const char *, size_t, writer_t);
 void present_text_lookup(pdns_tuple_ct, const char *, size_t, writer_t);
 void present_csv_lookup(pdns_tuple_ct, const char *, size_t, writer_t);
+void present_csv_header(writer_t);
 void present_text_summarize(pdns_tuple_ct, const char *, size_t, writer_t);
 void present_csv_summarize(pdns_tuple_ct, const char *, size_t, writer_t);
 const char *tuple_make(pdns_tuple_t, const char *, size_t);
@@ -285,7 +285,7 @@ dnsdb_info_req(void) {
 
 	DEBUG(1, true, "dnsdb_info_req()\n");
 
-	/* start a writer, which might be format functions, or POSIX sort. */
+	/* start a writer, which might be format functions, or a sorter. */
 	writer = writer_init(qparam_empty.output_limit);
 
 	/* create a rump query. */
@@ -302,7 +302,7 @@ dnsdb_info_req(void) {
 	/* run all jobs to completion. */
 	io_engine(0);
 
-	/* stop the writer, which might involve reading POSIX sort's output. */
+	/* stop the writer, which might involve draining the sorter. */
 	writer_fini(writer);
 }
 
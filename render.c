@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* the rendering pool: records arriving from the network are parsed,
+ * filtered, and presented (or turned into sort records) by a pool of
+ * worker threads, so that a slow presenter doesn't stall socket reads.
+ *
+ * the network thread copies each writer_func() call's complete lines into
+ * a batch, and queues it both on its writer (in arrival order) and on the
+ * pool's work list. a worker renders the batch into a private spool. the
+ * network thread writes out each writer's finished batches strictly in
+ * queue order, so the output is the same as for a serial run.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "deblock.h"
+#include "metrics.h"
+#include "netio.h"
+#include "pdns.h"
+#include "render.h"
+#include "stats.h"
+#include "globals.h"
+
+/* one writer_func() call's worth of lines, and what became of them. */
+struct render_batch {
+	struct render_batch *next;	// in its writer's queue
+	struct render_batch *work_next;	// in the pool's work list
+	query_t		query;		// which these came from
+	struct qparam	params;		// ...and a copy of its parameters
+	char		*in;		// complete lines, each with \n
+	size_t		inlen, insize;
+	char		*out;		// presenter (or sort) output
+	size_t		outlen;
+	int		count;
+	struct record_stats stats;
+	bool		done;
+};
+
+/* a writer's batches, oldest first, and the one being filled. */
+struct render_queue {
+	struct render_batch *head, *tail;
+	struct render_batch *open;
+};
+
+static void render_start(void);
+static void *render_worker(void *);
+static void render_run(struct render_batch *);
+
+static pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t render_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_done = PTHREAD_COND_INITIALIZER;
+static struct render_batch *work_head = NULL, *work_tail = NULL;
+static size_t render_unfinished = 0;	// queued or being rendered
+static bool render_stopping = false;
+static pthread_t *render_tids = NULL;
+static int render_nthreads = -1;	// -1 means not yet decided
+
+/* render_wanted -- should this writer's records go through the pool?
+ *
+ * not if there's only one CPU to do it on, nor for -I, nor if an output
+ * limit without sorting needs each record counted before the next.
+ */
+bool
+render_wanted(writer_t writer) {
+	if (render_nthreads < 0)
+		render_start();
+	return (render_nthreads > 1 && !writer->info &&
+		(sorting != no_sort || writer->output_limit <= 0));
+}
+
+/* render_line -- add one complete line from a fetch to its writer's
+ * open batch, starting a new batch if the line is from another query.
+ */
+void
+render_line(fetch_t fetch, const char *line, size_t len) {
+	writer_t writer = fetch->query->writer;
+	struct render_queue *rq = writer->render;
+	struct render_batch *rb;
+
+	if (rq == NULL) {
+		CREATE(rq, sizeof *rq);
+		writer->render = rq;
+	}
+	if (rq->open != NULL && rq->open->query != fetch->query)
+		render_submit(writer);
+	if (rq->open == NULL) {
+		CREATE(rq->open, sizeof *rq->open);
+		rq->open->query = fetch->query;
+		rq->open->params = fetch->query->params;
+	}
+	rb = rq->open;
+	if (rb->inlen + len + 1 > rb->insize) {
+		size_t size = rb->insize == 0 ? BUFSIZ : rb->insize;
+
+		while (size < rb->inlen + len + 1)
+			size *= 2;
+		rb->in = realloc(rb->in, size);
+		if (rb->in == NULL)
+			my_panic(true, "realloc");
+		rb->insize = size;
+	}
+	memcpy(rb->in + rb->inlen, line, len);
+	rb->in[rb->inlen + len] = '\n';
+	rb->inlen += len + 1;
+}
+
+/* render_submit -- hand a writer's open batch, if any, to the pool.
+ *
+ * if the workers are too far behind, wait for them, since memory would
+ * otherwise grow without bound while the network outpaces them.
+ */
+void
+render_submit(writer_t writer) {
+	struct render_queue *rq = writer->render;
+	struct render_batch *rb;
+
+	if (rq == NULL || rq->open == NULL)
+		return;
+	rb = rq->open;
+	rq->open = NULL;
+	if (rq->tail != NULL)
+		rq->tail->next = rb;
+	else
+		rq->head = rb;
+	rq->tail = rb;
+
+	pthread_mutex_lock(&render_mutex);
+	while (render_unfinished >= RENDER_BACKLOG * (size_t)render_nthreads)
+		pthread_cond_wait(&render_done, &render_mutex);
+	if (work_tail != NULL)
+		work_tail->work_next = rb;
+	else
+		work_head = rb;
+	work_tail = rb;
+	render_unfinished++;
+	pthread_cond_signal(&render_work);
+	pthread_mutex_unlock(&render_mutex);
+}
+
+/* render_sink -- write out a writer's finished batches, in order. if
+ * "wait" is true, wait for and write out all of them, and forget the
+ * writer.
+ */
+void
+render_sink(writer_t writer, bool wait) {
+	struct render_queue *rq = writer->render;
+
+	if (rq == NULL)
+		return;
+	if (wait)
+		render_submit(writer);
+	while (rq->head != NULL) {
+		struct render_batch *rb = rq->head;
+
+		pthread_mutex_lock(&render_mutex);
+		while (wait && !rb->done)
+			pthread_cond_wait(&render_done, &render_mutex);
+		pthread_mutex_unlock(&render_mutex);
+		if (!rb->done)
+			break;
+
+		if (rb->outlen != 0) {
+			if (sorting != no_sort) {
+				sorter_load(writer->sorter,
+					    rb->out, rb->outlen);
+			} else {
+				if (presentation == pres_csv)
+					present_csv_header(writer);
+				obuf_write(writer->out, rb->out, rb->outlen);
+			}
+		}
+		writer->count += rb->count;
+		metrics.tuples += (u_long)rb->count;
+		stats_records_add(&rb->query->stats, &rb->stats);
+		rq->head = rb->next;
+		if (rq->head == NULL)
+			rq->tail = NULL;
+		DESTROY(rb->out);
+		DESTROY(rb);
+	}
+	if (wait) {
+		assert(rq->head == NULL && rq->open == NULL);
+		DESTROY(writer->render);
+	}
+}
+
+/* render_fini -- stop the pool's workers.
+ */
+void
+render_fini(void) {
+	int t;
+
+	if (render_tids == NULL)
+		return;
+	pthread_mutex_lock(&render_mutex);
+	render_stopping = true;
+	pthread_cond_broadcast(&render_work);
+	pthread_mutex_unlock(&render_mutex);
+	for (t = 0; t < render_nthreads; t++)
+		pthread_join(render_tids[t], NULL);
+	DESTROY(render_tids);
+	render_stopping = false;
+	render_nthreads = -1;
+}
+
+/* render_start -- decide how many workers to use, and start them.
+ */
+static void
+render_start(void) {
+	long n = render_workers;
+	int t, rc;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > MAX_JOBS)
+		n = MAX_JOBS;
+	render_nthreads = n > 1 ? (int)n : 0;
+	DEBUG(1, true, "render: %d workers\n", render_nthreads);
+	if (render_nthreads == 0)
+		return;
+
+	CREATE(render_tids, (size_t)render_nthreads * sizeof *render_tids);
+	for (t = 0; t < render_nthreads; t++)
+		if ((rc = pthread_create(&render_tids[t], NULL,
+					 render_worker, NULL)) != 0)
+		{
+			errno = rc;
+			my_panic(true, "pthread_create");
+		}
+}
+
+/* render_worker -- thread body; render batches until told to stop.
+ */
+static void *
+render_worker(void *arg __attribute__((unused))) {
+	pthread_mutex_lock(&render_mutex);
+	for (;;) {
+		struct render_batch *rb;
+
+		while (work_head == NULL && !render_stopping)
+			pthread_cond_wait(&render_work, &render_mutex);
+		if (work_head == NULL)
+			break;
+		rb = work_head;
+		work_head = rb->work_next;
+		if (work_head == NULL)
+			work_tail = NULL;
+		pthread_mutex_unlock(&render_mutex);
+
+		render_run(rb);
+
+		pthread_mutex_lock(&render_mutex);
+		rb->done = true;
+		render_unfinished--;
+		pthread_cond_broadcast(&render_done);
+	}
+	pthread_mutex_unlock(&render_mutex);
+	return NULL;
+}
+
+/* render_run -- parse, filter, and present one batch into its output.
+ *
+ * a private writer and query are used, so that nothing is shared with
+ * the other workers, or with the network thread.
+ */
+static void
+render_run(struct render_batch *rb) {
+	const char *p = rb->in, *end = rb->in + rb->inlen;
+	struct writer writer;
+	struct query query;
+	FILE *sort_out = NULL;
+
+	memset(&writer, 0, sizeof writer);
+	memset(&query, 0, sizeof query);
+	writer.csv_headerp = true;
+	writer.queries = &query;
+	query.writer = &writer;
+	query.params = rb->params;
+
+	/* sort records are written by stdio, presentations to a spool. */
+	obuf_init(&writer.spool, -1);
+	writer.out = &writer.spool;
+	if (sorting != no_sort) {
+		sort_out = open_memstream(&rb->out, &rb->outlen);
+		if (sort_out == NULL)
+			my_panic(true, "open_memstream");
+		writer.sort_spool = sort_out;
+	}
+	while (p < end) {
+		struct slice slices[MAX_SLICES];
+		size_t i, n, used;
+
+		n = deblock_scan(p, (size_t)(end - p),
+				 slices, MAX_SLICES, &used);
+		if (n == 0)
+			break;
+		for (i = 0; i < n; i++)
+			writer.count += data_blob(&query,
+						  p + slices[i].offset,
+						  slices[i].len);
+		p += used;
+	}
+	if (sort_out != NULL)
+		fclose(sort_out);
+	else
+		rb->out = obuf_take(&writer.spool, &rb->outlen);
+	rb->count = writer.count;
+	rb->stats = query.stats;
+	DESTROY(rb->in);
+}
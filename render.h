@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RENDER_H_INCLUDED
+#define RENDER_H_INCLUDED 1
+
+#include <stdbool.h>
+
+#include "netio.h"
+
+bool render_wanted(writer_t);
+void render_line(fetch_t, const char *, size_t);
+void render_submit(writer_t);
+void render_sink(writer_t, bool);
+void render_fini(void);
+
+#endif /*RENDER_H_INCLUDED*/
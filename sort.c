@@ -19,7 +19,10 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -30,11 +33,87 @@
 
 #define	MAX_KEYS 5
 
-extern char **environ;
+/* the name and data keys are streams of tokens: SK_DOT between labels,
+ * and any other octet as itself, unless it is one of these three, which
+ * go behind SK_ESC. a name key ends with SK_END. this collates exactly
+ * as the hexified text which sort(1) was once given did, where the dot
+ * collated below every hex digit, at half the size or less.
+ */
+#define	SK_END	0x00
+#define	SK_DOT	0x01
+#define	SK_ESC	0x02
+
+/* one record held by the sorter. the key and the json are stored back to
+ * back in bytes[], neither NUL terminated. a spill run on disk is a
+ * sequence of these, each the fixed part followed by its bytes.
+ *
+ * the key is binary, built once by sort_rec_make() so that records can be
+ * ordered by memcmp() alone; see sortable_key() for its layout.
+ */
+struct sort_rec {
+	uint32_t	key_len, json_len;
+	char		bytes[];
+};
+#define	REC_FIXED offsetof(struct sort_rec, bytes)
+#define	REC_SIZE(r) (REC_FIXED + (r)->key_len + (r)->json_len)
+
+struct sortbuf { u_char *base; size_t size, alloc; };
+typedef struct sortbuf *sortbuf_t;
+
+/* a sorted run spilled to disk. a run made by merging SORT_FANIN runs of
+ * one level is of the next level up.
+ */
+struct sort_run {
+	FILE		*f;
+	sort_rec_t	head;		// next record, while being merged
+	u_int		level;
+};
+
+/* a merge of runs, by a heap of those which have records left. */
+struct sort_merge {
+	struct sort_run	*runs;
+	size_t		*heap;		// indices into runs, least head first
+	size_t		nheap;
+};
+
+struct sorter {
+	sort_rec_t	*recs;		// in memory, not yet sorted or spilled
+	size_t		nrecs, maxrecs;
+	size_t		held;		// octets accounted to recs
+	struct sort_run	*runs;		// sorted runs spilled to disk
+	size_t		nruns;
+	struct sort_merge merge;	// of all runs, once input has ended
+	bool		ready;		// sorter_next() has been called
+	size_t		next;		// in-memory cursor, if no runs
+	sort_rec_t	prev;		// most recent output, to enforce -u
+	size_t		added;
+	size_t		key_octets;	// total over all records added
+	size_t		limit;		// if nonzero, keep only the best this many
+	sort_rec_t	*set;		// ...and which records those are
+	size_t		setmask;
+};
 
 static struct sortkey keys[MAX_KEYS];
 static int nkeys = 0;
 
+static int sort_cmp(sort_rec_ct, sort_rec_ct);
+static int sort_qcmp(const void *, const void *);
+static void sorter_spill(sorter_t);
+static void sorter_cascade(sorter_t);
+static void merge_init(struct sort_merge *, struct sort_run *, size_t);
+static sort_rec_t merge_next(struct sort_merge *);
+static void merge_down(struct sort_merge *, size_t);
+static void sorter_topk(sorter_t, sort_rec_t);
+static sort_rec_t sort_rec_read(FILE *);
+static const char *sort_json(sort_rec_ct, size_t *);
+static void sortable_key(sortbuf_t, pdns_tuple_ct, u_long, u_long);
+static void sortable_rdata(sortbuf_t, pdns_tuple_ct);
+static void sortable_rdatum(sortbuf_t, const char *, const char *);
+static void sortable_dnsname(sortbuf_t, const char *);
+static void sortable_octets(sortbuf_t, const void *, size_t);
+static void sortable_put(sortbuf_t, const void *, size_t);
+static void sortable_u64(sortbuf_t, uint64_t);
+
 /* sort_ready -- finish initializing the sort related metadata.
  *
  * If sorting, all keys must be specified, to enable -u.
@@ -43,42 +122,39 @@ static int nkeys = 0;
  */
 void
 sort_ready(void) {
-	(void) add_sort_key("first");
-	(void) add_sort_key("last");
-	(void) add_sort_key("count");
-	(void) add_sort_key("name");
-	(void) add_sort_key("data");
+	static const char * const all[] = {
+		"first", "last", "count", "name", "data"
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof all / sizeof all[0]; i++)
+		if (find_sort_key(all[i]) == NULL)
+			(void) add_sort_key(all[i]);
 }
 
-/* add_sort_key -- add a key for use by POSIX sort.
+/* add_sort_key -- add a key for use by the sorter.
  *
  * Returns NULL if no error, otherwise a static error message.
  */
 const char *
 add_sort_key(const char *key_name) {
-	const char *key = NULL;
-	char *computed;
-	int x;
+	sortfield_e field;
 
 	if (nkeys == MAX_KEYS)
 		return ("too many sort keys given.");
 	if (strcasecmp(key_name, "first") == 0)
-		key = "-k1n";
+		field = sk_first;
 	else if (strcasecmp(key_name, "last") == 0)
-		key = "-k2n";
+		field = sk_last;
 	else if (strcasecmp(key_name, "count") == 0)
-		key = "-k3n";
+		field = sk_count;
 	else if (strcasecmp(key_name, "name") == 0)
-		key = "-k4";
+		field = sk_name;
 	else if (strcasecmp(key_name, "data") == 0)
-		key = "-k5";
+		field = sk_data;
 	else
 		return "key must be one of first, last, count, name, or data";
-	x = asprintf(&computed, "%s%s", key,
-		     sorting == reverse_sort ? "r" : "");
-	if (x < 0)
-		my_panic(true, "asprintf");
-	keys[nkeys++] = (struct sortkey){strdup(key_name), computed};
+	keys[nkeys++] = (struct sortkey){strdup(key_name), field};
 	return (NULL);
 }
 
@@ -89,7 +165,7 @@ find_sort_key(const char *key_name) {
 	int n;
 
 	for (n = 0; n < nkeys; n++) {
-		if (strcmp(keys[n].specified, key_name) == 0)
+		if (strcasecmp(keys[n].specified, key_name) == 0)
 			return (&keys[n]);
 	}
 	return (NULL);
@@ -101,108 +177,634 @@ void
 sort_destroy(void) {
 	int n;
 
-	for (n = 0; n < nkeys; n++) {
+	for (n = 0; n < nkeys; n++)
 		DESTROY(keys[n].specified);
-		DESTROY(keys[n].computed);
+	nkeys = 0;
+}
+
+/* sort_rec_make -- build one sortable record (to be freed by the caller).
+ *
+ * first and last are whichever of the time or zone times the caller chose.
+ */
+sort_rec_t
+sort_rec_make(pdns_tuple_ct tup, u_long first, u_long last,
+	      const char *json, size_t json_len)
+{
+	struct sortbuf key = {NULL, 0, 0};
+	sort_rec_t rec = NULL;
+
+	sortable_key(&key, tup, first, last);
+	CREATE(rec, REC_FIXED + key.size + json_len);
+	rec->key_len = (uint32_t)key.size;
+	rec->json_len = (uint32_t)json_len;
+	if (key.size != 0)
+		memcpy(rec->bytes, key.base, key.size);
+	memcpy(rec->bytes + key.size, json, json_len);
+	DESTROY(key.base);
+	return (rec);
+}
+
+/* sort_rec_write -- append one record to a spill run or other stream.
+ */
+void
+sort_rec_write(FILE *f, sort_rec_ct rec) {
+	if (fwrite(rec, REC_SIZE(rec), 1, f) != 1)
+		my_panic(true, "sort spill");
+}
+
+/* sort_rec_read -- read back one record written by sort_rec_write().
+ *
+ * returns NULL at end of file.
+ */
+static sort_rec_t
+sort_rec_read(FILE *f) {
+	struct sort_rec fixed;
+	sort_rec_t rec = NULL;
+
+	if (fread(&fixed, REC_FIXED, 1, f) != 1) {
+		if (ferror(f))
+			my_panic(true, "sort run");
+		return (NULL);
 	}
+	CREATE(rec, REC_SIZE(&fixed));
+	memcpy(rec, &fixed, REC_FIXED);
+	if (fread(rec->bytes, REC_SIZE(rec) - REC_FIXED, 1, f) != 1)
+		my_panic(ferror(f) != 0, "sort run truncated");
+	return (rec);
 }
 
-/* exec_sort -- replace this fork with a POSIX sort program
+/* sort_json -- return the json text of a sortable record, and its length.
  */
-__attribute__((noreturn)) void
-exec_sort(int p1[], int p2[]) {
-	char *sort_argv[3+MAX_KEYS], **sap;
-	int n;
+static const char *
+sort_json(sort_rec_ct rec, size_t *len) {
+	*len = rec->json_len;
+	return (rec->bytes + rec->key_len);
+}
+
+/* segcmp -- compare two counted strings; a prefix sorts first.
+ */
+static int
+segcmp(const char *a, size_t alen, const char *b, size_t blen) {
+	int r = memcmp(a, b, alen < blen ? alen : blen);
+
+	if (r != 0)
+		return (r);
+	return (alen < blen ? -1 : alen > blen ? 1 : 0);
+}
+
+/* sort_cmp -- compare two records according to the sort keys.
+ *
+ * the keys were laid out by sortable_key() in the order given, so this is
+ * one memcmp(), with the json breaking any tie (as it did when the records
+ * were lines of text for "sort -u", where the last key ran to the end).
+ */
+static int
+sort_cmp(sort_rec_ct a, sort_rec_ct b) {
+	int r = segcmp(a->bytes, a->key_len, b->bytes, b->key_len);
+
+	if (r == 0)
+		r = segcmp(a->bytes + a->key_len, a->json_len,
+			   b->bytes + b->key_len, b->json_len);
+	return (sorting == reverse_sort ? -r : r);
+}
+
+/* sort_qcmp -- qsort() adapter for sort_cmp().
+ */
+static int
+sort_qcmp(const void *a, const void *b) {
+	return (sort_cmp(*(sort_rec_ct const *)a, *(sort_rec_ct const *)b));
+}
+
+/* sorter_new -- create an empty sorter.
+ *
+ * if limit is nonzero, only that many records will ever be read back, so
+ * only the best that many are kept, in a heap; nothing is ever spilled.
+ * the heap and its set grow with the records actually held, since the
+ * limit may be far larger than the input.
+ */
+sorter_t
+sorter_new(size_t limit) {
+	sorter_t sorter = NULL;
+
+	CREATE(sorter, sizeof *sorter);
+	sorter->limit = limit;
+	return (sorter);
+}
 
-	if (dup2(p1[0], STDIN_FILENO) < 0 ||
-	    dup2(p2[1], STDOUT_FILENO) < 0) {
-		perror("dup2");
-		_exit(1);
+/* sorter_add -- give one record to the sorter, which takes ownership.
+ *
+ * once the records held exceed sort_memory, they are spilled as a run.
+ */
+void
+sorter_add(sorter_t sorter, sort_rec_t rec) {
+	assert(!sorter->ready);
+	sorter->added++;
+	sorter->key_octets += rec->key_len;
+	if (sorter->limit != 0) {
+		sorter_topk(sorter, rec);
+		return;
 	}
-	close(p1[0]); close(p1[1]);
-	close(p2[0]); close(p2[1]);
-	sap = sort_argv;
-	*sap++ = strdup("sort");
-	*sap++ = strdup("-u");
-	for (n = 0; n < nkeys; n++)
-		*sap++ = strdup(keys[n].computed);
-	*sap++ = NULL;
-	putenv(strdup("LC_ALL=C"));
-	DEBUG(1, true, "\"%s\" args:", path_sort);
-	for (sap = sort_argv; *sap != NULL; sap++)
-		DEBUG(1, false, " [%s]", *sap);
-	DEBUG(1, false, "\n");
-	execve(path_sort, sort_argv, environ);
-	perror("execve");
-	for (sap = sort_argv; *sap != NULL; sap++)
-		DESTROY(*sap);
-	_exit(1);
+	if (sorter->nrecs == sorter->maxrecs) {
+		sorter->maxrecs = sorter->maxrecs == 0
+			? 1024 : sorter->maxrecs * 2;
+		sorter->recs = realloc(sorter->recs,
+				       sorter->maxrecs * sizeof *sorter->recs);
+		if (sorter->recs == NULL)
+			my_panic(true, "realloc");
+	}
+	sorter->recs[sorter->nrecs++] = rec;
+	sorter->held += REC_SIZE(rec) + sizeof rec;
+	if (sorter->held > sort_memory)
+		sorter_spill(sorter);
 }
 
-/* sortable_rrname -- return a POSIX-sort-collatable rendition of RR name+type.
+/* rec_hash -- FNV-1a over a record's contents, for the top-K set.
  */
-char *
-sortable_rrname(pdns_tuple_ct tup) {
-	struct sortbuf buf = {NULL, 0};
+static size_t
+rec_hash(sort_rec_ct rec) {
+	const u_char *p = (const u_char *)rec, *end = p + REC_SIZE(rec);
+	uint64_t h = 14695981039346656037ULL;
+
+	while (p < end)
+		h = (h ^ *p++) * 1099511628211ULL;
+	return ((size_t)h);
+}
 
-	sortable_dnsname(&buf, tup->rrname);
-	buf.base = realloc(buf.base, buf.size+1);
-	buf.base[buf.size++] = '\0';
-	return (buf.base);
+/* set_slot -- find rec (or where it would go) in the top-K set.
+ *
+ * a record's sort keys include all of its json, so records are duplicates
+ * (for -u) exactly when their contents are identical.
+ */
+static size_t
+set_slot(sorter_t sorter, sort_rec_ct rec) {
+	size_t i = rec_hash(rec) & sorter->setmask;
+
+	while (sorter->set[i] != NULL &&
+	       (REC_SIZE(sorter->set[i]) != REC_SIZE(rec) ||
+		memcmp(sorter->set[i], rec, REC_SIZE(rec)) != 0))
+		i = (i + 1) & sorter->setmask;
+	return (i);
 }
 
-/* sortable_rdata -- return a POSIX-sort-collatable rendition of RR data set.
+/* set_remove -- take a record out of the top-K set (linear probing, so
+ * later members of its cluster are shifted back to fill the hole).
  */
-char *
-sortable_rdata(pdns_tuple_ct tup) {
-	struct sortbuf buf = {NULL, 0};
+static void
+set_remove(sorter_t sorter, sort_rec_ct rec) {
+	size_t i = set_slot(sorter, rec), j = i;
+
+	assert(sorter->set[i] != NULL);
+	for (;;) {
+		size_t k;
+
+		sorter->set[i] = NULL;
+		for (;;) {
+			j = (j + 1) & sorter->setmask;
+			if (sorter->set[j] == NULL)
+				return;
+			k = rec_hash(sorter->set[j]) & sorter->setmask;
+			/* can set[j] move back to i? not if its home
+			 * slot k lies cyclically within (i, j].
+			 */
+			if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+				continue;
+			break;
+		}
+		sorter->set[i] = sorter->set[j];
+		i = j;
+	}
+}
 
-	if (json_is_array(tup->obj.rdata)) {
-		size_t slot, nslots;
+/* set_grow -- double the top-K set (or start it), and rehash the heap
+ * into it.
+ */
+static void
+set_grow(sorter_t sorter) {
+	size_t size = sorter->set == NULL ? 16 : 2 * (sorter->setmask + 1);
+	size_t i;
 
-		nslots = json_array_size(tup->obj.rdata);
-		for (slot = 0; slot < nslots; slot++) {
-			json_t *rr = json_array_get(tup->obj.rdata, slot);
+	DESTROY(sorter->set);
+	CREATE(sorter->set, size * sizeof *sorter->set);
+	sorter->setmask = size - 1;
+	for (i = 0; i < sorter->nrecs; i++)
+		sorter->set[set_slot(sorter, sorter->recs[i])] =
+			sorter->recs[i];
+}
+
+/* heap_down -- restore the heap below slot i, where the worst record (the
+ * last in sort order) is at the root, so it is the one to be replaced.
+ */
+static void
+heap_down(sorter_t sorter, size_t i) {
+	sort_rec_t *h = sorter->recs;
+	size_t n = sorter->nrecs;
+
+	for (;;) {
+		size_t l = 2 * i + 1, r = l + 1, worst = i;
+		sort_rec_t t;
+
+		if (l < n && sort_cmp(h[l], h[worst]) > 0)
+			worst = l;
+		if (r < n && sort_cmp(h[r], h[worst]) > 0)
+			worst = r;
+		if (worst == i)
+			return;
+		t = h[i], h[i] = h[worst], h[worst] = t;
+		i = worst;
+	}
+}
 
-			if (json_is_string(rr))
-				sortable_rdatum(&buf, tup->rrtype,
-						json_string_value(rr));
+/* sorter_topk -- add one record to a limited sorter's heap, if it is
+ * better than the worst already there, and not already there.
+ */
+static void
+sorter_topk(sorter_t sorter, sort_rec_t rec) {
+	size_t slot;
+
+	/* keep the set at most half full, as the heap heads for its limit. */
+	if (sorter->nrecs < sorter->limit &&
+	    (sorter->set == NULL ||
+	     2 * (sorter->nrecs + 1) > sorter->setmask + 1))
+		set_grow(sorter);
+	slot = set_slot(sorter, rec);
+	if (sorter->set[slot] != NULL) {
+		DESTROY(rec);
+		return;
+	}
+	if (sorter->nrecs < sorter->limit) {
+		size_t i;
+
+		if (sorter->nrecs == sorter->maxrecs) {
+			sorter->maxrecs = sorter->maxrecs == 0
+				? 1024 : sorter->maxrecs * 2;
+			if (sorter->maxrecs > sorter->limit)
+				sorter->maxrecs = sorter->limit;
+			sorter->recs = realloc(sorter->recs,
+					       sorter->maxrecs *
+					       sizeof *sorter->recs);
+			if (sorter->recs == NULL)
+				my_panic(true, "realloc");
+		}
+		/* sift up. */
+		i = sorter->nrecs++;
+		while (i > 0 && sort_cmp(rec, sorter->recs[(i - 1) / 2]) > 0) {
+			sorter->recs[i] = sorter->recs[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		sorter->recs[i] = rec;
+		sorter->set[slot] = rec;
+		return;
+	}
+	if (sort_cmp(rec, sorter->recs[0]) >= 0) {
+		DESTROY(rec);
+		return;
+	}
+	set_remove(sorter, sorter->recs[0]);
+	DESTROY(sorter->recs[0]);
+	sorter->recs[0] = rec;
+	heap_down(sorter, 0);
+	sorter->set[set_slot(sorter, rec)] = rec;
+}
+
+/* sorter_load -- add every record in a buffer of sort_rec_write() output.
+ */
+void
+sorter_load(sorter_t sorter, const char *buf, size_t len) {
+	while (len >= REC_FIXED) {
+		struct sort_rec fixed;
+		sort_rec_t rec = NULL;
+		size_t size;
+
+		memcpy(&fixed, buf, REC_FIXED);
+		size = REC_SIZE(&fixed);
+		assert(size <= len);
+		CREATE(rec, size);
+		memcpy(rec, buf, size);
+		sorter_add(sorter, rec);
+		buf += size;
+		len -= size;
+	}
+	assert(len == 0);
+}
+
+/* sort_tmpfile -- open an anonymous temporary file for a spill run.
+ */
+static FILE *
+sort_tmpfile(void) {
+	const char *dir = getenv("TMPDIR");
+	char *path = NULL;
+	FILE *f;
+	int fd;
+
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	if (asprintf(&path, "%s/dnsdbq.XXXXXX", dir) < 0)
+		my_panic(true, "asprintf");
+	if ((fd = mkstemp(path)) < 0)
+		my_panic(true, path);
+	unlink(path);
+	DESTROY(path);
+	if ((f = fdopen(fd, "w+")) == NULL)
+		my_panic(true, "fdopen");
+	return (f);
+}
+
+/* sorter_spill -- sort the records in memory and write them out as a run.
+ */
+static void
+sorter_spill(sorter_t sorter) {
+	sort_rec_t prev = NULL;
+	size_t i;
+	FILE *f;
+
+	qsort(sorter->recs, sorter->nrecs, sizeof *sorter->recs, sort_qcmp);
+	f = sort_tmpfile();
+	for (i = 0; i < sorter->nrecs; i++) {
+		if (prev == NULL || sort_cmp(prev, sorter->recs[i]) != 0)
+			sort_rec_write(f, sorter->recs[i]);
+		DESTROY(prev);
+		prev = sorter->recs[i];
+	}
+	DESTROY(prev);
+	if (fflush(f) != 0)
+		my_panic(true, "sort spill");
+	sorter->runs = realloc(sorter->runs,
+			       (sorter->nruns + 1) * sizeof *sorter->runs);
+	if (sorter->runs == NULL)
+		my_panic(true, "realloc");
+	sorter->runs[sorter->nruns++] = (struct sort_run){ f, NULL, 0 };
+	DEBUG(1, true, "sorter: spilled run %zu, %zu recs, %zu octets\n",
+	      sorter->nruns, sorter->nrecs, sorter->held);
+	sorter->nrecs = 0;
+	sorter->held = 0;
+	sorter_cascade(sorter);
+}
+
+/* sorter_cascade -- while the newest SORT_FANIN runs are all of one level,
+ * merge them into a single run of the next level.
+ *
+ * runs are kept in descending order of level, so at most SORT_FANIN - 1 of
+ * each level are ever open, and each record is rewritten once per level,
+ * which is to say only a few times for any input.
+ */
+static void
+sorter_cascade(sorter_t sorter) {
+	while (sorter->nruns >= SORT_FANIN) {
+		struct sort_run *first = &sorter->runs[sorter->nruns -
+						       SORT_FANIN];
+		u_int level = sorter->runs[sorter->nruns - 1].level;
+		struct sort_merge merge;
+		sort_rec_t rec, prev = NULL;
+		size_t i;
+		FILE *f;
+
+		if (first->level != level)
+			break;
+		merge_init(&merge, first, SORT_FANIN);
+		f = sort_tmpfile();
+		while ((rec = merge_next(&merge)) != NULL) {
+			if (prev == NULL || sort_cmp(prev, rec) != 0)
+				sort_rec_write(f, rec);
+			DESTROY(prev);
+			prev = rec;
+		}
+		DESTROY(prev);
+		DESTROY(merge.heap);
+		if (fflush(f) != 0)
+			my_panic(true, "sort spill");
+		for (i = 0; i < SORT_FANIN; i++)
+			fclose(first[i].f);
+		sorter->nruns -= SORT_FANIN - 1;
+		*first = (struct sort_run){ f, NULL, level + 1 };
+		DEBUG(1, true, "sorter: merged %d runs into one of level %u\n",
+		      SORT_FANIN, level + 1);
+	}
+}
+
+/* merge_init -- start merging some runs, from the beginning of each.
+ */
+static void
+merge_init(struct sort_merge *merge, struct sort_run *runs, size_t nruns) {
+	size_t i;
+
+	memset(merge, 0, sizeof *merge);
+	merge->runs = runs;
+	CREATE(merge->heap, nruns * sizeof *merge->heap);
+	for (i = 0; i < nruns; i++) {
+		rewind(runs[i].f);
+		runs[i].head = sort_rec_read(runs[i].f);
+		if (runs[i].head != NULL)
+			merge->heap[merge->nheap++] = i;
+	}
+	for (i = merge->nheap / 2; i-- > 0; )
+		merge_down(merge, i);
+}
+
+/* merge_next -- return the least record from any of the runs being merged,
+ * or NULL when all are exhausted. the caller takes ownership of it.
+ */
+static sort_rec_t
+merge_next(struct sort_merge *merge) {
+	struct sort_run *run;
+	sort_rec_t rec;
+
+	if (merge->nheap == 0)
+		return (NULL);
+	run = &merge->runs[merge->heap[0]];
+	rec = run->head;
+	run->head = sort_rec_read(run->f);
+	if (run->head == NULL)
+		merge->heap[0] = merge->heap[--merge->nheap];
+	merge_down(merge, 0);
+	return (rec);
+}
+
+/* merge_down -- restore the heap below position i, whose run's head may now
+ * be greater than those of its children.
+ */
+static void
+merge_down(struct sort_merge *merge, size_t i) {
+	size_t *heap = merge->heap, n = merge->nheap;
+
+	for (;;) {
+		size_t least = i, l = 2 * i + 1, r = l + 1, t;
+
+		if (l < n && sort_cmp(merge->runs[heap[l]].head,
+				      merge->runs[heap[least]].head) < 0)
+			least = l;
+		if (r < n && sort_cmp(merge->runs[heap[r]].head,
+				      merge->runs[heap[least]].head) < 0)
+			least = r;
+		if (least == i)
+			return;
+		t = heap[i];
+		heap[i] = heap[least];
+		heap[least] = t;
+		i = least;
+	}
+}
+
+/* sorter_next -- return the json text of the next record in sorted order,
+ * or NULL when there are no more. duplicates (as -u) are suppressed.
+ *
+ * the first call ends input. the returned text stays valid until the
+ * next call, or sorter_free().
+ */
+const char *
+sorter_next(sorter_t sorter, size_t *len) {
+	sort_rec_t rec;
+
+	if (!sorter->ready) {
+		sorter->ready = true;
+		if (sorter->nruns == 0) {
+			qsort(sorter->recs, sorter->nrecs,
+			      sizeof *sorter->recs, sort_qcmp);
+		} else {
+			if (sorter->nrecs != 0)
+				sorter_spill(sorter);
+			merge_init(&sorter->merge, sorter->runs,
+				   sorter->nruns);
+		}
+		DEBUG(1, true, "sorter: %zu recs added, %zu key octets each, "
+		      "merging %zu runs\n",
+		      sorter->added, sorter->added == 0 ? 0
+		      : sorter->key_octets / sorter->added,
+		      sorter->nruns);
+	}
+
+	if (sorter->nruns == 0) {
+		/* everything fit in memory. */
+		while (sorter->next < sorter->nrecs) {
+			rec = sorter->recs[sorter->next++];
+			if (sorter->prev == NULL ||
+			    sort_cmp(sorter->prev, rec) != 0)
+			{
+				sorter->prev = rec;
+				return (sort_json(rec, len));
+			}
+		}
+		return (NULL);
+	}
+
+	/* k-way merge of the runs that are left. */
+	while ((rec = merge_next(&sorter->merge)) != NULL) {
+		if (sorter->prev != NULL && sort_cmp(sorter->prev, rec) == 0) {
+			DESTROY(rec);
+			continue;
+		}
+		DESTROY(sorter->prev);
+		sorter->prev = rec;
+		return (sort_json(rec, len));
+	}
+	return (NULL);
+}
+
+/* sorter_free -- release a sorter and everything it holds.
+ */
+void
+sorter_free(sorter_t sorter) {
+	size_t i;
+
+	/* in memory, prev is one of recs[]; when merging, it is not. */
+	for (i = 0; i < sorter->nrecs; i++)
+		DESTROY(sorter->recs[i]);
+	if (sorter->nruns != 0)
+		DESTROY(sorter->prev);
+	for (i = 0; i < sorter->nruns; i++) {
+		DESTROY(sorter->runs[i].head);
+		fclose(sorter->runs[i].f);
+	}
+	DESTROY(sorter->merge.heap);
+	DESTROY(sorter->runs);
+	DESTROY(sorter->recs);
+	DESTROY(sorter->set);
+	DESTROY(sorter);
+}
+
+/* sortable_key -- lay out the sort key of one record, for memcmp().
+ *
+ * first, last and count are each eight octets, big-endian. a name key
+ * is followed by the data, and both end the key: a sort(1) key with no
+ * end field ran to the end of the line, so nothing after it was ever
+ * consulted, and only the json (kept beside the key) breaks a tie.
+ */
+static void
+sortable_key(sortbuf_t buf, pdns_tuple_ct tup, u_long first, u_long last) {
+	int n;
+
+	for (n = 0; n < nkeys; n++) {
+		switch (keys[n].field) {
+		case sk_first:
+			sortable_u64(buf, first);
+			break;
+		case sk_last:
+			sortable_u64(buf, last);
+			break;
+		case sk_count:
+			sortable_u64(buf, (uint64_t)tup->count);
+			break;
+		case sk_name: {
+			static const u_char end = SK_END;
+
+			sortable_dnsname(buf, tup->rrname);
+			sortable_put(buf, &end, sizeof end);
+		    }
+			/* FALLTHROUGH */
+		case sk_data:
+			sortable_rdata(buf, tup);
+			return;
+		default:
+			abort();
+		}
+	}
+}
+
+/* sortable_rdata -- append the sortable rendition of an RR data set.
+ */
+static void
+sortable_rdata(sortbuf_t buf, pdns_tuple_ct tup) {
+	const char *rrtype = tup->rrtype != NULL ? tup->rrtype : "";
+
+	if (tup->rdatas != NULL) {
+		size_t slot;
+
+		for (slot = 0; slot < tup->nrdatas; slot++) {
+			if (tup->rdatas[slot] != NULL)
+				sortable_rdatum(buf, rrtype,
+						tup->rdatas[slot]);
 			else
 				fprintf(stderr,
 					"%s: warning: rdata slot "
 					"is not a string\n",
 					program_name);
 		}
-	} else {
-		sortable_rdatum(&buf, tup->rrtype, tup->rdata);
+	} else if (tup->rdata != NULL) {
+		sortable_rdatum(buf, rrtype, tup->rdata);
 	}
-	buf.base = realloc(buf.base, buf.size+1);
-	buf.base[buf.size++] = '\0';
-	return (buf.base);
 }
 
-/* sortable_rdatum -- called only by sortable_rdata(), realloc and normalize.
+/* sortable_rdatum -- called only by sortable_rdata(), to normalize one.
  *
- * this converts (lossily) addresses into hex strings, and extracts the
- * server-name component of a few other types like MX. all other rdata
- * are left in their normal string form, because it's hard to know what
- * to sort by with something like TXT, and extracting the serial number
- * from an SOA using a language like C is a bit ugly.
+ * this converts (lossily) addresses into their network octets, and
+ * extracts the server-name component of a few other types like MX. all
+ * other rdata are left in their normal string form, because it's hard to
+ * know what to sort by with something like TXT, and extracting the serial
+ * number from an SOA using a language like C is a bit ugly.
  */
-void
+static void
 sortable_rdatum(sortbuf_t buf, const char *rrtype, const char *rdatum) {
 	if (strcmp(rrtype, "A") == 0) {
 		u_char a[4];
 
 		if (inet_pton(AF_INET, rdatum, a) != 1)
 			memset(a, 0, sizeof a);
-		sortable_hexify(buf, a, sizeof a);
+		sortable_octets(buf, a, sizeof a);
 	} else if (strcmp(rrtype, "AAAA") == 0) {
 		u_char aaaa[16];
 
 		if (inet_pton(AF_INET6, rdatum, aaaa) != 1)
 			memset(aaaa, 0, sizeof aaaa);
-		sortable_hexify(buf, aaaa, sizeof aaaa);
+		sortable_octets(buf, aaaa, sizeof aaaa);
 	} else if (strcmp(rrtype, "NS") == 0 ||
 		   strcmp(rrtype, "PTR") == 0 ||
 		   strcmp(rrtype, "CNAME") == 0)
@@ -216,86 +818,98 @@ sortable_rdatum(sortbuf_t buf, const char *rrtype, const char *rdatum) {
 		if (space != NULL)
 			sortable_dnsname(buf, space+1);
 		else
-			sortable_hexify(buf, (const u_char *)rdatum,
-					strlen(rdatum));
+			sortable_octets(buf, rdatum, strlen(rdatum));
 	} else {
-		sortable_hexify(buf, (const u_char *)rdatum, strlen(rdatum));
-	}
-}
-
-/* sortable_hexify -- convert src into hex string in buffer
- */
-void
-sortable_hexify(sortbuf_t buf, const u_char *src, size_t len) {
-	size_t i;
-
-	buf->base = realloc(buf->base, buf->size + len*2);
-	for (i = 0; i < len; i++) {
-		const char hex[] = "0123456789abcdef";
-		unsigned int ch = src[i];
-
-		buf->base[buf->size++] = hex[ch >> 4];
-		buf->base[buf->size++] = hex[ch & 0xf];
+		sortable_octets(buf, rdatum, strlen(rdatum));
 	}
 }
 
-/* sortable_dnsname -- make a sortable dns name; destructive and lossy.
+/* sortable_dnsname -- append a sortable dns name; lossy.
  *
  * to be lexicographically sortable, a dnsname has to be converted to
- * TLD-first, all uppercase letters must be converted to lower case,
- * and all characters except dots then converted to hexadecimal. this
- * transformation is for POSIX sort's use, and is irreversibly lossy.
+ * TLD-first, and all uppercase letters must be converted to lower case.
+ * the labels are separated by SK_DOT, which orders a name before all
+ * those below it ("com.example" before "com.example.www"); a trailing
+ * dot becomes a leading one, and so does the root, whose name is empty.
+ * a NULL name is taken to be the root.
  */
-void
+static void
 sortable_dnsname(sortbuf_t buf, const char *name) {
-	const char hex[] = "0123456789abcdef";
-	size_t len, new_size;
-	unsigned int dots;
-	signed int m, n;
-	char *p;
-
-	/* to avoid calling realloc() on every label, count the dots. */
-	for (dots = 0, len = 0; name[len] != '\0'; len++) {
-		if (name[len] == '.')
-			dots++;
-	}
+	static const u_char dot = SK_DOT;
+	size_t len = name != NULL ? strlen(name) : 0, end = len, m, i;
 
-	/* collatable names are TLD-first, all lower case. */
-	new_size = buf->size + len*2 - (size_t)dots;
-	assert(new_size != 0);
-	if (new_size != buf->size)
-		buf->base = realloc(buf->base, new_size);
-	p = buf->base + buf->size;
-	for (m = (int)len - 1, n = m; m >= 0; m--) {
+	for (m = len; m > 0; m--) {
 		/* note: actual presentation form names can have \. and \\,
-		 * but we are destructive and lossy, and will ignore that.
+		 * but we are lossy, and will ignore that.
 		 */
-		if (name[m] == '.') {
-			int i;
+		if (name[m - 1] == '.') {
+			for (i = m; i < end; i++) {
+				u_char ch = (u_char)tolower((u_char)name[i]);
 
-			for (i = m+1; i <= n; i++) {
-				int ch = tolower(name[i]);
-				*p++ = hex[ch >> 4];
-				*p++ = hex[ch & 0xf];
+				sortable_octets(buf, &ch, 1);
 			}
-			*p++ = '.';
-			n = m-1;
+			sortable_put(buf, &dot, 1);
+			end = m - 1;
 		}
 	}
-	assert(m == -1);
-	/* first label remains after loop. */
-	for (m = 0; m <= n; m++) {
-		int ch = tolower(name[m]);
-		*p++ = hex[ch >> 4];
-		*p++ = hex[ch & 0xf];
+	/* the first label remains. */
+	for (i = 0; i < end; i++) {
+		u_char ch = (u_char)tolower((u_char)name[i]);
+
+		sortable_octets(buf, &ch, 1);
+	}
+	if (len == 0)
+		sortable_put(buf, &dot, 1);
+}
+
+/* sortable_octets -- append octets as key tokens, escaping any which
+ * would be taken for SK_END, SK_DOT or SK_ESC.
+ */
+static void
+sortable_octets(sortbuf_t buf, const void *src, size_t len) {
+	const u_char *p = src;
+	u_char *q;
+	size_t i;
+
+	sortable_put(buf, NULL, 2 * len);
+	q = buf->base + buf->size;
+	for (i = 0; i < len; i++) {
+		if (p[i] <= SK_ESC)
+			*q++ = SK_ESC;
+		*q++ = p[i];
+	}
+	buf->size = (size_t)(q - buf->base);
+}
+
+/* sortable_u64 -- append a number as eight octets, most significant first.
+ */
+static void
+sortable_u64(sortbuf_t buf, uint64_t val) {
+	u_char octets[8];
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		octets[i] = (u_char)val;
+		val >>= 8;
+	}
+	sortable_put(buf, octets, sizeof octets);
+}
+
+/* sortable_put -- append len octets from src, or with a NULL src, just
+ * make room for that many (without counting them as used).
+ */
+static void
+sortable_put(sortbuf_t buf, const void *src, size_t len) {
+	if (buf->size + len > buf->alloc) {
+		buf->alloc = buf->alloc == 0 ? 64 : buf->alloc * 2;
+		if (buf->alloc < buf->size + len)
+			buf->alloc = buf->size + len;
+		buf->base = realloc(buf->base, buf->alloc);
+		if (buf->base == NULL)
+			my_panic(true, "realloc");
 	}
-	buf->size = (size_t)(p - buf->base);
-	assert(buf->size == new_size);
-	/* if no characters were written, it's the empty string,
-	 * meaning the dns root zone.
-	 */
-	if (len == 0) {
-		buf->base = realloc(buf->base, buf->size + 1);
-		buf->base[buf->size++] = '.';
+	if (src != NULL) {
+		memcpy(buf->base + buf->size, src, len);
+		buf->size += len;
 	}
 }
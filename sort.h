@@ -18,27 +18,32 @@
 #define SORT_H_INCLUDED 1
 
 #include <sys/types.h>
+#include <stdio.h>
 
 #include "pdns.h"
 
-struct sortbuf { char *base; size_t size; };
-typedef struct sortbuf *sortbuf_t;
+typedef enum { sk_first, sk_last, sk_count, sk_name, sk_data } sortfield_e;
 
-struct sortkey { char *specified, *computed; };
+struct sortkey { char *specified; sortfield_e field; };
 typedef struct sortkey *sortkey_t;
 typedef const struct sortkey *sortkey_ct;
 
 typedef enum { no_sort = 0, normal_sort, reverse_sort } sort_e;
 
+typedef struct sort_rec *sort_rec_t;
+typedef const struct sort_rec *sort_rec_ct;
+typedef struct sorter *sorter_t;
+
 const char *add_sort_key(const char *);
 sortkey_ct find_sort_key(const char *);
 void sort_ready(void);
 void sort_destroy(void);
-__attribute__((noreturn)) void exec_sort(int p1[], int p2[]);
-char *sortable_rrname(pdns_tuple_ct);
-char *sortable_rdata(pdns_tuple_ct);
-void sortable_rdatum(sortbuf_t, const char *, const char *);
-void sortable_dnsname(sortbuf_t, const char *);
-void sortable_hexify(sortbuf_t, const u_char *, size_t);
+sort_rec_t sort_rec_make(pdns_tuple_ct, u_long, u_long, const char *, size_t);
+void sort_rec_write(FILE *, sort_rec_ct);
+sorter_t sorter_new(size_t);
+void sorter_add(sorter_t, sort_rec_t);
+void sorter_load(sorter_t, const char *, size_t);
+const char *sorter_next(sorter_t, size_t *);
+void sorter_free(sorter_t);
 
 #endif /*SORT_H_INCLUDED*/
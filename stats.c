@@ -0,0 +1,242 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* per-fetch network timing and per-query record counts, for -T. each
+ * fetch is recorded just before it is reaped (while its easy handle can
+ * still be asked how it went) and each query as its writer closes; the
+ * whole lot goes to stderr as one JSON object, at exit.
+ */
+
+#include <sys/time.h>
+
+#include <jansson.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defs.h"
+#include "netio.h"
+#include "stats.h"
+#include "globals.h"
+
+static json_t *stats_fetches = NULL, *stats_queries = NULL;
+static struct record_stats stats_records;
+static json_int_t stats_bytes = 0, stats_total_max = 0, stats_total_sum = 0;
+static json_int_t stats_ttfb_max = 0, stats_ttfb_sum = 0;
+static u_long stats_cached = 0, stats_live = 0;
+
+static json_int_t stats_time(CURL *, CURLINFO, CURLINFO);
+static json_t *stats_array(json_t **);
+static void stats_set(json_t *, const char *, json_int_t);
+
+/* stats_fetch -- record how a live fetch went.
+ */
+void
+stats_fetch(fetch_t fetch, CURLcode result) {
+	json_int_t dns, connect, tls, ttfb, total;
+	long rcode = 0;
+	double bytes = 0.0;
+	json_t *fj;
+
+	if (!timing_stats || fetch->easy == NULL)
+		return;
+#if CURL_AT_LEAST_VERSION(7,61,0)
+	dns = stats_time(fetch->easy, CURLINFO_NAMELOOKUP_TIME_T,
+			 CURLINFO_NAMELOOKUP_TIME);
+	connect = stats_time(fetch->easy, CURLINFO_CONNECT_TIME_T,
+			     CURLINFO_CONNECT_TIME);
+	tls = stats_time(fetch->easy, CURLINFO_APPCONNECT_TIME_T,
+			 CURLINFO_APPCONNECT_TIME);
+	ttfb = stats_time(fetch->easy, CURLINFO_STARTTRANSFER_TIME_T,
+			  CURLINFO_STARTTRANSFER_TIME);
+	total = stats_time(fetch->easy, CURLINFO_TOTAL_TIME_T,
+			   CURLINFO_TOTAL_TIME);
+#else
+	dns = stats_time(fetch->easy, 0, CURLINFO_NAMELOOKUP_TIME);
+	connect = stats_time(fetch->easy, 0, CURLINFO_CONNECT_TIME);
+	tls = stats_time(fetch->easy, 0, CURLINFO_APPCONNECT_TIME);
+	ttfb = stats_time(fetch->easy, 0, CURLINFO_STARTTRANSFER_TIME);
+	total = stats_time(fetch->easy, 0, CURLINFO_TOTAL_TIME);
+#endif /* CURL_AT_LEAST_VERSION */
+#if CURL_AT_LEAST_VERSION(7,55,0)
+	{
+		curl_off_t size = 0;
+
+		curl_easy_getinfo(fetch->easy, CURLINFO_SIZE_DOWNLOAD_T,
+				  &size);
+		bytes = (double)size;
+	}
+#else
+	curl_easy_getinfo(fetch->easy, CURLINFO_SIZE_DOWNLOAD, &bytes);
+#endif /* CURL_AT_LEAST_VERSION */
+	curl_easy_getinfo(fetch->easy, CURLINFO_RESPONSE_CODE, &rcode);
+
+	fj = json_object();
+	json_object_set_new(fj, "query",
+			    json_string(or_else(fetch->query->command, "")));
+	json_object_set_new(fj, "url", json_string(fetch->url));
+	json_object_set_new(fj, "source", json_string("network"));
+	stats_set(fj, "rcode", rcode);
+	stats_set(fj, "curl_result", result);
+	stats_set(fj, "stopped", fetch->stopped);
+	stats_set(fj, "dns_us", dns);
+	stats_set(fj, "connect_us", connect);
+	stats_set(fj, "tls_us", tls);
+	stats_set(fj, "ttfb_us", ttfb);
+	stats_set(fj, "total_us", total);
+	stats_set(fj, "bytes", (json_int_t)bytes);
+	json_array_append_new(stats_array(&stats_fetches), fj);
+	stats_live++;
+	stats_bytes += (json_int_t)bytes;
+	stats_ttfb_sum += ttfb;
+	stats_total_sum += total;
+	if (ttfb > stats_ttfb_max)
+		stats_ttfb_max = ttfb;
+	if (total > stats_total_max)
+		stats_total_max = total;
+}
+
+/* stats_replay -- record a fetch answered from the cache or a capture.
+ */
+void
+stats_replay(fetch_t fetch, size_t bytes) {
+	json_t *fj;
+
+	if (!timing_stats)
+		return;
+	fj = json_object();
+	json_object_set_new(fj, "query",
+			    json_string(or_else(fetch->query->command, "")));
+	json_object_set_new(fj, "url", json_string(fetch->url));
+	json_object_set_new(fj, "source",
+			    json_string(fetch->replay != NULL
+					? "capture" : "cache"));
+	stats_set(fj, "bytes", (json_int_t)bytes);
+	json_array_append_new(stats_array(&stats_fetches), fj);
+	stats_cached++;
+	stats_bytes += (json_int_t)bytes;
+}
+
+/* stats_query -- record what became of a query's records.
+ */
+void
+stats_query(query_t query) {
+	json_t *qj;
+
+	if (!timing_stats)
+		return;
+	qj = json_object();
+	json_object_set_new(qj, "query",
+			    json_string(or_else(query->command, "")));
+	json_object_set_new(qj, "status",
+			    json_string(or_else(query->status, "NOERROR")));
+	json_object_set_new(qj, "message",
+			    json_string(or_else(query->message, "no error")));
+	stats_set(qj, "parsed", (json_int_t)query->stats.parsed);
+	stats_set(qj, "filtered", (json_int_t)query->stats.filtered);
+	stats_set(qj, "emitted", (json_int_t)query->stats.emitted);
+	json_array_append_new(stats_array(&stats_queries), qj);
+	stats_records_add(&stats_records, &query->stats);
+}
+
+/* stats_records_add -- add one set of record counts to another.
+ */
+void
+stats_records_add(struct record_stats *to, const struct record_stats *from) {
+	to->parsed += from->parsed;
+	to->filtered += from->filtered;
+	to->emitted += from->emitted;
+}
+
+/* stats_report -- write out everything recorded, as one JSON object.
+ */
+void
+stats_report(void) {
+	struct timeval now;
+	json_t *report, *totals;
+	json_int_t elapsed;
+	char *text;
+
+	if (!timing_stats)
+		return;
+	gettimeofday(&now, NULL);
+	elapsed = (json_int_t)(now.tv_sec - startup_time.tv_sec) * 1000000 +
+		(now.tv_usec - startup_time.tv_usec);
+	totals = json_object();
+	stats_set(totals, "fetches", (json_int_t)(stats_live + stats_cached));
+	stats_set(totals, "cached", (json_int_t)stats_cached);
+	stats_set(totals, "bytes", stats_bytes);
+	if (stats_live != 0) {
+		stats_set(totals, "ttfb_us_max", stats_ttfb_max);
+		stats_set(totals, "ttfb_us_mean",
+			  stats_ttfb_sum / (json_int_t)stats_live);
+		stats_set(totals, "total_us_max", stats_total_max);
+		stats_set(totals, "total_us_mean",
+			  stats_total_sum / (json_int_t)stats_live);
+	}
+	stats_set(totals, "queries",
+		  (json_int_t)json_array_size(stats_array(&stats_queries)));
+	stats_set(totals, "parsed", (json_int_t)stats_records.parsed);
+	stats_set(totals, "filtered", (json_int_t)stats_records.filtered);
+	stats_set(totals, "emitted", (json_int_t)stats_records.emitted);
+
+	report = json_object();
+	stats_set(report, "elapsed_us", elapsed);
+	json_object_set_new(report, "totals", totals);
+	json_object_set_new(report, "fetches", stats_array(&stats_fetches));
+	json_object_set_new(report, "queries", stats_array(&stats_queries));
+	text = json_dumps(report, JSON_COMPACT);
+	if (text != NULL) {
+		fprintf(stderr, "%s\n", text);
+		free(text);
+	}
+	json_decref(report);
+	stats_fetches = stats_queries = NULL;
+}
+
+/* stats_time -- ask an easy handle for one of its times, in microseconds.
+ */
+static json_int_t
+stats_time(CURL *easy, CURLINFO info_t, CURLINFO info) {
+#if CURL_AT_LEAST_VERSION(7,61,0)
+	curl_off_t us = 0;
+
+	(void) info;
+	curl_easy_getinfo(easy, info_t, &us);
+	return (json_int_t)us;
+#else
+	double secs = 0.0;
+
+	(void) info_t;
+	curl_easy_getinfo(easy, info, &secs);
+	return (json_int_t)(secs * 1e6);
+#endif /* CURL_AT_LEAST_VERSION */
+}
+
+/* stats_array -- the given array, made if need be.
+ */
+static json_t *
+stats_array(json_t **arrayp) {
+	if (*arrayp == NULL)
+		*arrayp = json_array();
+	return (*arrayp);
+}
+
+/* stats_set -- set an integer member of an object.
+ */
+static void
+stats_set(json_t *obj, const char *key, json_int_t value) {
+	json_object_set_new(obj, key, json_integer(value));
+}
@@ -0,0 +1,30 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATS_H_INCLUDED
+#define STATS_H_INCLUDED 1
+
+#include <curl/curl.h>
+
+#include "netio.h"
+
+void stats_fetch(fetch_t, CURLcode);
+void stats_replay(fetch_t, size_t);
+void stats_query(query_t);
+void stats_records_add(struct record_stats *, const struct record_stats *);
+void stats_report(void);
+
+#endif /*STATS_H_INCLUDED*/
@@ -20,6 +20,7 @@
 
 #include <sys/types.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -29,6 +30,17 @@
 #include "globals.h"
 #include "ns_ttl.h"
 
+#define TIME_DAY (24UL * 60UL * 60UL)
+#define TIME_MAX 253402300799UL		/* 9999-12-31 23:59:59 */
+#define TIME_DAYS 64
+
+/* one day's formatted date, in time_fmt()'s cache. */
+struct time_day {
+	u_long		day;		// days since the epoch
+	size_t		len;		// zero if unused
+	char		date[sizeof "yyyy-mm-dd"];
+};
+
 /* time_cmp -- compare two absolute timestamps, give -1, 0, or 1.
  */
 int
@@ -40,20 +52,72 @@ time_cmp(u_long a, u_long b) {
 	return (0);
 }
 
-/* time_str -- format one (possibly relative) timestamp (returns static string)
+/* time_fmt -- format one timestamp into a buffer of TIME_BUFSIZ octets,
+ * as "%F %T" or ISO8601 "%FT%TZ". returns the length, not counting the NUL.
+ *
+ * timestamps in a result tend to fall on a few days, so the date part is
+ * kept in a small cache of days (per-thread, so that -J workers may share
+ * this), and only the time of day is worked out, by arithmetic.
  */
-const char *
-time_str(u_long x, bool iso8601fmt) {
-	static char ret[sizeof "yyyy-mm-ddThh:mm:ssZ"];
+size_t
+time_fmt(u_long x, bool iso8601fmt, char *buf) {
+	static __thread struct time_day days[TIME_DAYS];
+	u_long day = x / TIME_DAY, secs = x % TIME_DAY;
+	struct time_day *td = &days[day % TIME_DAYS];
+	char *p;
 
 	if (x == 0) {
-		strcpy(ret, "0");
-	} else {
+		strcpy(buf, "0");
+		return (1);
+	}
+	if (x > TIME_MAX) {
+		/* beyond 9999-12-31, leave it all to the C library. */
 		time_t t = (time_t)x;
 		struct tm result, *y = gmtime_r(&t, &result);
+		size_t len = 0;
+
+		if (y != NULL)
+			len = strftime(buf, TIME_BUFSIZ,
+				       iso8601fmt ? "%FT%TZ" : "%F %T", y);
+		if (len == 0)
+			len = (size_t)snprintf(buf, TIME_BUFSIZ, "%lu", x);
+		return (len);
+	}
+	if (td->len == 0 || td->day != day) {
+		time_t t = (time_t)(day * TIME_DAY);
+		struct tm result;
 
-		strftime(ret, sizeof ret, iso8601fmt ? "%FT%TZ" : "%F %T", y);
+		gmtime_r(&t, &result);
+		td->len = strftime(td->date, sizeof td->date, "%F", &result);
+		td->day = day;
 	}
+
+	memcpy(buf, td->date, td->len);
+	p = buf + td->len;
+	*p++ = iso8601fmt ? 'T' : ' ';
+	*p++ = (char)('0' + secs / 36000);
+	*p++ = (char)('0' + secs / 3600 % 10);
+	*p++ = ':';
+	*p++ = (char)('0' + secs / 600 % 6);
+	*p++ = (char)('0' + secs / 60 % 10);
+	*p++ = ':';
+	*p++ = (char)('0' + secs % 60 / 10);
+	*p++ = (char)('0' + secs % 10);
+	if (iso8601fmt)
+		*p++ = 'Z';
+	*p = '\0';
+	return ((size_t)(p - buf));
+}
+
+/* time_str -- format one (possibly relative) timestamp (returns static string)
+ *
+ * note: the static string is per-thread, so that -J workers may share this.
+ */
+const char *
+time_str(u_long x, bool iso8601fmt) {
+	static __thread char ret[TIME_BUFSIZ];
+
+	(void) time_fmt(x, iso8601fmt, ret);
 	return ret;
 }
 
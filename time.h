@@ -20,7 +20,11 @@
 #include <sys/types.h>
 #include <stdbool.h>
 
+/* room for any formatted timestamp, even one far outside 0000..9999. */
+#define TIME_BUFSIZ 32
+
 int time_cmp(u_long, u_long);
+size_t time_fmt(u_long, bool, char *);
 const char * time_str(u_long, bool);
 int time_get(const char *src, u_long *dst);
 